@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "emulator.h"
+#include "jit.h"
+#include "framebuffer.h"
+#include "profile.h"
+
+/* Benchmarks of the emulator. Micro-benchmarks time the functions of
+   emulator.h one at a time, macro-benchmarks run whole programs to HALT
+   with each engine (execute_step(), the interpreter of run(), the JIT and
+   the interpreter with a profile attached).
+
+   Results are printed as CSV, one line per benchmark:
+   kind,name,engine,operations,seconds,ns_per_op,ops_per_sec,peak_rss_kb
+   where operations are calls for micro-benchmarks and guest instructions
+   for macro-benchmarks. Each benchmark (each engine of a macro-benchmark)
+   runs in its own child process, so peak_rss_kb is the peak resident 
+   memory of that benchmark rather than of all those run before it.
+
+   Usage: bench [program.bin ...]    (default: circle.asm.bin) */
+
+#define MICRO_ITERATIONS 4000000
+#define STEP_SLOTS 1000000 // instructions per execute_step() benchmark, one slot each
+#define ALLOC_ITERATIONS 20
+#define FRAME_ITERATIONS 500 // full-screen conversions
+
+static double get_time_seconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs $call in a child process, whose peak RSS is then that of $call
+   alone. Runs it in this process if no child can be forked. */
+#define ISOLATED(call) do{ \
+    fflush(stdout); \
+    pid_t pid = fork(); \
+    if(pid == 0){ \
+        call; \
+        fflush(stdout); \
+        _exit(0); \
+    } \
+    if(pid < 0){ \
+        call; \
+    } \
+    else{ \
+        waitpid(pid, NULL, 0); \
+    } \
+} while(0)
+
+// Peak resident memory of this process, that of the benchmark in a child process
+static long peak_rss_kb(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void report(const char* kind, const char* name, const char* engine, uint64_t ops, double seconds){
+    printf("%s,%s,%s,%lu,%.6f,%.3f,%.0f,%ld\n", kind, name, engine, (unsigned long) ops, seconds,
+           (ops > 0) ? seconds * 1e9 / ops : 0.0, (seconds > 0) ? ops / seconds : 0.0, peak_rss_kb());
+    fflush(stdout);
+}
+
+/* Instruction encoding */
+
+enum{
+    R0 = 0, R1, R2, R3, R4, R5, R6,
+    BP = 27, LP = 28, SP = 29, R31 = 31
+};
+
+static int enc(int opcode, int rc, int ra, int rb_or_literal){
+    return (opcode << 26) | (rc << 21) | (ra << 16) | (rb_or_literal & 0xFFFF);
+}
+
+#define ADD(ra, rb, rc) enc(0x20, rc, ra, (rb) << 11)
+#define ADDC(ra, lit, rc) enc(0x30, rc, ra, lit)
+#define SUBC(ra, lit, rc) enc(0x31, rc, ra, lit)
+#define MULC(ra, lit, rc) enc(0x32, rc, ra, lit)
+#define SHLC(ra, lit, rc) enc(0x3C, rc, ra, lit)
+#define CMPLTC(ra, lit, rc) enc(0x35, rc, ra, lit)
+#define LD(ra, lit, rc) enc(0x18, rc, ra, lit)
+#define ST(rc, lit, ra) enc(0x19, rc, ra, lit)
+#define JMP(ra, rc) enc(0x1B, rc, ra, 0)
+#define BEQ(ra, offset, rc) enc(0x1D, rc, ra, offset)
+#define BNE(ra, offset, rc) enc(0x1E, rc, ra, offset)
+#define HALT() 0
+
+// Small assembler writing directly into the program memory of a computer
+typedef struct{
+    Computer* c;
+    long pc;
+} Assembler;
+
+static void emit(Assembler* a, int instruction){
+    store_word(a->c, a->pc, instruction);
+    a->pc += 4;
+}
+
+// Offset of a branch at the current position to $target
+static int offset_to(Assembler* a, long target){
+    return (target - (a->pc + 4)) / 4;
+}
+
+// Loads a positive 31-bit constant into $rc, as CMOVE() does for 16-bit ones
+static void emit_constant(Assembler* a, int value, int rc){
+    int low = (short) (value & 0xFFFF); // sign-extended by ADDC
+    emit(a, ADDC(R31, (value - low) >> 16, rc));
+    emit(a, SHLC(rc, 16, rc));
+    emit(a, ADDC(rc, low, rc));
+}
+
+static void emit_push(Assembler* a, int r){ emit(a, ADDC(SP, 4, SP)); emit(a, ST(r, -4, SP)); }
+static void emit_pop(Assembler* a, int r){ emit(a, LD(SP, -4, r)); emit(a, ADDC(SP, -4, SP)); }
+static void emit_move(Assembler* a, int ra, int rc){ emit(a, ADD(ra, R31, rc)); }
+
+static void new_computer(Computer* c, const char* engine){
+    init_computer(c, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+    if(strcmp(engine, "jit") == 0){
+        jit_attach(c);
+    }
+    else if(strcmp(engine, "profile") == 0){
+        profile_attach(c);
+    }
+}
+
+/* Micro-benchmarks */
+
+static volatile int sink; // keeps results alive
+
+static void bench_memory(){
+    static Computer c;
+    new_computer(&c, "interpret");
+
+    // Pseudo-random word-aligned addresses in program memory, precomputed
+    long* addrs = malloc(sizeof(long) * 4096);
+    unsigned seed = 12345;
+    for(int i = 0; i < 4096; i++){
+        seed = seed * 1103515245 + 12345;
+        addrs[i] = (seed % (PROGRAM_MEMORY_SZ / 4)) * 4;
+    }
+
+    double start = get_time_seconds();
+    int acc = 0;
+    for(long i = 0; i < MICRO_ITERATIONS; i++){
+        acc += get_word(&c, addrs[i & 4095]);
+    }
+    report("micro", "get_word", "-", MICRO_ITERATIONS, get_time_seconds() - start);
+    sink = acc;
+
+    start = get_time_seconds();
+    for(long i = 0; i < MICRO_ITERATIONS; i++){
+        store_word(&c, addrs[i & 4095], (int) i);
+    }
+    report("micro", "store_word", "-", MICRO_ITERATIONS, get_time_seconds() - start);
+
+    free(addrs);
+    free_computer(&c);
+}
+
+/* Times execute_step() on STEP_SLOTS copies of $instruction, executed
+   from address 0 (or always at address 0 for jumps back to it). */
+static void bench_step(const char* name, int instruction){
+    static Computer c;
+    new_computer(&c, "step");
+
+    for(long addr = 0; addr < STEP_SLOTS * 4; addr += 4){
+        store_word(&c, addr, instruction);
+    }
+    c.cpu.registers[R1] = 7;
+    c.cpu.registers[R2] = 3;
+    c.cpu.registers[R3] = STEP_SLOTS * 4 + 4096; // data, after the code
+
+    // First pass decodes the instructions, the second one is timed
+    for(int pass = 0; pass < 2; pass++){
+        c.cpu.program_counter = 0;
+        double start = get_time_seconds();
+        for(long i = 0; i < STEP_SLOTS; i++){
+            execute_step(&c);
+        }
+        if(pass == 1){
+            report("micro", name, "step", STEP_SLOTS, get_time_seconds() - start);
+        }
+    }
+
+    free_computer(&c);
+}
+
+static void bench_disassemble(){
+    char buf[64];
+    unsigned seed = 42;
+    int instructions[256];
+
+    static const int opcodes[] = {0x00, 0x18, 0x19, 0x1B, 0x1D, 0x1E, 0x1F, 0x20, 0x24, 0x2C, 0x30, 0x35, 0x3E};
+    for(int i = 0; i < 256; i++){
+        seed = seed * 1103515245 + 12345;
+        instructions[i] = (opcodes[i % 13] << 26) | (seed & 0x3FFFFFF);
+    }
+
+    double start = get_time_seconds();
+    int acc = 0;
+    for(long i = 0; i < MICRO_ITERATIONS / 4; i++){
+        acc += disassemble(instructions[i & 255], buf);
+    }
+    report("micro", "disassemble", "-", MICRO_ITERATIONS / 4, get_time_seconds() - start);
+    sink = acc;
+
+    // The same instructions listed by disassemble_range(), operations are instructions
+    static Computer c;
+    new_computer(&c, "interpret");
+    for(long addr = 0; addr < 4 * 65536; addr += 4){
+        store_word(&c, addr, instructions[(addr / 4) & 255]);
+    }
+
+    Disassembly d;
+    init_disassembly(&d, true);
+    start = get_time_seconds();
+    long rounds = MICRO_ITERATIONS / 4 / 65536;
+    for(long i = 0; i < rounds; i++){
+        acc += disassemble_range(&c, 0, 4 * 65536, &d);
+    }
+    report("micro", "disassemble_range", "-", rounds * 65536, get_time_seconds() - start);
+    sink = acc;
+
+    free_disassembly(&d);
+    free_computer(&c);
+}
+
+static void bench_init_computer(){
+    static Computer c;
+
+    double start = get_time_seconds();
+    for(int i = 0; i < ALLOC_ITERATIONS; i++){
+        init_computer(&c, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+        free_computer(&c);
+    }
+    report("micro", "init_computer", "-", ALLOC_ITERATIONS, get_time_seconds() - start);
+}
+
+static void bench_load(){
+    static Computer c;
+    init_computer(&c, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+
+    // A 1 MiB program in a temporary file
+    FILE* fp = tmpfile();
+    if(fp == NULL){
+        free_computer(&c);
+        return;
+    }
+    for(int i = 0; i < (1 << 18); i++){
+        int word = ADDC(R1, i, R1);
+        fwrite(&word, sizeof(word), 1, fp);
+    }
+
+    double start = get_time_seconds();
+    for(int i = 0; i < ALLOC_ITERATIONS; i++){
+        if(load(&c, fp) != LOAD_OK){
+            break;
+        }
+    }
+    report("micro", "load_1MiB", "-", ALLOC_ITERATIONS, get_time_seconds() - start);
+
+    fclose(fp);
+    free_computer(&c);
+}
+
+// Converts the whole screen, operations are pixels
+static void bench_framebuffer(){
+    int width, height;
+    framebuffer_dimensions(VIDEO_MEMORY_SZ, &width, &height);
+    size_t pixels = (size_t) width * height;
+
+    char* video = malloc(pixels * 4);
+    unsigned char* out = malloc(pixels * 4);
+    if(video == NULL || out == NULL){
+        free(video);
+        free(out);
+        return;
+    }
+    for(size_t i = 0; i < pixels * 4; i++){
+        video[i] = i * 7;
+    }
+
+    double start = get_time_seconds();
+    for(int i = 0; i < FRAME_ITERATIONS; i++){
+        framebuffer_to_rgb(out, video, pixels);
+    }
+    report("micro", "frame_to_rgb", framebuffer_kernel_name(), FRAME_ITERATIONS * pixels, get_time_seconds() - start);
+
+    start = get_time_seconds();
+    for(int i = 0; i < FRAME_ITERATIONS; i++){
+        framebuffer_to_rgba(out, video, pixels);
+    }
+    report("micro", "frame_to_rgba", framebuffer_kernel_name(), FRAME_ITERATIONS * pixels, get_time_seconds() - start);
+
+    sink = out[pixels - 1];
+    free(video);
+    free(out);
+}
+
+/* Macro-benchmarks: synthetic kernels */
+
+// Counting loop: 3 instructions per iteration
+static void kernel_loop(Assembler* a){
+    emit_constant(a, 10000000, R1);
+    long loop = a->pc;
+    emit(a, ADD(R2, R1, R2));
+    emit(a, SUBC(R1, 1, R1));
+    emit(a, BNE(R1, offset_to(a, loop), R31));
+    emit(a, HALT());
+}
+
+// Copies 64 KiB 100 times, one word per iteration of the inner loop
+static void kernel_memcpy(Assembler* a){
+    const int src = 0x100000, dst = 0x200000, words = 16384;
+
+    for(int i = 0; i < 64; i++){ // some non-zero data
+        store_word(a->c, src + i * 1024, i * 0x01010101);
+    }
+
+    emit(a, ADDC(R31, 100, R6));
+    long outer = a->pc;
+    emit_constant(a, src, R3);
+    emit_constant(a, dst, R4);
+    emit_constant(a, words, R2);
+    long inner = a->pc;
+    emit(a, LD(R3, 0, R5));
+    emit(a, ST(R5, 0, R4));
+    emit(a, ADDC(R3, 4, R3));
+    emit(a, ADDC(R4, 4, R4));
+    emit(a, SUBC(R2, 1, R2));
+    emit(a, BNE(R2, offset_to(a, inner), R31));
+    emit(a, SUBC(R6, 1, R6));
+    emit(a, BNE(R6, offset_to(a, outer), R31));
+    emit(a, HALT());
+}
+
+// Recursive fib(25) with the calling convention of beta.uasm
+static void kernel_calls(Assembler* a){
+    emit_constant(a, 0x400000, SP);
+    emit(a, ADDC(R31, 25, R1));
+    long call = a->pc;
+    emit(a, BEQ(R31, 0, LP)); // patched below
+    emit(a, HALT());
+
+    long fib = a->pc;
+    store_word(a->c, call, BEQ(R31, (fib - (call + 4)) / 4, LP));
+
+    emit_push(a, LP);
+    emit_push(a, BP);
+    emit_move(a, SP, BP);
+    emit_push(a, R1);
+    emit_push(a, R2);
+    emit(a, CMPLTC(R1, 2, R0));
+    long to_rec = a->pc;
+    emit(a, BEQ(R0, 0, R31)); // patched below
+    emit_move(a, R1, R0);
+    long to_ret = a->pc;
+    emit(a, BEQ(R31, 0, R31)); // patched below
+
+    long rec = a->pc;
+    store_word(a->c, to_rec, BEQ(R0, (rec - (to_rec + 4)) / 4, R31));
+    emit(a, SUBC(R1, 1, R1));
+    emit(a, BEQ(R31, offset_to(a, fib), LP));
+    emit_move(a, R0, R2);
+    emit(a, SUBC(R1, 1, R1));
+    emit(a, BEQ(R31, offset_to(a, fib), LP));
+    emit(a, ADD(R0, R2, R0));
+
+    long ret = a->pc;
+    store_word(a->c, to_ret, BEQ(R31, (ret - (to_ret + 4)) / 4, R31));
+    emit_pop(a, R2);
+    emit_pop(a, R1);
+    emit_move(a, BP, SP);
+    emit_pop(a, BP);
+    emit_pop(a, LP);
+    emit(a, JMP(LP, R31));
+}
+
+// "profile" is the interpreter with a profile attached (see profile.h)
+#define NB_ENGINES 4
+static const char* engines[NB_ENGINES] = {"step", "interpret", "jit", "profile"};
+
+/* Runs the program loaded in $c to HALT with $engine and reports it,
+   $c is freed afterwards. */
+static void run_to_halt(Computer* c, const char* name, const char* engine){
+    StopConditions no_stop = {.on_interrupt = false, .breakpoint = -1};
+
+    double start = get_time_seconds();
+    if(strcmp(engine, "step") == 0){
+        do{
+            execute_step(c);
+        } while(!c->halted);
+    }
+    else{
+        while(run(c, 10000000, no_stop) != RUN_HALTED) ;
+    }
+    report("macro", name, engine, c->instructions, get_time_seconds() - start);
+
+    free_computer(c);
+}
+
+static void bench_kernel_engine(const char* name, void (*generate)(Assembler*), const char* engine){
+    static Computer c;
+
+    new_computer(&c, engine);
+    Assembler a = {&c, 0};
+    generate(&a);
+    c.program_size = a.pc;
+    run_to_halt(&c, name, engine);
+}
+
+static void bench_kernel(const char* name, void (*generate)(Assembler*)){
+    for(int e = 0; e < NB_ENGINES; e++){
+        ISOLATED(bench_kernel_engine(name, generate, engines[e]));
+    }
+}
+
+static void bench_program_engine(const char* path, const char* engine){
+    static Computer c;
+
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL){
+        fprintf(stderr, "Cannot open %s\n", path);
+        return;
+    }
+
+    new_computer(&c, engine);
+    LoadStatus status = load(&c, fp);
+    fclose(fp);
+    if(status != LOAD_OK){
+        fprintf(stderr, "Cannot load %s: %s\n", path, load_status_message(status));
+        free_computer(&c);
+        return;
+    }
+
+    fp = fopen("interrupt_handler.asm.bin", "rb");
+    load_interrupt_handler(&c, fp);
+    if(fp != NULL){
+        fclose(fp);
+    }
+
+    run_to_halt(&c, path, engine);
+}
+
+static void bench_program(const char* path){
+    for(int e = 0; e < NB_ENGINES; e++){
+        ISOLATED(bench_program_engine(path, engines[e]));
+    }
+}
+
+int main(int argc, char** argv){
+    printf("kind,name,engine,operations,seconds,ns_per_op,ops_per_sec,peak_rss_kb\n");
+
+    ISOLATED(bench_memory());
+    ISOLATED(bench_step("step_alu", ADD(R1, R2, R4)));
+    ISOLATED(bench_step("step_alu_literal", MULC(R1, 3, R4)));
+    ISOLATED(bench_step("step_load", LD(R3, 0, R4)));
+    ISOLATED(bench_step("step_store", ST(R1, 0, R3)));
+    ISOLATED(bench_step("step_branch", BEQ(R31, 0, R31))); // falls through to the next slot
+    ISOLATED(bench_step("step_jump", JMP(R31, R31))); // always at address 0
+    ISOLATED(bench_disassemble());
+    ISOLATED(bench_init_computer());
+    ISOLATED(bench_load());
+    ISOLATED(bench_framebuffer());
+
+    bench_kernel("loop", kernel_loop);
+    bench_kernel("memcpy", kernel_memcpy);
+    bench_kernel("calls", kernel_calls);
+
+    if(argc < 2){
+        bench_program("circle.asm.bin");
+    }
+    for(int i = 1; i < argc; i++){
+        bench_program(argv[i]);
+    }
+
+    return 0;
+}
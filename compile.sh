@@ -1,3 +1,19 @@
 #!/bin/bash
 
-gcc `pkg-config --cflags gtk4` *.c `pkg-config --libs gtk4` -lm -Wno-deprecated-declarations
+# GUI
+gcc `pkg-config --cflags gtk4` graphics.c emulator.c jit.c framebuffer.c profile.c trace.c history.c `pkg-config --libs gtk4` -lm -lz -Wno-deprecated-declarations
+
+# Headless command-line runner (no GTK needed)
+gcc -O2 headless.c emulator.c jit.c framebuffer.c profile.c trace.c history.c -o headless -lm -lpthread -lz
+
+# Benchmarks (CSV on stdout)
+gcc -O2 bench.c emulator.c jit.c framebuffer.c profile.c trace.c history.c -o bench -lm -lpthread -lz
+
+# Batch runner: many jobs on a pool of worker threads (CSV on stdout)
+gcc -O2 farm.c emulator.c jit.c profile.c trace.c history.c -o farm -lm -lpthread -lz
+
+# Execution trace reader (traces recorded with headless -T)
+gcc -O2 tracedump.c emulator.c jit.c profile.c trace.c history.c -o tracedump -lm -lpthread -lz
+
+# Trace round-trip test (exits with 0 if it passes)
+gcc -O2 trace_test.c emulator.c jit.c profile.c trace.c history.c -o trace_test -lm -lpthread -lz && ./trace_test
@@ -1,6 +1,20 @@
 #include "emulator.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
+#include "history.h"
 #include <assert.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Reserves $size bytes of zero-filled memory. Pages only get backed by 
+   physical memory when first touched, so a computer costs what its 
+   program actually uses rather than its full address space. */
+static void* allocate_zeroed(size_t size){
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (p == MAP_FAILED) ? NULL : p;
+}
 
 void init_computer(Computer* c, long program_memory_size, 
                                 long video_memory_size, long kernel_memory_size){
@@ -8,7 +22,7 @@ void init_computer(Computer* c, long program_memory_size,
     assert(c);
 
     c->memory_size = program_memory_size + video_memory_size + kernel_memory_size;
-    c->cpu.memory = (char *) malloc(c->memory_size * sizeof(char));
+    c->cpu.memory = (char *) allocate_zeroed(c->memory_size * sizeof(char));
     if(c->cpu.memory == NULL){
         exit(-1);
     }
@@ -23,12 +37,53 @@ void init_computer(Computer* c, long program_memory_size,
     c->cpu.kernel_memory = &c->cpu.memory[program_memory_size + video_memory_size];
 
     c->program_size = 0; // It's currently empty
+    c->handler_start = program_memory_size + video_memory_size + 400;
+    c->handler_size = 0;
 
     c->latest_accessed = 0;
 
-    c->cpu.interrupt_line = false;
+    c->cpu.program_counter = 0;
+    memset(c->cpu.registers, 0, sizeof(c->cpu.registers));
+
+    // Slots are decoded lazily, the untouched part of the table stays unallocated
+    c->cache_slots = c->memory_size / 4;
+    c->instruction_cache = (DecodedInstruction *) allocate_zeroed(c->cache_slots * sizeof(DecodedInstruction));
+    if(c->instruction_cache == NULL){
+        exit(-1);
+    }
+
+    c->jit = NULL;
+    c->profile = NULL;
+    c->trace = NULL;
+    c->history = NULL;
+
+    c->nb_pages = (c->memory_size + MEMORY_PAGE_SZ - 1) >> MEMORY_PAGE_SHIFT;
+    c->page_flags = (unsigned char *) allocate_zeroed(c->nb_pages);
+    if(c->page_flags == NULL){
+        exit(-1);
+    }
+    c->snapshot = NULL;
+
+    c->video_spans = (video_memory_size + (1 << VIDEO_SPAN_SHIFT) - 1) >> VIDEO_SPAN_SHIFT;
+    c->video_dirty = (uint64_t *) calloc((c->video_spans + 63) / 64, sizeof(uint64_t));
+    if(c->video_dirty == NULL){
+        exit(-1);
+    }
+
+    c->breakpoints = NULL;
+    c->nb_breakpoints = 0;
+    c->watchpoints = NULL;
+    c->nb_watchpoints = 0;
+    c->watch_hit = false;
+
+    c->cpu.interrupts.entries = NULL;
+    if(!set_interrupt_queue_depth(c, INTERRUPT_QUEUE_DEPTH)){
+        exit(-1);
+    }
+    atomic_init(&c->cpu.interrupts.overflows, 0);
 
     c->halted = false;
+    c->instructions = 0;
 }
 
 static int get_bits(int instruction, int i, int n){
@@ -36,44 +91,160 @@ static int get_bits(int instruction, int i, int n){
     return (mask & (instruction >> i));
 }
 
-int get_word(Computer* c, long addr){
-    if(addr > c->memory_size){
+// Dispatch index of invalid instructions, 0x3F is not an opcode of the Beta
+#define OP_INVALID 0x3F
+
+// Dispatch indexes of fused sequences of instructions (see fuse()), S is any register but R31
+enum{
+    OP_PUSH = 0x40, // ADDC(S, 4, S) ST(X, -4, S)
+    OP_PUSH_MOVE,   // PUSH(X) ADD(S, R31, Y)
+    OP_POP,         // LD(S, -4, X) ADDC(S, -4, S) or SUBC(S, 4, S)
+    OP_POP_JMP,     // POP(X) JMP(Y, Z)
+    OP_CMP_BRANCH,  // CMPxx(A, B, T) or CMPxxC(A, lit, T) followed by BEQ/BNE(T, label, L)
+    OP_BREAKPOINT = OP_CMP_BRANCH + 12, // instruction with a breakpoint, never part of a fused sequence
+    OP_COUNT
+};
+
+// Longest fused sequence, a slot can be covered by the fused entries of the slots before it
+#define FUSED_MAX_LENGTH 3
+
+// Little-endian 32-bit accesses to the host memory of the guest
+static inline int read_le32(const char* p){
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap32(word);
+#endif
+    return (int) word;
+}
+
+static inline void write_le32(char* p, int value){
+    uint32_t word = (uint32_t) value;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap32(word);
+#endif
+    memcpy(p, &word, sizeof(word));
+}
+
+// Slow path of get_word(), for words that are not entirely inside the memory
+static int get_partial_word(Computer* c, long addr){
+    if(addr < 0 || addr >= c->memory_size){
         return 0;
     }
 
-    if(addr+3 < c->memory_size){
-        return((unsigned char) (c->cpu.memory[addr]) |
-               (unsigned char) (c->cpu.memory[addr + 1]) << 8 |
-               (unsigned char) (c->cpu.memory[addr + 2]) << 16 |
-               (unsigned char) (c->cpu.memory[addr + 3]) << 24);
+    // If addr is found at the boundary of the computer, return only the valid bytes
+    int word = 0;
+    for(int i = 0; addr + i < c->memory_size; i++){
+        word |= (unsigned char) (c->cpu.memory[addr + i]) << (8 * i);
+    }
+    return word;
+}
+
+int get_word(Computer* c, long addr){
+    // A single unsigned comparison also rejects negative addresses
+    if((unsigned long) addr <= (unsigned long) (c->memory_size - 4)){
+        return read_le32(&c->cpu.memory[addr]);
     }
 
-    // If addr is found at the boundary of the computer, return only the valid bytes  
-    else if(addr+2 < c->memory_size){
-        return((unsigned char) (c->cpu.memory[addr]) |
-               (unsigned char) (c->cpu.memory[addr + 1]) << 8 |
-               (unsigned char) (c->cpu.memory[addr + 2]) << 16);
+    return get_partial_word(c, addr);
+}
+
+// PAGE_* flags of the pages holding bytes of the word at $addr
+static inline unsigned char word_page_flags(Computer* c, long addr){
+    // A single unsigned comparison also rejects negative addresses
+    if((unsigned long) addr <= (unsigned long) (c->memory_size - 4)){
+        return c->page_flags[addr >> MEMORY_PAGE_SHIFT] | c->page_flags[(addr + 3) >> MEMORY_PAGE_SHIFT];
     }
-    else if(addr+1 < c->memory_size){
-        return((unsigned char) (c->cpu.memory[addr]) |
-               (unsigned char) (c->cpu.memory[addr + 1]) << 8);
+
+    // Partial word at a boundary of the memory
+    long first = (addr < 0) ? 0 : addr;
+    long last = (addr + 3 >= c->memory_size) ? c->memory_size - 1 : addr + 3;
+    if(first > last){
+        return 0;
     }
-    else if(addr < c->memory_size){
-        return (unsigned char) (c->cpu.memory[addr]);
+    return c->page_flags[first >> MEMORY_PAGE_SHIFT] | c->page_flags[last >> MEMORY_PAGE_SHIFT];
+}
+
+// Slow path of load_word() and store_word(), for words on the pages of watchpoints
+static void check_watchpoints(Computer* c, long addr, int access){
+    for(int i = 0; i < c->nb_watchpoints; i++){
+        const Watchpoint* w = &c->watchpoints[i];
+        if((w->access & access) && addr < w->end && addr + 4 > w->start){
+            c->watch_hit = true;
+            c->watch_address = addr;
+            c->watch_access = access;
+            return;
+        }
     }
+}
 
+int load_word(Computer* c, long addr){
     c->latest_accessed = addr;
+    if(word_page_flags(c, addr) & PAGE_WATCH_READ){
+        check_watchpoints(c, addr, WATCH_READ);
+    }
+    return get_word(c, addr);
+}
 
-    return 0;
+static void invalidate_slot(Computer* c, long addr){
+    if(addr >= 0 && (addr >> 2) < c->cache_slots){
+        long index = addr >> 2;
+        DecodedInstruction* slot = &c->instruction_cache[index];
+        if(slot->handler == NULL && !slot->translated){
+            return; // Neither decoded nor translated (nor part of a fused sequence)
+        }
+        if(slot->translated){
+            jit_invalidate(c);
+        }
+        slot->handler = NULL;
+
+        // Sequences that include this slot fall back to their first instruction alone
+        for(long i = index - 1; i > index - FUSED_MAX_LENGTH && i >= 0; i--){
+            DecodedInstruction* prev = &c->instruction_cache[i];
+            if(prev->op >= OP_PUSH && prev->op != OP_BREAKPOINT){
+                prev->op = prev->opcode;
+            }
+        }
+    }
 }
 
-static void store_word(Computer* c, long addr, int word){
-    if(addr < c->memory_size){ c->cpu.memory[addr] = (word >> 0) & 0xFF; }
-    if(addr+1 < c->memory_size){ c->cpu.memory[addr+1] = (word >> 8) & 0xFF; }
-    if(addr+2 < c->memory_size){ c->cpu.memory[addr+2] = (word >> 16) & 0xFF; }
-    if(addr+3 < c->memory_size){ c->cpu.memory[addr+3] = (word >> 24) & 0xFF; }
+// Records that the byte at $addr (a valid address) was written
+static inline void mark_written(Computer* c, long addr){
+    c->page_flags[addr >> MEMORY_PAGE_SHIFT] |= PAGE_DIRTY | PAGE_CHANGED;
+
+    unsigned long offset = addr - c->program_memory_size;
+    if(offset < (unsigned long) c->video_memory_size){
+        long span = offset >> VIDEO_SPAN_SHIFT;
+        c->video_dirty[span / 64] |= (uint64_t) 1 << (span % 64);
+    }
+}
 
+void store_word(Computer* c, long addr, int word){
     c->latest_accessed = addr;
+    if(word_page_flags(c, addr) & PAGE_WATCH_WRITE){
+        check_watchpoints(c, addr, WATCH_WRITE);
+    }
+
+    if((unsigned long) addr <= (unsigned long) (c->memory_size - 4)){
+        write_le32(&c->cpu.memory[addr], word);
+        mark_written(c, addr);
+        mark_written(c, addr + 3);
+    }
+    else{
+        // Bytes that would fall past the end of the memory are dropped
+        for(int i = 0; i < 4; i++){
+            if(addr + i >= 0 && addr + i < c->memory_size){
+                c->cpu.memory[addr + i] = (word >> (8 * i)) & 0xFF;
+                mark_written(c, addr + i);
+            }
+        }
+    }
+
+    // An unaligned store overlaps two slots, both must be decoded again (self-modifying code)
+    invalidate_slot(c, addr);
+    if((addr & 3) != 0){
+        invalidate_slot(c, addr + 3);
+    }
 }
 
 int get_register(Computer* c, int reg){
@@ -84,41 +255,782 @@ int get_register(Computer* c, int reg){
     return c->cpu.registers[reg];
 }
 
+/* Saved state of a computer. Pages are copied lazily: a page that was
+   never written since init_computer() has no copy and is all zeros. */
+typedef struct Snapshot{
+    long program_counter;
+    int registers[32];
+    bool halted;
+    uint64_t instructions;
+    unsigned program_size;
+    long latest_accessed;
+    char** pages; // one copy of MEMORY_PAGE_SZ bytes per page of memory, or NULL
+} Snapshot;
+
+static void free_snapshot(Computer* c){
+    if(c->snapshot == NULL){
+        return;
+    }
+
+    for(long page = 0; page < c->nb_pages; page++){
+        free(c->snapshot->pages[page]);
+    }
+    free(c->snapshot->pages);
+    free(c->snapshot);
+    c->snapshot = NULL;
+}
+
 void free_computer(Computer* c){
     assert(c);
-    free(c->cpu.memory);
+    jit_detach(c);
+    profile_detach(c);
+    trace_stop(c);
+    history_detach(c);
+    munmap(c->cpu.memory, c->memory_size);
+    munmap(c->instruction_cache, c->cache_slots * sizeof(DecodedInstruction));
+    munmap(c->page_flags, c->nb_pages);
+    free(c->video_dirty);
+    free(c->cpu.interrupts.entries);
+    free(c->breakpoints);
+    free(c->watchpoints);
+    free_snapshot(c);
 }
 
-void load(Computer* c, FILE* binary){
+static long user_memory_end(Computer* c){
+    return c->program_memory_size + c->video_memory_size;
+}
+
+// Rounds $size up to a multiple of the page size
+static size_t page_align(size_t size){
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+/* Forgets the decoded (and translated) instructions of memory [0, $end)
+   after it was replaced. Fresh zero pages are mapped over that part of 
+   the instruction cache, whatever the number of slots in use; it is
+   cleared in place if they cannot be. */
+static void discard_decoded_program(Computer* c, long end){
+    size_t bytes = page_align(((end + 3) / 4 + 1) * sizeof(DecodedInstruction));
+    if(bytes > c->cache_slots * sizeof(DecodedInstruction)){
+        bytes = c->cache_slots * sizeof(DecodedInstruction);
+    }
+
+    if(mmap(c->instruction_cache, bytes, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED){
+        memset(c->instruction_cache, 0, bytes);
+    }
+    jit_invalidate(c);
+}
+
+// Size of $binary in bytes, -1 if it cannot be determined
+static long binary_size(FILE* binary){
+    if(fseek(binary, 0, SEEK_END) != 0){
+        return -1;
+    }
+    long size = ftell(binary);
+    rewind(binary);
+    return size;
+}
+
+LoadStatus load(Computer* c, FILE* binary){
     assert(c && binary);
 
-    fseek(binary, 0, SEEK_END);
-    c->program_size = ftell(binary);                    
-    if(c->program_size > c->program_memory_size){
-        printf("There is not enough space in the computer's program memory to store this program.");
-        exit(-2);
+    long size = binary_size(binary);
+    if(size < 0){
+        return LOAD_READ_ERROR;
+    }
+    if(size > c->program_memory_size){
+        return LOAD_TOO_LARGE;
     }
-    rewind(binary); 
-    fread(c->cpu.program_memory, c->program_size, 1, binary); // Loads the binary at the beginning of the computer's memory
+
+    // The binary is copied rather than mapped: a mapping of the file would fault (SIGBUS) 
+    // once the file is truncated, and follow its changes if it is rewritten in place
+    if(size > 0 && fread(c->cpu.program_memory, size, 1, binary) != 1){
+        return LOAD_READ_ERROR;
+    }
+
+    // Slots of a previous, larger program may have been decoded beyond the binary,
+    // the rest of that program is cleared so that it cannot be executed either
+    long end = (size > (long) c->program_size) ? size : c->program_size;
+    discard_decoded_program(c, end);
+    memset(c->cpu.program_memory + size, 0, end - size);
+    for(long addr = size; addr < end; addr += MEMORY_PAGE_SZ){
+        mark_written(c, addr);
+    }
+    if(end > size){
+        mark_written(c, end - 1);
+    }
+    c->program_size = size;
+    for(long addr = 0; addr < size; addr += MEMORY_PAGE_SZ){
+        mark_written(c, addr);
+    }
+    if(size > 0){
+        mark_written(c, size - 1);
+    }
+
+    return LOAD_OK;
 }
 
-void load_interrupt_handler(Computer* c, FILE* binary){
+LoadStatus load_interrupt_handler(Computer* c, FILE* binary){
     assert(c); 
 
     if(binary == NULL){
-        return; // If binary is NULL the function does nothing
+        return LOAD_OK; // If binary is NULL the function does nothing
     }
 
-    fseek(binary, 0, SEEK_END);
-    int handler_size = ftell(binary);                   
+    long handler_size = binary_size(binary);
+    if(handler_size < 0){
+        return LOAD_READ_ERROR;
+    }
     if(handler_size > c->kernel_memory_size - 400){
-        printf("There is not enough space in the computer's kernel memory to store this interrupt handler.");
-        exit(-2);
+        return LOAD_TOO_LARGE;
     }
-    rewind(binary); 
 
     char *addr = c->cpu.kernel_memory + 400;
-    fread(addr, handler_size, 1, binary); // Loads the binary at its place in kernel memory
+    if(handler_size > 0 && fread(addr, handler_size, 1, binary) != 1){ // Loads the binary at its place in kernel memory
+        return LOAD_READ_ERROR;
+    }
+
+    long start = user_memory_end(c) + 400;
+    c->handler_start = start;
+    c->handler_size = handler_size;
+    for(long slot = start; slot < start + handler_size + 4; slot += 4){
+        invalidate_slot(c, slot);
+    }
+    for(long addr = start; addr < start + handler_size; addr++){
+        mark_written(c, addr);
+    }
+
+    return LOAD_OK;
+}
+
+const char* load_status_message(LoadStatus status){
+    switch(status){
+        case LOAD_OK: return "Success";
+        case LOAD_READ_ERROR: return "The binary could not be read";
+        case LOAD_TOO_LARGE: return "There is not enough space in the computer's memory to store this binary";
+        default: return "Unknown error";
+    }
+}
+
+bool take_dirty_video(Computer* c, long from, long* start, long* end){
+    assert(c && start && end);
+
+    long span = (from < 0) ? 0 : from >> VIDEO_SPAN_SHIFT;
+
+    // First dirty span
+    while(span < c->video_spans){
+        uint64_t bits = c->video_dirty[span / 64] >> (span % 64);
+        if(bits != 0){
+            span += __builtin_ctzll(bits);
+            break;
+        }
+        span = (span / 64 + 1) * 64;
+    }
+    if(span >= c->video_spans){
+        return false;
+    }
+
+    // Extends the run while spans are dirty, clearing them
+    long first = span;
+    while(span < c->video_spans && (c->video_dirty[span / 64] & ((uint64_t) 1 << (span % 64)))){
+        c->video_dirty[span / 64] &= ~((uint64_t) 1 << (span % 64));
+        span++;
+    }
+
+    *start = first << VIDEO_SPAN_SHIFT;
+    *end = span << VIDEO_SPAN_SHIFT;
+    if(*end > c->video_memory_size){
+        *end = c->video_memory_size;
+    }
+
+    return true;
+}
+
+void clear_dirty_video(Computer* c){
+    assert(c);
+    memset(c->video_dirty, 0, (c->video_spans + 63) / 64 * sizeof(uint64_t));
+}
+
+// Size of $page, the last page of memory can be partial
+static long page_size(Computer* c, long page){
+    long start = page << MEMORY_PAGE_SHIFT;
+    return (c->memory_size - start < MEMORY_PAGE_SZ) ? c->memory_size - start : MEMORY_PAGE_SZ;
+}
+
+bool take_snapshot(Computer* c){
+    assert(c);
+
+    Snapshot* snapshot = c->snapshot;
+    if(snapshot == NULL){
+        snapshot = (Snapshot *) calloc(1, sizeof(Snapshot));
+        if(snapshot == NULL){
+            return false;
+        }
+        snapshot->pages = (char **) calloc(c->nb_pages, sizeof(char *));
+        if(snapshot->pages == NULL){
+            free(snapshot);
+            return false;
+        }
+        c->snapshot = snapshot;
+    }
+
+    // Copies are allocated first so that a failure leaves the previous snapshot intact
+    for(long page = 0; page < c->nb_pages; page++){
+        if((c->page_flags[page] & PAGE_DIRTY) && snapshot->pages[page] == NULL){
+            snapshot->pages[page] = (char *) malloc(MEMORY_PAGE_SZ);
+            if(snapshot->pages[page] == NULL){
+                return false;
+            }
+        }
+    }
+
+    for(long page = 0; page < c->nb_pages; page++){
+        if(c->page_flags[page] & PAGE_DIRTY){
+            memcpy(snapshot->pages[page], &c->cpu.memory[page << MEMORY_PAGE_SHIFT], page_size(c, page));
+            c->page_flags[page] &= ~PAGE_DIRTY;
+        }
+    }
+
+    snapshot->program_counter = c->cpu.program_counter;
+    memcpy(snapshot->registers, c->cpu.registers, sizeof(snapshot->registers));
+    snapshot->halted = c->halted;
+    snapshot->instructions = c->instructions;
+    snapshot->program_size = c->program_size;
+    snapshot->latest_accessed = c->latest_accessed;
+
+    return true;
+}
+
+bool restore_snapshot(Computer* c){
+    assert(c);
+
+    Snapshot* snapshot = c->snapshot;
+    if(snapshot == NULL){
+        return false;
+    }
+
+    for(long page = 0; page < c->nb_pages; page++){
+        if(c->page_flags[page] & PAGE_DIRTY){
+            write_page(c, page, snapshot->pages[page]);
+            c->page_flags[page] &= ~PAGE_DIRTY;
+        }
+    }
+
+    c->cpu.program_counter = snapshot->program_counter;
+    memcpy(c->cpu.registers, snapshot->registers, sizeof(c->cpu.registers));
+    c->halted = snapshot->halted;
+    c->instructions = snapshot->instructions;
+    c->program_size = snapshot->program_size;
+    c->latest_accessed = snapshot->latest_accessed;
+
+    return true;
+}
+
+void write_page(Computer* c, long page, const char* data){
+    assert(c && page >= 0 && page < c->nb_pages);
+
+    char* start = &c->cpu.memory[page << MEMORY_PAGE_SHIFT];
+    if(data != NULL){
+        memcpy(start, data, page_size(c, page));
+    }
+    else{
+        memset(start, 0, page_size(c, page));
+    }
+
+    // The display must show the new pixels (spans are smaller than pages)
+    for(long addr = page << MEMORY_PAGE_SHIFT; addr < (page << MEMORY_PAGE_SHIFT) + page_size(c, page); addr += 1 << VIDEO_SPAN_SHIFT){
+        mark_written(c, addr);
+    }
+
+    // Code of the page may have changed, it must be decoded (and translated) again
+    if(c->page_flags[page] & PAGE_CODE){
+        for(long addr = page << MEMORY_PAGE_SHIFT; addr < (page << MEMORY_PAGE_SHIFT) + page_size(c, page); addr += 4){
+            invalidate_slot(c, addr);
+        }
+        c->page_flags[page] &= ~PAGE_CODE;
+    }
+}
+
+static void op_invalid(Computer* c, const DecodedInstruction* in, bool kernel_mode){
+    // Invalid instructions are skipped
+    (void) c;
+    (void) in;
+    (void) kernel_mode;
+}
+
+static void op_halt(Computer* c, const DecodedInstruction* in, bool kernel_mode){
+    (void) in;
+    (void) kernel_mode;
+    c->halted = true;
+}
+
+static void op_ld(Computer* c, const DecodedInstruction* in, bool kernel_mode){
+    int ra = c->cpu.registers[in->ra];
+    if(!kernel_mode && (ra + in->literal >= user_memory_end(c))){
+        return; // Cannot access kernel memory from user program memory
+    }
+
+    c->cpu.registers[in->rc] = load_word(c, ra + in->literal);
+}
+
+static void op_st(Computer* c, const DecodedInstruction* in, bool kernel_mode){
+    int ra = c->cpu.registers[in->ra];
+    if(!kernel_mode && (ra + in->literal >= user_memory_end(c))){
+        return; // Cannot access kernel memory from user program memory
+    }
+
+    store_word(c, ra + in->literal, c->cpu.registers[in->rc]);
+}
+
+static void op_jmp(Computer* c, const DecodedInstruction* in, bool kernel_mode){
+    long target = c->cpu.registers[in->ra] & 0xFFFFFFFC;
+    if(!kernel_mode && (target >= user_memory_end(c))){
+        return; // Cannot access kernel memory from user program memory
+    }
+
+    c->cpu.registers[in->rc] = c->cpu.program_counter;
+    c->cpu.program_counter = target;
+}
+
+static void op_beq(Computer* c, const DecodedInstruction* in, bool kernel_mode){
+    long target = c->cpu.program_counter + 4 * in->literal;
+    if(!kernel_mode && (target >= user_memory_end(c))){
+        return; // Cannot access kernel memory from user program memory
+    }
+
+    int ra = c->cpu.registers[in->ra];
+    c->cpu.registers[in->rc] = c->cpu.program_counter;
+    if(ra == 0){
+        c->cpu.program_counter = target;
+    }
+}
+
+static void op_bne(Computer* c, const DecodedInstruction* in, bool kernel_mode){
+    long target = c->cpu.program_counter + 4 * in->literal;
+    if(!kernel_mode && (target >= user_memory_end(c))){
+        return; // Cannot access kernel memory from user program memory
+    }
+
+    int ra = c->cpu.registers[in->ra];
+    c->cpu.registers[in->rc] = c->cpu.program_counter;
+    if(ra != 0){
+        c->cpu.program_counter = target;
+    }
+}
+
+static void op_ldr(Computer* c, const DecodedInstruction* in, bool kernel_mode){
+    (void) kernel_mode; // LDR, and STR through it, are allowed in both modes
+    long addr = c->cpu.program_counter + 4 * in->literal;
+
+    // LDR is to be interpreted as STR if the address in question is part of kernel memory.
+    if(addr >= user_memory_end(c)){
+        store_word(c, addr, c->cpu.registers[in->rc]); // STR
+    }
+    else{
+        c->cpu.registers[in->rc] = load_word(c, addr); // LDR
+    }
+}
+
+#define RA c->cpu.registers[in->ra]
+#define RB c->cpu.registers[in->rb]
+#define RC c->cpu.registers[in->rc]
+#define LIT in->literal
+
+static void op_add(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA + RB; }
+static void op_sub(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA - RB; }
+static void op_mul(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA * RB; }
+static void op_div(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA / RB; }
+
+static void op_cmpeq(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = (RA == RB); }
+static void op_cmplt(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = (RA < RB); }
+static void op_cmple(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = (RA <= RB); }
+
+static void op_and(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA & RB; }
+static void op_or(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA | RB; }
+static void op_xor(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA ^ RB; }
+
+// Only the 5 least-significant bits of the second operand (representing the shift) are considered.
+static void op_shl(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA << get_bits(RB, 0, 5); }
+static void op_shr(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = (int) ((unsigned int) RA >> get_bits(RB, 0, 5)); }
+static void op_sra(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA >> get_bits(RB, 0, 5); }
+
+static void op_addc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA + LIT; }
+static void op_subc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA - LIT; }
+static void op_mulc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA * LIT; }
+static void op_divc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA / LIT; }
+
+static void op_cmpeqc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = (RA == LIT); }
+static void op_cmpltc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = (RA < LIT); }
+static void op_cmplec(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = (RA <= LIT); }
+
+static void op_andc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA & LIT; }
+static void op_orc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA | LIT; }
+static void op_xorc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA ^ LIT; }
+
+static void op_shlc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA << get_bits(LIT, 0, 5); }
+static void op_shrc(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = (int) ((unsigned int) RA >> get_bits(LIT, 0, 5)); }
+static void op_srac(Computer* c, const DecodedInstruction* in, bool kernel_mode){ (void) kernel_mode; RC = RA >> get_bits(LIT, 0, 5); }
+
+#undef RA
+#undef RB
+#undef RC
+#undef LIT
+
+static const InstructionHandler handlers[64] = {
+    [0x00] = op_halt,
+    [0x18] = op_ld, [0x19] = op_st, [0x1B] = op_jmp, 
+    [0x1D] = op_beq, [0x1E] = op_bne, [0x1F] = op_ldr,
+    [0x20] = op_add, [0x21] = op_sub, [0x22] = op_mul, [0x23] = op_div,
+    [0x24] = op_cmpeq, [0x25] = op_cmplt, [0x26] = op_cmple,
+    [0x28] = op_and, [0x29] = op_or, [0x2A] = op_xor,
+    [0x2C] = op_shl, [0x2D] = op_shr, [0x2E] = op_sra,
+    [0x30] = op_addc, [0x31] = op_subc, [0x32] = op_mulc, [0x33] = op_divc,
+    [0x34] = op_cmpeqc, [0x35] = op_cmpltc, [0x36] = op_cmplec,
+    [0x38] = op_andc, [0x39] = op_orc, [0x3A] = op_xorc,
+    [0x3C] = op_shlc, [0x3D] = op_shrc, [0x3E] = op_srac,
+};
+
+// Dispatch index of the instruction $in alone, whether or not it starts a fused sequence or has a breakpoint
+static inline unsigned char unfused_op(const DecodedInstruction* in){
+    return (in->handler == op_invalid) ? OP_INVALID : in->opcode;
+}
+
+static void decode(int instruction, DecodedInstruction* in){
+    in->opcode = get_bits(instruction, 26, 6);
+    in->ra = get_bits(instruction, 16, 5);
+    in->rb = get_bits(instruction, 11, 5);
+    in->rc = get_bits(instruction, 21, 5);
+
+    in->literal = get_bits(instruction, 0, 16);
+    in->literal |= ((in->literal & 0x8000) ? 0xFFFF0000 : 0); // SEXT(literal)
+
+    in->handler = handlers[in->opcode];
+
+    // An instruction with opcode 0 but not equal to 0 is not a valid instruction.
+    if(in->handler == NULL || (in->opcode == 0 && instruction != 0)){
+        in->handler = op_invalid;
+    }
+
+    in->op = unfused_op(in);
+}
+
+// Index of CMPEQ, CMPLT, CMPLE and their literal forms among the fused compare-and-branch pairs
+static int compare_index(unsigned char opcode){
+    switch(opcode){
+        case 0x24: return 0; // CMPEQ
+        case 0x25: return 1; // CMPLT
+        case 0x26: return 2; // CMPLE
+        case 0x34: return 3; // CMPEQC
+        case 0x35: return 4; // CMPLTC
+        case 0x36: return 5; // CMPLEC
+        default: return -1;
+    }
+}
+
+/* Recognises the beta.uasm macro sequence (PUSH, POP, MOVE, compare and 
+   branch) starting at cache slot $index and stores its dispatch index in
+   the slot. run() then executes the whole sequence at once, reading the
+   operands of the next instructions from the next slots, which must thus 
+   be decoded already. execute_step() ignores fusion. A sequence is not
+   fused if one of its instructions has a breakpoint. */
+static void fuse(Computer* c, long index){
+    if(index < 0 || index + 1 >= c->cache_slots || c->instruction_cache[index].handler == NULL ||
+       c->instruction_cache[index].op == OP_BREAKPOINT){
+        return;
+    }
+
+    DecodedInstruction* in = &c->instruction_cache[index];
+    const DecodedInstruction* next = &in[1];
+    const DecodedInstruction* third = (index + 2 < c->cache_slots && in[2].handler != NULL) ? &in[2] : NULL;
+
+    in->op = unfused_op(in);
+    if(next->handler == NULL || next->op == OP_BREAKPOINT){
+        return;
+    }
+
+    // A third instruction with a breakpoint is left out of the sequence
+    if(third != NULL && third->op == OP_BREAKPOINT){
+        third = NULL;
+    }
+
+    // PUSH(X): ADDC(S, 4, S) ST(X, -4, S), followed by MOVE(S, Y) in procedure prologues
+    if(in->opcode == 0x30 && in->ra == in->rc && in->rc != 31 && in->literal == 4 &&
+       next->opcode == 0x19 && next->ra == in->rc && next->literal == -4){
+        if(third != NULL && third->opcode == 0x20 && third->ra == in->rc && third->rb == 31){
+            in->op = OP_PUSH_MOVE;
+        }
+        else{
+            in->op = OP_PUSH;
+        }
+    }
+
+    // POP(X): LD(S, -4, X) then S - 4, followed by JMP(LP) in procedure epilogues
+    else if(in->opcode == 0x18 && in->ra != 31 && in->literal == -4 && 
+            next->ra == in->ra && next->rc == in->ra &&
+            ((next->opcode == 0x30 && next->literal == -4) || (next->opcode == 0x31 && next->literal == 4))){
+        if(third != NULL && third->opcode == 0x1B){
+            in->op = OP_POP_JMP;
+        }
+        else{
+            in->op = OP_POP;
+        }
+    }
+
+    // CMPxx followed by BF/BT on its result
+    else if(compare_index(in->opcode) >= 0 && (next->opcode == 0x1D || next->opcode == 0x1E) && next->ra == in->rc){
+        in->op = OP_CMP_BRANCH + 2 * compare_index(in->opcode) + (next->opcode == 0x1E);
+    }
+}
+
+/* Returns the decoded instruction at $addr, decoding it into the instruction 
+   cache on first use. Addresses the cache does not cover are decoded into
+   $scratch instead. */
+static const DecodedInstruction* fetch(Computer* c, long addr, DecodedInstruction* scratch){
+    if(addr >= 0 && (addr & 3) == 0 && (addr >> 2) < c->cache_slots){
+        long index = addr >> 2;
+        DecodedInstruction* slot = &c->instruction_cache[index];
+        if(slot->handler == NULL){
+            decode(get_word(c, addr), slot);
+            c->page_flags[addr >> MEMORY_PAGE_SHIFT] |= PAGE_CODE;
+            if(has_breakpoint(c, addr)){
+                slot->op = OP_BREAKPOINT;
+            }
+
+            // The slot may complete sequences starting up to two slots before
+            for(long i = index - FUSED_MAX_LENGTH + 1; i <= index; i++){
+                fuse(c, i);
+            }
+        }
+        return slot;
+    }
+
+    decode(get_word(c, addr), scratch);
+    return scratch;
+}
+
+// Index of the first breakpoint of $c at or after $addr
+static int breakpoint_index(Computer* c, long addr){
+    int low = 0;
+    int high = c->nb_breakpoints;
+    while(low < high){
+        int middle = (low + high) / 2;
+        if(c->breakpoints[middle] < addr){
+            low = middle + 1;
+        }
+        else{
+            high = middle;
+        }
+    }
+    return low;
+}
+
+bool has_breakpoint(Computer* c, long addr){
+    // Only the pages holding breakpoints need a look at the list
+    if(addr < 0 || addr >= c->memory_size || !(c->page_flags[addr >> MEMORY_PAGE_SHIFT] & PAGE_BREAKPOINT)){
+        return false;
+    }
+
+    int i = breakpoint_index(c, addr);
+    return i < c->nb_breakpoints && c->breakpoints[i] == addr;
+}
+
+/* Dispatches the slot at $addr, if it is decoded, to the breakpoint check
+   ($breakpoint) or back to its instruction, then fuses the sequences 
+   around it again. Native code does not check breakpoints, the blocks 
+   translated from the slot are thrown away. */
+static void update_breakpoint_slot(Computer* c, long addr, bool breakpoint){
+    long index = addr >> 2;
+    DecodedInstruction* slot = &c->instruction_cache[index];
+
+    if(slot->translated){
+        jit_invalidate(c);
+    }
+    if(slot->handler == NULL){
+        return; // fetch() looks for the breakpoint when decoding the slot
+    }
+
+    slot->op = breakpoint ? OP_BREAKPOINT : unfused_op(slot);
+    for(long i = index - FUSED_MAX_LENGTH + 1; i <= index; i++){
+        fuse(c, i);
+    }
+}
+
+bool add_breakpoint(Computer* c, long addr){
+    assert(c);
+
+    if(addr < 0 || (addr & 3) != 0 || (addr >> 2) >= c->cache_slots){
+        return false;
+    }
+    if(has_breakpoint(c, addr)){
+        return true;
+    }
+
+    long* breakpoints = (long *) realloc(c->breakpoints, (c->nb_breakpoints + 1) * sizeof(long));
+    if(breakpoints == NULL){
+        return false;
+    }
+    c->breakpoints = breakpoints;
+
+    int i = breakpoint_index(c, addr);
+    memmove(&c->breakpoints[i + 1], &c->breakpoints[i], (c->nb_breakpoints - i) * sizeof(long));
+    c->breakpoints[i] = addr;
+    c->nb_breakpoints++;
+
+    c->page_flags[addr >> MEMORY_PAGE_SHIFT] |= PAGE_BREAKPOINT;
+    update_breakpoint_slot(c, addr, true);
+    return true;
+}
+
+bool remove_breakpoint(Computer* c, long addr){
+    assert(c);
+
+    if(!has_breakpoint(c, addr)){
+        return false;
+    }
+
+    int i = breakpoint_index(c, addr);
+    memmove(&c->breakpoints[i], &c->breakpoints[i + 1], (c->nb_breakpoints - i - 1) * sizeof(long));
+    c->nb_breakpoints--;
+
+    // The page keeps its flag while it holds other breakpoints, which are next to this one in the list
+    long page = addr >> MEMORY_PAGE_SHIFT;
+    if(!(i < c->nb_breakpoints && c->breakpoints[i] >> MEMORY_PAGE_SHIFT == page) &&
+       !(i > 0 && c->breakpoints[i - 1] >> MEMORY_PAGE_SHIFT == page)){
+        c->page_flags[page] &= ~PAGE_BREAKPOINT;
+    }
+
+    update_breakpoint_slot(c, addr, false);
+    return true;
+}
+
+// Sets the watch flags of the pages of [$start, $end) from the watchpoints they overlap
+static void update_watch_flags(Computer* c, long start, long end){
+    for(long page = start >> MEMORY_PAGE_SHIFT; page <= (end - 1) >> MEMORY_PAGE_SHIFT; page++){
+        long page_start = page << MEMORY_PAGE_SHIFT;
+        unsigned char flags = 0;
+
+        for(int i = 0; i < c->nb_watchpoints; i++){
+            const Watchpoint* w = &c->watchpoints[i];
+            if(w->start < page_start + MEMORY_PAGE_SZ && w->end > page_start){
+                flags |= ((w->access & WATCH_READ) ? PAGE_WATCH_READ : 0) | ((w->access & WATCH_WRITE) ? PAGE_WATCH_WRITE : 0);
+            }
+        }
+
+        c->page_flags[page] = (c->page_flags[page] & ~(PAGE_WATCH_READ | PAGE_WATCH_WRITE)) | flags;
+    }
+}
+
+bool add_watchpoint(Computer* c, long start, long end, int access){
+    assert(c);
+
+    if(start < 0 || start >= end || end > c->memory_size || (access & (WATCH_READ | WATCH_WRITE)) == 0){
+        return false;
+    }
+
+    Watchpoint* watchpoints = (Watchpoint *) realloc(c->watchpoints, (c->nb_watchpoints + 1) * sizeof(Watchpoint));
+    if(watchpoints == NULL){
+        return false;
+    }
+    c->watchpoints = watchpoints;
+    c->watchpoints[c->nb_watchpoints++] = (Watchpoint) {start, end, access & (WATCH_READ | WATCH_WRITE)};
+
+    update_watch_flags(c, start, end);
+    return true;
+}
+
+bool remove_watchpoint(Computer* c, long start, long end){
+    assert(c);
+
+    int kept = 0;
+    for(int i = 0; i < c->nb_watchpoints; i++){
+        if(c->watchpoints[i].start != start || c->watchpoints[i].end != end){
+            c->watchpoints[kept++] = c->watchpoints[i];
+        }
+    }
+    if(kept == c->nb_watchpoints){
+        return false;
+    }
+
+    c->nb_watchpoints = kept;
+    update_watch_flags(c, start, end);
+    return true;
+}
+
+void clear_breakpoints(Computer* c){
+    assert(c);
+
+    while(c->nb_breakpoints > 0){
+        remove_breakpoint(c, c->breakpoints[c->nb_breakpoints - 1]);
+    }
+
+    while(c->nb_watchpoints > 0){
+        Watchpoint w = c->watchpoints[c->nb_watchpoints - 1];
+        remove_watchpoint(c, w.start, w.end);
+    }
+}
+
+/* Takes the oldest interrupt waiting for the CPU of $c into $irq, returns
+   false if there is none (the line can stay raised by a raise_interrupt()
+   whose interrupt was already taken). The line is left raised as long as
+   interrupts are waiting. */
+static bool take_interrupt(Computer* c, PendingInterrupt* irq){
+    InterruptQueue* q = &c->cpu.interrupts;
+
+    unsigned long tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    bool taken = atomic_load_explicit(&q->head, memory_order_acquire) != tail;
+    if(taken){
+        *irq = q->entries[tail % q->depth];
+        atomic_store_explicit(&q->tail, ++tail, memory_order_release);
+    }
+
+    // Lowered before looking for more interrupts, so that one queued meanwhile raises it again
+    atomic_store_explicit(&c->cpu.interrupt_line, false, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&q->head, memory_order_acquire) != tail){
+        atomic_store_explicit(&c->cpu.interrupt_line, true, memory_order_relaxed);
+    }
+
+    return taken;
+}
+
+// Whether an interrupt waits for the CPU of $c
+static bool interrupt_waiting(Computer* c){
+    return atomic_load_explicit(&c->cpu.interrupts.head, memory_order_acquire) 
+           != atomic_load_explicit(&c->cpu.interrupts.tail, memory_order_relaxed);
+}
+
+// Hands control to the interrupt handler, to handle $irq
+static void enter_interrupt(Computer* c, PendingInterrupt irq){
+
+    // The CPU places the interrupt number and associated character at the adequate place in kernel memory
+    c->cpu.kernel_memory[13] = irq.nb;
+    c->cpu.kernel_memory[13+1] = irq.character;
+    mark_written(c, user_memory_end(c) + 13);
+    mark_written(c, user_memory_end(c) + 13 + 1);
+
+    // The CPU stores PC into XP (30) so that the interrupt handler is able to return.
+    c->cpu.registers[30] = c->cpu.program_counter;
+              
+    // The program counter becomes the start address of the interrupt handler.
+    c->cpu.program_counter = c->program_memory_size + c->video_memory_size + 400;
+}
+
+// Executes the instruction at PC, in kernel mode or not
+static void execute_current(Computer* c, bool kernel_mode){
+
+    // Fetch + decode
+    DecodedInstruction scratch;
+    const DecodedInstruction* instr = fetch(c, c->cpu.program_counter, &scratch);
+
+    // Execute
+    c->cpu.program_counter += 4;
+    instr->handler(c, instr, kernel_mode);
+
+    c->cpu.registers[31] = 0; // R31 is hardwired to 0, writes to it are discarded
+
+    c->instructions++;
 }
 
 void execute_step(Computer* c){
@@ -127,249 +1039,788 @@ void execute_step(Computer* c){
     c->halted = false;
     
     bool kernel_mode = c->cpu.program_counter >= c->program_memory_size + c->video_memory_size;
+    PendingInterrupt irq;
 
     // If an interrupt line is raised (and the computer is not already executing the interrupt handler),
-    if(c->cpu.interrupt_line && !kernel_mode){
+    if(c->cpu.interrupt_line && !kernel_mode && take_interrupt(c, &irq)){
+        if(c->history != NULL){
+            history_log_interrupt(c, c->instructions, irq);
+        }
 
         // Before handing control to the interrupt handler,
+        enter_interrupt(c, irq);
+    }
+
+    execute_current(c, kernel_mode);
+}
 
-        // The CPU places the interrupt number and associated character at the adequate place in kernel memory
-        c->cpu.kernel_memory[13] = c->cpu.interrupt_nb;
-        c->cpu.kernel_memory[13+1] = c->cpu.interrupt_char;
+void execute_interrupt(Computer* c, char nb, char character){
+    assert(c);
 
-        // The CPU stores PC into XP (30) so that the interrupt handler is able to return.
-        c->cpu.registers[30] = c->cpu.program_counter;
-                  
-        // The program counter becomes the start address of the interrupt handler.
-        c->cpu.program_counter = c->program_memory_size + c->video_memory_size + 400;
+    c->halted = false;
 
-        c->cpu.interrupt_line = false;
+    bool kernel_mode = c->cpu.program_counter >= c->program_memory_size + c->video_memory_size;
+    enter_interrupt(c, (PendingInterrupt) {nb, character});
+    execute_current(c, kernel_mode);
+}
+
+// Executes $c with the fastest engine its attachments allow
+static RunStatus run_engine(Computer* c, uint64_t max_steps, StopConditions stop){
+    if(c->jit != NULL && c->profile == NULL && c->trace == NULL){
+        return jit_run(c, max_steps, stop);
     }
 
-    // Fetch instruction
-    int instruction = get_word(c, c->cpu.program_counter);
+    return interpret(c, max_steps, stop);
+}
 
-    // Decode
-    int opcode = get_bits(instruction, 26, 6);
-    
-    int ra = get_register(c, get_bits(instruction, 16, 5));
-    int rb = get_register(c, get_bits(instruction, 11, 5));
+RunStatus run(Computer* c, uint64_t max_steps, StopConditions stop){
+    assert(c);
 
-    int rc_addr = get_bits(instruction, 21, 5);
+    c->watch_hit = false;
 
-    int lit = get_bits(instruction, 0, 16);
-        lit |= ((lit & 0x8000) ? 0xFFFF0000 : 0); // SEXT(literal)
+    if(c->history == NULL){
+        return run_engine(c, max_steps, stop);
+    }
 
-    // Execute
-    c->cpu.program_counter += 4;
-    
-    switch (opcode){
-        case 0x0: 
-            if(instruction != 0){ // An instruction with opcode 0 but not equal to 0 is not a valid instruction.
-                return;
-            }
-            c->halted = true;
-            break;
+    // With a history attached, execution pauses at each checkpoint to take it
+    uint64_t left = max_steps;
+    while(true){
+        uint64_t due = history_next_checkpoint(c);
+        if(c->instructions >= due){
+            history_checkpoint(c);
+            continue;
+        }
+
+        uint64_t batch = (due - c->instructions < left) ? due - c->instructions : left;
+        uint64_t before = c->instructions;
+        RunStatus status = run_engine(c, batch, stop);
+        left -= c->instructions - before;
+
+        if(status != RUN_BUDGET_EXHAUSTED || left == 0){
+            return status;
+        }
+        // Not the instruction this run() started from, the breakpoints apply
+        if(c->cpu.program_counter == stop.breakpoint || (stop.breakpoints && has_breakpoint(c, c->cpu.program_counter))){
+            return RUN_BREAKPOINT;
+        }
+    }
+}
 
-        case 0x18: // LD
-            if(!kernel_mode && (ra + lit >= c->program_memory_size + c->video_memory_size)){
-                return; // Cannot access kernel memory from user program memory
-            }
+RunStatus interpret(Computer* c, uint64_t max_steps, StopConditions stop){
+    assert(c);
 
-            c->cpu.registers[rc_addr] = get_word(c, ra + lit); 
-            break;  
+    // Direct-threaded dispatch: each instruction jumps straight to the code of the next one
+    static void* const labels[OP_COUNT] = {
+        [0x00] = &&l_halt,
+        [0x18] = &&l_ld, [0x19] = &&l_st, [0x1B] = &&l_jmp, 
+        [0x1D] = &&l_beq, [0x1E] = &&l_bne, [0x1F] = &&l_ldr,
+        [0x20] = &&l_add, [0x21] = &&l_sub, [0x22] = &&l_mul, [0x23] = &&l_div,
+        [0x24] = &&l_cmpeq, [0x25] = &&l_cmplt, [0x26] = &&l_cmple,
+        [0x28] = &&l_and, [0x29] = &&l_or, [0x2A] = &&l_xor,
+        [0x2C] = &&l_shl, [0x2D] = &&l_shr, [0x2E] = &&l_sra,
+        [0x30] = &&l_addc, [0x31] = &&l_subc, [0x32] = &&l_mulc, [0x33] = &&l_divc,
+        [0x34] = &&l_cmpeqc, [0x35] = &&l_cmpltc, [0x36] = &&l_cmplec,
+        [0x38] = &&l_andc, [0x39] = &&l_orc, [0x3A] = &&l_xorc,
+        [0x3C] = &&l_shlc, [0x3D] = &&l_shrc, [0x3E] = &&l_srac,
+        [OP_INVALID] = &&l_invalid,
+        [OP_PUSH] = &&f_push, [OP_PUSH_MOVE] = &&f_push_move,
+        [OP_POP] = &&f_pop, [OP_POP_JMP] = &&f_pop_jmp,
+        [OP_CMP_BRANCH + 0] = &&f_cmpeq_beq, [OP_CMP_BRANCH + 1] = &&f_cmpeq_bne,
+        [OP_CMP_BRANCH + 2] = &&f_cmplt_beq, [OP_CMP_BRANCH + 3] = &&f_cmplt_bne,
+        [OP_CMP_BRANCH + 4] = &&f_cmple_beq, [OP_CMP_BRANCH + 5] = &&f_cmple_bne,
+        [OP_CMP_BRANCH + 6] = &&f_cmpeqc_beq, [OP_CMP_BRANCH + 7] = &&f_cmpeqc_bne,
+        [OP_CMP_BRANCH + 8] = &&f_cmpltc_beq, [OP_CMP_BRANCH + 9] = &&f_cmpltc_bne,
+        [OP_CMP_BRANCH + 10] = &&f_cmplec_beq, [OP_CMP_BRANCH + 11] = &&f_cmplec_bne,
+        [OP_BREAKPOINT] = &&l_breakpoint,
+    };
+
+    // With a profile attached, every instruction goes through l_profile first (see profile.h)
+    static void* const profile_labels[OP_COUNT] = {[0 ... OP_BREAKPOINT - 1] = &&l_profile, [OP_BREAKPOINT] = &&l_breakpoint};
+    Profile* const profile = c->profile;
+
+    // With a trace attached, through l_trace first, then l_profile (see trace.h)
+    static void* const trace_labels[OP_COUNT] = {[0 ... OP_BREAKPOINT - 1] = &&l_trace, [OP_BREAKPOINT] = &&l_breakpoint};
+    Trace* const trace = c->trace;
+
+    void* const* const dispatch = (trace != NULL) ? trace_labels : (profile != NULL) ? profile_labels : labels;
+
+    // PC and registers live in locals for the whole run, they are written back on exit
+    long pc = c->cpu.program_counter;
+    int r[32];
+    memcpy(r, c->cpu.registers, sizeof(r));
+
+    const long kernel_start = user_memory_end(c);
+    const long handler_start = kernel_start + 400;
+    DecodedInstruction* const cache = c->instruction_cache;
+    const unsigned long cache_end = c->cache_slots * 4;
+
+    uint64_t steps = 0;
+    bool kernel_mode;
+    const DecodedInstruction* in;
+    DecodedInstruction scratch;
+    PendingInterrupt irq;
+    RunStatus status = RUN_BUDGET_EXHAUSTED;
 
-        case 0x19: // ST
-            if(!kernel_mode && (ra + lit >= c->program_memory_size + c->video_memory_size)){
-                return; // Cannot access kernel memory from user program memory
-            }
+    c->halted = false;
 
-            int rc = get_register(c, rc_addr);
-            store_word(c, ra + lit, rc);
-            break; 
+#define DISPATCH() \
+    do{ \
+        r[31] = 0; \
+        if(steps == max_steps){ goto done; } \
+        kernel_mode = pc >= kernel_start; \
+        if(atomic_load_explicit(&c->cpu.interrupt_line, memory_order_relaxed) && !kernel_mode){ goto interrupt; } \
+        if(pc == stop.breakpoint && steps != 0){ status = RUN_BREAKPOINT; goto done; } \
+        EXECUTE_NEXT(); \
+    } while(0)
+
+#define EXECUTE_NEXT() \
+    do{ \
+        if((unsigned long) pc < cache_end && (pc & 3) == 0 && cache[pc >> 2].handler != NULL){ \
+            in = &cache[pc >> 2]; \
+        } \
+        else{ \
+            in = fetch(c, pc, &scratch); \
+        } \
+        pc += 4; \
+        steps++; \
+        goto *dispatch[in->op]; \
+    } while(0)
+
+/* A fused sequence of $length instructions runs as a whole only if the 
+   budget allows it, no breakpoint is set inside and all of its
+   instructions run in the same mode (which is not the case for the first
+   instruction of the interrupt handler). Otherwise, its first instruction
+   runs alone. */
+#define FUSED(length) \
+    do{ \
+        if(max_steps - steps < (length) - 1 || kernel_mode != (pc + 4 * ((length) - 2) >= kernel_start) || \
+           (stop.breakpoint >= pc && stop.breakpoint <= pc + 4 * ((length) - 2))){ \
+            goto *labels[in->opcode]; \
+        } \
+    } while(0)
+
+// Stops right after an instruction whose load or store hit a watchpoint
+#define WATCHED() \
+    do{ \
+        if(c->watch_hit && stop.breakpoints){ status = RUN_WATCHPOINT; goto done; } \
+    } while(0)
+
+// Moves on to the next instruction of a fused sequence, which always comes from the next slot
+#define NEXT_PART(label) \
+    do{ \
+        r[31] = 0; \
+        in++; \
+        pc += 4; \
+        steps++; \
+        goto label; \
+    } while(0)
+
+#define RA r[in->ra]
+#define RB r[in->rb]
+#define RC r[in->rc]
+#define LIT in->literal
+
+    DISPATCH();
+
+interrupt:
+    if(stop.hold_interrupts){
+        EXECUTE_NEXT();
+    }
+    if(stop.on_interrupt && interrupt_waiting(c)){
+        status = RUN_INTERRUPT;
+        goto done;
+    }
+    if(!take_interrupt(c, &irq)){
+        EXECUTE_NEXT(); // the line was raised for an interrupt already delivered
+    }
+    if(c->history != NULL){
+        history_log_interrupt(c, c->instructions + steps, irq);
+    }
 
-        case 0x1B: // JMP
-            if(!kernel_mode && (ra & 0xFFFFFFFC >= c->program_memory_size + c->video_memory_size)){
-                return; // Cannot access kernel memory from user program memory
-            }
+    // Same sequence as in execute_step()
+    c->cpu.kernel_memory[13] = irq.nb;
+    c->cpu.kernel_memory[13+1] = irq.character;
+    mark_written(c, kernel_start + 13);
+    mark_written(c, kernel_start + 13 + 1);
+    if(trace != NULL){
+        trace_interrupt(trace, r, irq.nb, irq.character);
+        trace_forget_code(trace, kernel_start + 13);
+    }
+    r[30] = pc;
+    pc = handler_start;
+    if(profile != NULL){
+        profile->interrupts++;
+    }
+    EXECUTE_NEXT(); // with kernel_mode still false, as in execute_step()
+
+/* The instruction $in, whose address is pc - 4, has a breakpoint: stops
+   before it, unless run() started from it or it is the first instruction
+   of the interrupt handler, executed in user mode right after an 
+   interrupt was handed to it. Otherwise, executes it alone. */
+l_breakpoint:
+    if(stop.breakpoints && (steps != 1 || pc - 4 != c->cpu.program_counter) && (kernel_mode || pc - 4 < kernel_start)){
+        pc -= 4;
+        steps--;
+        status = RUN_BREAKPOINT;
+        goto done;
+    }
+    if(trace != NULL){
+        goto l_trace;
+    }
+    if(profile != NULL){
+        goto l_profile;
+    }
+    goto *labels[unfused_op(in)];
 
-            c->cpu.registers[rc_addr] = c->cpu.program_counter; 
-            c->cpu.program_counter = ra & 0xFFFFFFFC; 
-            break; 
+// Traces the instruction $in, whose address is pc - 4, then executes it alone
+l_trace:{
+    unsigned char op = unfused_op(in);
 
-        case 0x1D: // BEQ
-            if(!kernel_mode && (c->cpu.program_counter + 4 * lit >= c->program_memory_size + c->video_memory_size)){
-                return; // Cannot access kernel memory from user program memory
-            }
+    bool ldr_store = op == 0x1F && pc + 4 * LIT >= kernel_start; // LDR into kernel memory stores RC
 
-            c->cpu.registers[rc_addr] = c->cpu.program_counter; 
-            if(ra == 0){
-                c->cpu.program_counter = c->cpu.program_counter + 4 * lit;
-            }
-            break;       
-        case 0x1E: // BNE
-            if(!kernel_mode && (c->cpu.program_counter + 4 * lit >= c->program_memory_size + c->video_memory_size)){
-                return; // Cannot access kernel memory from user program memory
-            }
+    trace_retire(trace, r);
+    trace_step(trace, c, pc - 4, (TRACE_WRITES_RC >> op & 1) && in->rc != 31 && !ldr_store ? in->rc : -1);
+    if(op == 0x19 && (kernel_mode || RA + LIT < kernel_start)){ // ST
+        trace_store(trace, RA + LIT, RC);
+    }
+    else if(ldr_store){
+        trace_store(trace, pc + 4 * LIT, RC);
+    }
+    if(trace->cursor > trace->limit){
+        trace_hand_over(trace);
+    }
 
-            c->cpu.registers[rc_addr] = c->cpu.program_counter; 
-            if(ra != 0){
-                c->cpu.program_counter = c->cpu.program_counter + 4 * lit;
-            }
-            break;  
+    if(profile != NULL){
+        goto l_profile;
+    }
+    goto *labels[op];
+}
 
-        case 0x1F:
-            // LDR is to be interpreted as STR if the address in question is part of kernel memory.
-            if((c->cpu.program_counter + 4 * lit) >= c->program_memory_size + c->video_memory_size){
-                int rc = get_register(c, rc_addr);
-                store_word(c, c->cpu.program_counter + 4 * lit, rc); // STR
-            }
-            else{
-                c->cpu.registers[rc_addr] = get_word(c, c->cpu.program_counter + 4 * lit); // LDR
-            }
-            break;
+// Records the instruction $in, whose address is pc - 4, then executes it alone
+l_profile:{
+    unsigned char op = unfused_op(in);
+    unsigned long slot = (unsigned long) (pc - 4) >> 2;
+    bool counted = (unsigned long) (pc - 4) < cache_end;
+
+    profile->instructions++;
+    profile->opcodes[op]++;
+    if(counted){
+        profile->counts[slot]++;
+    }
+    if(pc - 4 >= kernel_start){
+        profile->kernel_instructions++;
+    }
+
+    if(op == 0x1D || op == 0x1E){ // BEQ, BNE
+        long target = pc + 4 * LIT;
+        bool taken = (kernel_mode || target < kernel_start) && ((RA == 0) == (op == 0x1D));
+        profile->branches[op - 0x1D][taken]++;
+        if(taken && counted){
+            profile->taken[slot]++;
+        }
+    }
+
+    goto *labels[op];
+}
 
-        case 0x20: c->cpu.registers[rc_addr] = ra + rb; break; // ADD   
-        case 0x21: c->cpu.registers[rc_addr] = ra - rb; break; // SUB   
-        case 0x22: c->cpu.registers[rc_addr] = ra * rb; break; // MUL   
-        case 0x23: c->cpu.registers[rc_addr] = ra / rb; break; // DIV   
+l_invalid: DISPATCH();
 
-        case 0x24: c->cpu.registers[rc_addr] = (ra == rb); break; // CMPEQ   
-        case 0x25: c->cpu.registers[rc_addr] = (ra < rb); break; // CMPLT      
-        case 0x26: c->cpu.registers[rc_addr] = (ra <= rb); break; // CMPLE   
+l_halt:
+    c->halted = true;
+    status = RUN_HALTED;
+    goto done;
 
-        case 0x28: c->cpu.registers[rc_addr] = ra & rb; break; // AND       
-        case 0x29: c->cpu.registers[rc_addr] = ra | rb; break; // OR       
-        case 0x2A: c->cpu.registers[rc_addr] = ra ^ rb; break; // XOR 
+l_ld:
+    if(kernel_mode || (RA + LIT < kernel_start)){ // Cannot access kernel memory from user program memory
+        RC = load_word(c, RA + LIT);
+        WATCHED();
+    }
+    DISPATCH();
 
-        // Only the 5 least-significant bits of the second operand (representing the shift) are considered.
-        case 0x2C: c->cpu.registers[rc_addr] = ra << get_bits(rb, 0, 5); break; // SHL
-        case 0x2D: c->cpu.registers[rc_addr] = (int) ((unsigned int) ra >> get_bits(rb, 0, 5)); break; // SHR
-        case 0x2E: c->cpu.registers[rc_addr] = ra >> get_bits(rb, 0, 5); break; // SRA
+l_st:
+    if(kernel_mode || (RA + LIT < kernel_start)){
+        store_word(c, RA + LIT, RC);
+        WATCHED();
+    }
+    DISPATCH();
 
-        case 0x30: c->cpu.registers[rc_addr] = ra + lit; break; // ADDC
-        case 0x31: c->cpu.registers[rc_addr] = ra - lit; break; // SUBC
-        case 0x32: c->cpu.registers[rc_addr] = ra * lit; break; // MULC
-        case 0x33: c->cpu.registers[rc_addr] = ra / lit; break; // DIVC
+l_jmp:{
+    long target = RA & 0xFFFFFFFC;
+    if(kernel_mode || (target < kernel_start)){
+        RC = pc;
+        pc = target;
+    }
+    DISPATCH();
+}
 
-        case 0x34: c->cpu.registers[rc_addr] = (ra == lit); break; // CMPEQC       
-        case 0x35: c->cpu.registers[rc_addr] = (ra < lit); break; // CMPLTC       
-        case 0x36: c->cpu.registers[rc_addr] = (ra <= lit); break; // CMPLEC
+l_beq:{
+    long target = pc + 4 * LIT;
+    if(kernel_mode || (target < kernel_start)){
+        int ra = RA;
+        RC = pc;
+        if(ra == 0){
+            pc = target;
+        }
+    }
+    DISPATCH();
+}
 
-        case 0x38: c->cpu.registers[rc_addr] = ra & lit; break; // ANDC     
-        case 0x39: c->cpu.registers[rc_addr] = ra | lit; break; // ORC    
-        case 0x3A: c->cpu.registers[rc_addr] = ra ^ lit; break; // XORC    
+l_bne:{
+    long target = pc + 4 * LIT;
+    if(kernel_mode || (target < kernel_start)){
+        int ra = RA;
+        RC = pc;
+        if(ra != 0){
+            pc = target;
+        }
+    }
+    DISPATCH();
+}
 
-        case 0x3C: c->cpu.registers[rc_addr] = ra << get_bits(lit, 0, 5); break; // SHLC
-        case 0x3D: c->cpu.registers[rc_addr] = (int) ((unsigned int) ra >> get_bits(lit, 0, 5)); break; // SHRC
-        case 0x3E: c->cpu.registers[rc_addr] = ra >> get_bits(lit, 0, 5); break; // SRAC
+l_ldr:{
+    long addr = pc + 4 * LIT;
+    if(addr >= kernel_start){
+        store_word(c, addr, RC); // STR
+    }
+    else{
+        RC = load_word(c, addr);
+    }
+    WATCHED();
+    DISPATCH();
+}
 
-        default: 
-            break;
+l_add: RC = RA + RB; DISPATCH();
+l_sub: RC = RA - RB; DISPATCH();
+l_mul: RC = RA * RB; DISPATCH();
+l_div: RC = RA / RB; DISPATCH();
+
+l_cmpeq: RC = (RA == RB); DISPATCH();
+l_cmplt: RC = (RA < RB); DISPATCH();
+l_cmple: RC = (RA <= RB); DISPATCH();
+
+l_and: RC = RA & RB; DISPATCH();
+l_or: RC = RA | RB; DISPATCH();
+l_xor: RC = RA ^ RB; DISPATCH();
+
+l_shl: RC = RA << get_bits(RB, 0, 5); DISPATCH();
+l_shr: RC = (int) ((unsigned int) RA >> get_bits(RB, 0, 5)); DISPATCH();
+l_sra: RC = RA >> get_bits(RB, 0, 5); DISPATCH();
+
+l_addc: RC = RA + LIT; DISPATCH();
+l_subc: RC = RA - LIT; DISPATCH();
+l_mulc: RC = RA * LIT; DISPATCH();
+l_divc: RC = RA / LIT; DISPATCH();
+
+l_cmpeqc: RC = (RA == LIT); DISPATCH();
+l_cmpltc: RC = (RA < LIT); DISPATCH();
+l_cmplec: RC = (RA <= LIT); DISPATCH();
+
+l_andc: RC = RA & LIT; DISPATCH();
+l_orc: RC = RA | LIT; DISPATCH();
+l_xorc: RC = RA ^ LIT; DISPATCH();
+
+l_shlc: RC = RA << get_bits(LIT, 0, 5); DISPATCH();
+l_shrc: RC = (int) ((unsigned int) RA >> get_bits(LIT, 0, 5)); DISPATCH();
+l_srac: RC = RA >> get_bits(LIT, 0, 5); DISPATCH();
+
+// Fused sequences, each part has the exact semantics of the instruction it replaces
+
+f_push: FUSED(2); RC = RA + LIT; NEXT_PART(l_st);
+
+f_push_move:
+    FUSED(3);
+    RC = RA + LIT;
+    NEXT_PART(f_push_move_st);
+f_push_move_st:
+    if(kernel_mode || (RA + LIT < kernel_start)){
+        long addr = RA + LIT;
+        store_word(c, addr, RC);
+        WATCHED();
+
+        // The store overwrote the MOVE, which must be decoded again
+        if(addr > pc - 4 && addr < pc + 4){
+            DISPATCH();
+        }
     }
+    NEXT_PART(l_add);
+
+f_pop: FUSED(2); if(kernel_mode || (RA + LIT < kernel_start)){ RC = load_word(c, RA + LIT); WATCHED(); } NEXT_PART(f_pop_sp);
+f_pop_sp: RC = RA - 4; DISPATCH(); // ADDC(S, -4, S) and SUBC(S, 4, S) alike
+
+f_pop_jmp:
+    FUSED(3);
+    if(kernel_mode || (RA + LIT < kernel_start)){
+        RC = load_word(c, RA + LIT);
+        WATCHED();
+    }
+    NEXT_PART(f_pop_jmp_sp);
+f_pop_jmp_sp: RC = RA - 4; NEXT_PART(l_jmp);
+
+f_cmpeq_beq: FUSED(2); RC = (RA == RB); NEXT_PART(l_beq);
+f_cmpeq_bne: FUSED(2); RC = (RA == RB); NEXT_PART(l_bne);
+f_cmplt_beq: FUSED(2); RC = (RA < RB); NEXT_PART(l_beq);
+f_cmplt_bne: FUSED(2); RC = (RA < RB); NEXT_PART(l_bne);
+f_cmple_beq: FUSED(2); RC = (RA <= RB); NEXT_PART(l_beq);
+f_cmple_bne: FUSED(2); RC = (RA <= RB); NEXT_PART(l_bne);
+f_cmpeqc_beq: FUSED(2); RC = (RA == LIT); NEXT_PART(l_beq);
+f_cmpeqc_bne: FUSED(2); RC = (RA == LIT); NEXT_PART(l_bne);
+f_cmpltc_beq: FUSED(2); RC = (RA < LIT); NEXT_PART(l_beq);
+f_cmpltc_bne: FUSED(2); RC = (RA < LIT); NEXT_PART(l_bne);
+f_cmplec_beq: FUSED(2); RC = (RA <= LIT); NEXT_PART(l_beq);
+f_cmplec_bne: FUSED(2); RC = (RA <= LIT); NEXT_PART(l_bne);
+
+#undef RA
+#undef RB
+#undef RC
+#undef LIT
+#undef DISPATCH
+#undef EXECUTE_NEXT
+#undef FUSED
+#undef WATCHED
+#undef NEXT_PART
+
+done:
+    r[31] = 0;
+    if(trace != NULL){
+        trace_retire(trace, r);
+    }
+    memcpy(c->cpu.registers, r, sizeof(r));
+    c->cpu.program_counter = pc;
+    c->instructions += steps;
+
+    return status;
 }
 
-void raise_interrupt(Computer* c, char type, char keyval){
+bool raise_interrupt(Computer* c, char type, char keyval){
     assert(c);
 
-    if(c->cpu.interrupt_line){
-        return; // Does nothing if an interrupt line is already raised.
+    InterruptQueue* q = &c->cpu.interrupts;
+
+    unsigned long head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&q->tail, memory_order_acquire) >= q->depth){
+        atomic_fetch_add_explicit(&q->overflows, 1, memory_order_relaxed);
+        return false;
     }
-    
-    c->cpu.interrupt_nb = type;
-    c->cpu.interrupt_char = keyval;
-    
-    c->cpu.interrupt_line = true;
+
+    q->entries[head % q->depth] = (PendingInterrupt) {type, keyval};
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    // Raised after queuing, see take_interrupt()
+    atomic_thread_fence(memory_order_seq_cst);
+    atomic_store_explicit(&c->cpu.interrupt_line, true, memory_order_relaxed);
+
+    return true;
 }
 
-static char *special_reg(int r, char *reg){  
-    switch (r){
-        case 27: sprintf(reg, "BP"); break;
-        case 28: sprintf(reg, "LP"); break;
-        case 29: sprintf(reg, "SP"); break;
-        case 30: sprintf(reg, "XP"); break;
-        default: sprintf(reg, "R%i", r); break;
+bool set_interrupt_queue_depth(Computer* c, unsigned long depth){
+    assert(c);
+
+    if(depth == 0){
+        return false;
+    }
+
+    PendingInterrupt* entries = (PendingInterrupt *) malloc(depth * sizeof(PendingInterrupt));
+    if(entries == NULL){
+        return false;
     }
+
+    InterruptQueue* q = &c->cpu.interrupts;
+    free(q->entries);
+    q->entries = entries;
+    q->depth = depth;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&c->cpu.interrupt_line, false);
+
+    return true;
 }
 
-int disassemble(int instruction, char* buf){
-    assert(buf); // We assume that buf is large enough to store any disassembled instructions.
+unsigned long interrupt_overflows(Computer* c){
+    assert(c);
+    return atomic_load_explicit(&c->cpu.interrupts.overflows, memory_order_relaxed);
+}
 
+// Operand layouts of the instructions, for the disassembler
+typedef enum{
+    FORMAT_INVALID = 0,
+    FORMAT_HALT,
+    FORMAT_LD,     // LD(Ra, literal, Rc)
+    FORMAT_ST,     // ST(Rc, literal, Ra)
+    FORMAT_JMP,    // JMP(Ra, Rc)
+    FORMAT_BRANCH, // BEQ(Ra, target, Rc)
+    FORMAT_LDR,    // LDR(target, Rc)
+    FORMAT_OP,     // ADD(Ra, Rb, Rc)
+    FORMAT_OPC     // ADDC(Ra, literal, Rc)
+} Format;
+
+typedef struct{
+    char name[8]; // with its opening parenthesis
+    unsigned char length;
+    unsigned char format;
+} Mnemonic;
+
+#define MNEMONIC(name, format) {name "(", sizeof(name), format}
+
+static const Mnemonic mnemonics[64] = {
+    [0x00] = MNEMONIC("HALT", FORMAT_HALT),
+    [0x18] = MNEMONIC("LD", FORMAT_LD),
+    [0x19] = MNEMONIC("ST", FORMAT_ST),
+    [0x1B] = MNEMONIC("JMP", FORMAT_JMP),
+    [0x1D] = MNEMONIC("BEQ", FORMAT_BRANCH),
+    [0x1E] = MNEMONIC("BNE", FORMAT_BRANCH),
+    [0x1F] = MNEMONIC("LDR", FORMAT_LDR),
+
+    [0x20] = MNEMONIC("ADD", FORMAT_OP),
+    [0x21] = MNEMONIC("SUB", FORMAT_OP),
+    [0x22] = MNEMONIC("MUL", FORMAT_OP),
+    [0x23] = MNEMONIC("DIV", FORMAT_OP),
+    [0x24] = MNEMONIC("CMPEQ", FORMAT_OP),
+    [0x25] = MNEMONIC("CMPLT", FORMAT_OP),
+    [0x26] = MNEMONIC("CMPLE", FORMAT_OP),
+    [0x28] = MNEMONIC("AND", FORMAT_OP),
+    [0x29] = MNEMONIC("OR", FORMAT_OP),
+    [0x2A] = MNEMONIC("XOR", FORMAT_OP),
+    [0x2C] = MNEMONIC("SHL", FORMAT_OP),
+    [0x2D] = MNEMONIC("SHR", FORMAT_OP),
+    [0x2E] = MNEMONIC("SRA", FORMAT_OP),
+
+    [0x30] = MNEMONIC("ADDC", FORMAT_OPC),
+    [0x31] = MNEMONIC("SUBC", FORMAT_OPC),
+    [0x32] = MNEMONIC("MULC", FORMAT_OPC),
+    [0x33] = MNEMONIC("DIVC", FORMAT_OPC),
+    [0x34] = MNEMONIC("CMPEQC", FORMAT_OPC),
+    [0x35] = MNEMONIC("CMPLTC", FORMAT_OPC),
+    [0x36] = MNEMONIC("CMPLEC", FORMAT_OPC),
+    [0x38] = MNEMONIC("ANDC", FORMAT_OPC),
+    [0x39] = MNEMONIC("ORC", FORMAT_OPC),
+    [0x3A] = MNEMONIC("XORC", FORMAT_OPC),
+    [0x3C] = MNEMONIC("SHLC", FORMAT_OPC),
+    [0x3D] = MNEMONIC("SHRC", FORMAT_OPC),
+    [0x3E] = MNEMONIC("SRAC", FORMAT_OPC)
+};
+
+#undef MNEMONIC
+
+// Register names, as in reg_symbols, with their lengths
+static const struct{
+    char name[4];
+    unsigned char length;
+} registers[32] = {
+    {"R0", 2}, {"R1", 2}, {"R2", 2}, {"R3", 2}, {"R4", 2}, {"R5", 2}, {"R6", 2}, {"R7", 2},
+    {"R8", 2}, {"R9", 2}, {"R10", 3}, {"R11", 3}, {"R12", 3}, {"R13", 3}, {"R14", 3}, {"R15", 3},
+    {"R16", 3}, {"R17", 3}, {"R18", 3}, {"R19", 3}, {"R20", 3}, {"R21", 3}, {"R22", 3}, {"R23", 3},
+    {"R24", 3}, {"R25", 3}, {"R26", 3}, {"BP", 2}, {"LP", 2}, {"SP", 2}, {"XP", 2}, {"R31", 3}
+};
+
+static Format instruction_format(int instruction){
     int opcode = get_bits(instruction, 26, 6);
+    if(opcode == 0 && instruction != 0){ // An instruction with opcode 0 but not equal to 0 is not a valid instruction.
+        return FORMAT_INVALID;
+    }
+    return mnemonics[opcode].format;
+}
 
-    char ra[4];
-    special_reg(get_bits(instruction, 16, 5), ra);
+static char* put_register(char* p, int r){
+    memcpy(p, registers[r].name, 4);
+    return p + registers[r].length;
+}
 
-    char rb[4];
-    special_reg(get_bits(instruction, 11, 5), rb);
+// Writes $value in decimal
+static char* put_int(char* p, int value){
+    char digits[10];
+    int n = 0;
+    unsigned int u = value;
 
-    char rc[4];
-    special_reg(get_bits(instruction, 21, 5), rc);
+    if(value < 0){
+        *p++ = '-';
+        u = -u;
+    }
+    do{
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while(u != 0);
 
-    int lit = get_bits(instruction, 0, 16);
-        lit |= ((lit & 0x8000) ? 0xFFFF0000 : 0); // Extends the sign bit
+    while(n > 0){
+        *p++ = digits[--n];
+    }
+    return p;
+}
 
-    switch (opcode){
-        case 0x0: 
-            if(instruction != 0){ // An instruction with opcode 0 but not equal to 0 is not a valid instruction.
-                sprintf(buf, "INVALID"); 
-                return -1;
-            }
-            sprintf(buf, "HALT()"); 
-            return 0;
-            break; 
+// Writes the 8 lowercase hexadecimal digits of $value
+static char* put_hex(char* p, unsigned int value){
+    static const char hex[16] = "0123456789abcdef";
+    for(int i = 7; i >= 0; i--){
+        p[i] = hex[value & 0xF];
+        value >>= 4;
+    }
+    return p + 8;
+}
 
-        case 0x18: sprintf(buf, "LD(%s, %i, %s)", ra, lit, rc); break;       
-        case 0x19: sprintf(buf, "ST(%s, %i, %s)", rc, lit, ra); break;     
+static char* put_separator(char* p){
+    p[0] = ',';
+    p[1] = ' ';
+    return p + 2;
+}
 
-        case 0x1B: sprintf(buf, "JMP(%s, %s)", ra, rc); break;    
+/* Writes the disassembly of $instruction, of format $format, at $p and 
+   returns the end of the text (not terminated). $addr is the address of
+   the instruction, used with $symbolic to write the targets of branches 
+   and LDR as labels if they lie in [$start, $end), or as absolute 
+   addresses otherwise. */
+static char* put_instruction(char* p, int instruction, Format format, long addr,
+                             bool symbolic, long start, long end){
+
+    if(format == FORMAT_INVALID){
+        memcpy(p, "INVALID", 7);
+        return p + 7;
+    }
 
-        case 0x1D: sprintf(buf, "BEQ(%s, %i, %s)", ra, lit, rc); break;       
-        case 0x1E: sprintf(buf, "BNE(%s, %i, %s)", ra, lit, rc); break;         
-        case 0x1F: 
-            sprintf(buf, "LDR(%i, %s)", lit, rc); 
+    const Mnemonic* m = &mnemonics[get_bits(instruction, 26, 6)];
+    memcpy(p, m->name, sizeof(m->name));
+    p += m->length;
+
+    int ra = get_bits(instruction, 16, 5);
+    int rb = get_bits(instruction, 11, 5);
+    int rc = get_bits(instruction, 21, 5);
+    int lit = (short) get_bits(instruction, 0, 16); // Extends the sign bit
+
+    switch(format){
+        case FORMAT_HALT: break;
+        case FORMAT_LD:
+        case FORMAT_OPC:
+            p = put_separator(put_register(p, ra));
+            p = put_separator(put_int(p, lit));
+            p = put_register(p, rc);
+            break;
+        case FORMAT_ST:
+            p = put_separator(put_register(p, rc));
+            p = put_separator(put_int(p, lit));
+            p = put_register(p, ra);
+            break;
+        case FORMAT_JMP:
+            p = put_separator(put_register(p, ra));
+            p = put_register(p, rc);
             break;
+        case FORMAT_OP:
+            p = put_separator(put_register(p, ra));
+            p = put_separator(put_register(p, rb));
+            p = put_register(p, rc);
+            break;
+        case FORMAT_BRANCH:
+        case FORMAT_LDR:
+            if(format == FORMAT_BRANCH){
+                p = put_separator(put_register(p, ra));
+            }
+            if(symbolic){
+                long target = addr + 4 + 4 * (long) lit;
+                bool label = target >= start && target < end;
+                memcpy(p, label ? "L_" : "0x", 2);
+                p = put_hex(p + 2, target);
+            }
+            else{
+                p = put_int(p, lit);
+            }
+            p = put_register(put_separator(p), rc);
+            break;
+        default: break;
+    }
+
+    *p++ = ')';
+    return p;
+}
 
-        case 0x20: sprintf(buf, "ADD(%s, %s, %s)", ra, rb, rc); break;
-        case 0x21: sprintf(buf, "SUB(%s, %s, %s)", ra, rb, rc); break;
-        case 0x22: sprintf(buf, "MUL(%s, %s, %s)", ra, rb, rc); break;
-        case 0x23: sprintf(buf, "DIV(%s, %s, %s)", ra, rb, rc); break;
+int disassemble(int instruction, char* buf){
+    assert(buf); // We assume that buf is large enough to store any disassembled instructions.
+
+    Format format = instruction_format(instruction);
+    char* end = put_instruction(buf, instruction, format, 0, false, 0, 0);
+    *end = '\0';
 
-        case 0x24: sprintf(buf, "CMPEQ(%s, %s, %s)", ra, rb, rc); break;
-        case 0x25: sprintf(buf, "CMPLT(%s, %s, %s)", ra, rb, rc); break;       
-        case 0x26: sprintf(buf, "CMPLE(%s, %s, %s)", ra, rb, rc); break;   
+    return (format == FORMAT_INVALID) ? -1 : 0;
+}
+
+int disassemble_at(int instruction, long addr, char* buf){
+    assert(buf);
 
-        case 0x28: sprintf(buf, "AND(%s, %s, %s)", ra, rb, rc); break;       
-        case 0x29: sprintf(buf, "OR(%s, %s, %s)", ra, rb, rc); break;        
-        case 0x2A: sprintf(buf, "XOR(%s, %s, %s)", ra, rb, rc); break;  
+    // No range: every target is written as an absolute address
+    Format format = instruction_format(instruction);
+    char* end = put_instruction(buf, instruction, format, addr, true, 0, 0);
+    *end = '\0';
 
-        case 0x2C: sprintf(buf, "SHL(%s, %s, %s)", ra, rb, rc); break;
-        case 0x2D: sprintf(buf, "SHR(%s, %s, %s)", ra, rb, rc); break;
-        case 0x2E: sprintf(buf, "SRA(%s, %s, %s)", ra, rb, rc); break;
+    return (format == FORMAT_INVALID) ? -1 : 0;
+}
 
-        case 0x30: sprintf(buf, "ADDC(%s, %i, %s)", ra, lit, rc); break;
-        case 0x31: sprintf(buf, "SUBC(%s, %i, %s)", ra, lit, rc); break;
-        case 0x32: sprintf(buf, "MULC(%s, %i, %s)", ra, lit, rc); break;
-        case 0x33: sprintf(buf, "DIVC(%s, %i, %s)", ra, lit, rc); break;  
+void init_disassembly(Disassembly* d, bool symbolic){
+    assert(d);
+    d->lines = NULL;
+    d->nb_lines = 0;
+    d->lines_capacity = 0;
+    d->text = NULL;
+    d->text_capacity = 0;
+    d->symbolic = symbolic;
+}
 
-        case 0x34: sprintf(buf, "CMPEQC(%s, %i, %s)", ra, lit, rc); break;        
-        case 0x35: sprintf(buf, "CMPLTC(%s, %i, %s)", ra, lit, rc); break;       
-        case 0x36: sprintf(buf, "CMPLEC(%s, %i, %s)", ra, lit, rc); break;  
+void free_disassembly(Disassembly* d){
+    assert(d);
+    free(d->lines);
+    free(d->text);
+    init_disassembly(d, d->symbolic);
+}
 
-        case 0x38: sprintf(buf, "ANDC(%s, %i, %s)", ra, lit, rc); break;        
-        case 0x39: sprintf(buf, "ORC(%s, %i, %s)", ra, lit, rc); break;
-        case 0x3A: sprintf(buf, "XORC(%s, %i, %s)", ra, lit, rc); break;
+long disassemble_range(Computer* c, long start, long end, Disassembly* out){
+    assert(c);
+    assert(out);
 
-        case 0x3C: sprintf(buf, "SHLC(%s, %i, %s)", ra, lit, rc); break;
-        case 0x3D: sprintf(buf, "SHRC(%s, %i, %s)", ra, lit, rc); break;
-        case 0x3E: sprintf(buf, "SRAC(%s, %i, %s)", ra, lit, rc); break;
+    start &= ~3L;
+    long n = (end > start) ? (end - start + 3) / 4 : 0;
 
-        default: 
-            strcpy(buf, "INVALID"); 
+    // Sized once for the longest instructions, so that lines need no checks
+    if(n > out->lines_capacity){
+        DisassemblyLine* lines = (DisassemblyLine *) realloc(out->lines, n * sizeof(DisassemblyLine));
+        if(lines == NULL){
             return -1;
-            break;
+        }
+        out->lines = lines;
+        out->lines_capacity = n;
+    }
+    if(n * DISASSEMBLY_MAX > out->text_capacity){
+        char* text = (char *) realloc(out->text, n * DISASSEMBLY_MAX);
+        if(text == NULL){
+            return -1;
+        }
+        out->text = text;
+        out->text_capacity = n * DISASSEMBLY_MAX;
+    }
+
+    // Targets can come after their branches, all lines are cleared first
+    for(long i = 0; i < n; i++){
+        out->lines[i].target = false;
+    }
+
+    char* p = out->text;
+    for(long i = 0; i < n; i++){
+        DisassemblyLine* line = &out->lines[i];
+        long addr = start + 4 * i;
+        int word = get_word(c, addr);
+        Format format = instruction_format(word);
+
+        line->addr = addr;
+        line->word = word;
+        line->valid = format != FORMAT_INVALID;
+        line->text = p - out->text;
+
+        if(out->symbolic && (format == FORMAT_BRANCH || format == FORMAT_LDR)){
+            long target = addr + 4 + 4 * (long) (short) get_bits(word, 0, 16);
+            if(target >= start && target < end){
+                out->lines[(target - start) / 4].target = true;
+            }
+        }
+
+        p = put_instruction(p, word, format, addr, out->symbolic, start, end);
+        *p++ = '\0';
     }
 
-    return 0;
+    out->nb_lines = n;
+    return n;
 }
 
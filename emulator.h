@@ -4,6 +4,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 /* suggested parameters for init_computer() calls by the GUI
    Editing PROGRAM_MEMORY (32MB is plenty) and VIDEO_MEMORY most likely will
@@ -14,11 +16,57 @@
 #define VIDEO_MEMORY_SZ (600 * 400 * 4) // must be 3:2 aspect ratio
 #define KERNEL_MEMORY_SZ 800
 
+// Granularity at which writes to memory are tracked (see take_snapshot())
+#define MEMORY_PAGE_SHIFT 12
+#define MEMORY_PAGE_SZ (1 << MEMORY_PAGE_SHIFT)
+
+// Writes to video memory are tracked by spans of 64 bytes (16 pixels)
+#define VIDEO_SPAN_SHIFT 6
+
+// Default number of interrupts that can wait for the CPU (see raise_interrupt())
+#define INTERRUPT_QUEUE_DEPTH 64
+
+// Flags kept for each page of memory
+#define PAGE_DIRTY 0x01 // written since the last snapshot (or since init_computer())
+#define PAGE_CODE 0x02 // some of its slots were decoded into the instruction cache
+#define PAGE_CHANGED 0x04 // written since the last checkpoint of the history (see history.h)
+#define PAGE_BREAKPOINT 0x08 // holds at least one breakpoint (see add_breakpoint())
+#define PAGE_WATCH_READ 0x10 // overlaps a watchpoint on loads (see add_watchpoint())
+#define PAGE_WATCH_WRITE 0x20 // overlaps a watchpoint on stores
+
+// Accesses a watchpoint stops on
+#define WATCH_READ 0x1
+#define WATCH_WRITE 0x2
+
+/* Interrupt raised by a device, waiting to be handed to the interrupt handler */
+typedef struct{
+    char nb;
+    char character;
+} PendingInterrupt;
+
+/* Ring of the interrupts waiting for the CPU. Interrupts are raised by a
+   single thread and delivered by the one running the CPU, each of them
+   only writes its own counter so that neither ever takes a lock. */
+typedef struct{
+    PendingInterrupt* entries;
+    unsigned long depth;
+    atomic_ulong head; // number of interrupts queued by raise_interrupt()
+    atomic_ulong tail; // number of interrupts delivered to the CPU
+    atomic_ulong overflows; // interrupts dropped because the queue was full
+} InterruptQueue;
+
+/* Range of memory whose loads and/or stores by the CPU stop run() */
+typedef struct{
+    long start;
+    long end; // exclusive
+    int access; // WATCH_READ, WATCH_WRITE or both
+} Watchpoint;
+
 typedef struct{
 	 
     long program_counter;
     
-    int registers[31];
+    int registers[32]; // registers[31] is kept at 0 so that R31 can be read like any other register
     
     char *memory;
 
@@ -26,13 +74,32 @@ typedef struct{
     char *video_memory;
     char *kernel_memory;
 
-    bool interrupt_line;
+    atomic_bool interrupt_line; // raised while interrupts are waiting in $interrupts
 
-    char interrupt_nb;
-    char interrupt_char;
+    InterruptQueue interrupts;
 } CPU;
 
-typedef struct{
+struct Computer;
+struct DecodedInstruction;
+
+typedef void (*InstructionHandler)(struct Computer* c, const struct DecodedInstruction* instr, 
+                                   bool kernel_mode);
+
+/* Instruction word found at a 4-byte slot of memory, decoded once and kept
+   in the computer's instruction cache until the slot is written to. */
+typedef struct DecodedInstruction{
+
+    InstructionHandler handler; // NULL while the slot has not been decoded yet
+    int literal; // sign-extended 16-bit literal
+    unsigned char op; // dispatch index used by run(), the opcode of valid instructions or a fused sequence starting here
+    unsigned char opcode;
+    unsigned char ra;
+    unsigned char rb;
+    unsigned char rc;
+    bool translated; // part of a block of native code generated by the JIT (see jit.h)
+} DecodedInstruction;
+
+typedef struct Computer{
 
     CPU cpu;
     
@@ -42,7 +109,33 @@ typedef struct{
     long kernel_memory_size;
     long latest_accessed; // address of the word most recently loaded/stored from/into memory
     bool halted; // was the HALT() instruction executed (stopping the program's execution)
+    uint64_t instructions; // number of instructions executed since init_computer()
     unsigned program_size; // user-space program size (code + stack)
+    long handler_start; // address of the first instruction of the interrupt handler
+    unsigned handler_size; // size of the interrupt handler binary, 0 if none was loaded
+
+    DecodedInstruction* instruction_cache; // one entry per 4-byte slot of memory, filled lazily
+    long cache_slots;
+
+    struct Jit* jit; // binary translator used by run(), NULL unless jit_attach() was called
+    struct Profile* profile; // execution profiler (see profile.h), NULL unless profile_attach() was called
+    struct Trace* trace; // execution trace being recorded (see trace.h), NULL unless trace_start() was called
+    struct History* history; // checkpoints for time-travel debugging (see history.h), NULL unless history_attach() was called
+
+    unsigned char* page_flags; // PAGE_* flags of each page of memory
+    long nb_pages;
+    struct Snapshot* snapshot; // state restore_snapshot() returns to, NULL until take_snapshot()
+
+    uint64_t* video_dirty; // one bit per span of video memory written since taken by take_dirty_video()
+    long video_spans;
+
+    long* breakpoints; // addresses of the breakpoints, in increasing order
+    int nb_breakpoints;
+    Watchpoint* watchpoints;
+    int nb_watchpoints;
+    bool watch_hit; // a load or store hit a watchpoint since run() was called
+    long watch_address; // address of the last access that hit a watchpoint
+    int watch_access; // WATCH_READ or WATCH_WRITE, for that access
 } Computer;
 
 static char* reg_symbols[32] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9",
@@ -51,19 +144,33 @@ static char* reg_symbols[32] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7",
                                 "LP", "SP", "XP", "R31"};
 
 /* Initializes the computer data structure, must be run before any other function
-   manipulating the computer */
+   manipulating the computer. Memory starts zero-filled and is only backed
+   by physical pages once it is touched, so initialization is immediate
+   whatever the memory sizes. */
 void init_computer(Computer* c, long program_memory_size, 
                                 long video_memory_size, long kernel_memory_size);
 
 /*  Reads a 32-bit word at the address $addr from the computer's 
     memory.
-    Return value: the word found at addr. If addr > c -> 
-    memory_size, 0 will be returned. If addr is a valid address 
-    found at the boundary of the computer's memory (i.e. there is 
-    less than a full 4-byte word to return, then the function 
-    will return the valid bytes followed by a padding of 0-bytes. */
+    Return value: the word found at addr. If addr is negative or
+    addr >= c -> memory_size, 0 will be returned. If addr is a valid
+    address found at the boundary of the computer's memory (i.e. 
+    there is less than a full 4-byte word to return, then the 
+    function will return the valid bytes followed by a padding of 
+    0-bytes. 
+    get_word() only peeks at memory (for instruction fetches, the 
+    GUI...) and leaves c -> latest_accessed untouched. */
 int get_word(Computer* c, long addr);
 
+/*  get_word() for a load executed by the CPU (LD, LDR): also 
+    records $addr in c -> latest_accessed, as store_word() does. */
+int load_word(Computer* c, long addr);
+
+/*  Writes the 32-bit word $word at the address $addr of the
+    computer's memory. Bytes that would fall past the end of the 
+    memory are dropped. */
+void store_word(Computer* c, long addr, int word);
+
 /* Returns the value of a given register of computer c, reg is 
 the register's number between 0 and 31. */
 int get_register(Computer* c, int reg);
@@ -71,15 +178,56 @@ int get_register(Computer* c, int reg);
 /* Frees all resources allocated for the computer data structure. */
 void free_computer(Computer* c);
 
+/* Result of load() and load_interrupt_handler() */
+typedef enum{
+    LOAD_OK = 0,
+    LOAD_READ_ERROR = -1, // the binary could not be read
+    LOAD_TOO_LARGE = -2 // the binary does not fit in its part of memory
+} LoadStatus;
+
 /* Loads the binary at the beginning of the computer's memory,
-   c -> program_size becomes the size of the binary in bytes. */
-void load(Computer* c, FILE* binary);
+   c -> program_size becomes the size of the binary in bytes. 
+   The binary is copied, the file can be changed afterwards.
+   On error, c -> program_size is left unchanged. */
+LoadStatus load(Computer* c, FILE* binary);
 
 /* Loads the interrupt handler binary in $c's kernel memory.
    $binary can be NULL, in which case the function does nothing.
    The $binary is placed after the kernel's data structures
-   (see statement for a diagram of kernel memory). */
-void load_interrupt_handler(Computer* c, FILE* binary);
+   (see statement for a diagram of kernel memory), at 
+   c -> handler_start, and c -> handler_size becomes its size
+   in bytes. */
+LoadStatus load_interrupt_handler(Computer* c, FILE* binary);
+
+/* Human-readable description of $status */
+const char* load_status_message(LoadStatus status);
+
+/* Finds the first run of consecutive spans of video memory written since
+   they were last taken, starting at or after the offset $from (in bytes 
+   from the start of video memory). Returns false if there is none, 
+   otherwise stores the run in [*start, *end) (offsets in bytes, within
+   video memory) and marks it as clean. */
+bool take_dirty_video(Computer* c, long from, long* start, long* end);
+
+/* Marks the whole video memory as clean, e.g. after a full redraw */
+void clear_dirty_video(Computer* c);
+
+/* Records the current state of $c (PC, registers, memory, counters) as
+   the one restore_snapshot() returns to. Only the pages written since the 
+   previous snapshot (or since init_computer()) are copied. The interrupt
+   queue is not part of it: interrupts raised meanwhile stay pending.
+   Returns false if memory ran out, the previous snapshot is then kept. */
+bool take_snapshot(Computer* c);
+
+/* Brings $c back to its state at the last take_snapshot(). Only the
+   pages written since are copied back, the decoded and translated code
+   of the other ones is kept. Returns false if there is no snapshot. */
+bool restore_snapshot(Computer* c);
+
+/* Overwrites the page $page of $c's memory with the MEMORY_PAGE_SZ bytes
+   at $data (fewer for a partial last page), or with zeros if $data is 
+   NULL. Code decoded or translated from the page is discarded. */
+void write_page(Computer* c, long page, const char* data);
 
 /* Runs one fetch + decode + execute cycle of $c's CPU,
    If an interrupt line is raised (and the computer is not
@@ -93,10 +241,92 @@ void load_interrupt_handler(Computer* c, FILE* binary);
    return. */
 void execute_step(Computer* c);
 
-/* Raise an interrupt line of computer $c if no other already is. 
-   Otherwise, this does nothing.  $type is the interrupt number
-   while $keyval is the associated character. */
-void raise_interrupt(Computer* c, char type, char keyval);
+/* Same as execute_step() taking an interrupt, for the interrupt $nb with
+   the character $character instead of one from the queue: hands it to
+   the interrupt handler and executes the handler's first instruction. */
+void execute_interrupt(Computer* c, char nb, char character);
+
+/* Reasons for run() to hand control back to its caller */
+typedef enum{
+    RUN_BUDGET_EXHAUSTED = 0,
+    RUN_HALTED,
+    RUN_INTERRUPT,
+    RUN_BREAKPOINT,
+    RUN_WATCHPOINT
+} RunStatus;
+
+/* Optional conditions on which run() stops before its budget runs out */
+typedef struct{
+    bool on_interrupt; // stop before handing control to the interrupt handler
+    long breakpoint; // stop before executing the instruction at this address (-1 for none)
+    bool hold_interrupts; // leave raised interrupts waiting, as if the CPU was in kernel mode
+    bool breakpoints; // stop at the breakpoints and watchpoints of the computer (see add_breakpoint())
+} StopConditions;
+
+/* Executes up to $max_steps instructions of $c's CPU, with the same
+   semantics as as many calls to execute_step(), but without returning
+   to the caller in between. Returns as soon as HALT() is executed, 
+   a stop condition of $stop is met or the budget is exhausted. 
+   A breakpoint on the instruction run() starts from is ignored, so 
+   that execution can be resumed from it, as is one on the first 
+   instruction of the interrupt handler when an interrupt is handed to
+   it. A watchpoint stops run() right after the instruction that hit it.
+   The time run() takes does not depend on the breakpoints and 
+   watchpoints, except for the pages of memory they are on. */
+RunStatus run(Computer* c, uint64_t max_steps, StopConditions stop);
+
+/* Same as run(), but always executes instructions with the interpreter,
+   even when a JIT is attached to $c. */
+RunStatus interpret(Computer* c, uint64_t max_steps, StopConditions stop);
+
+/* Sets a breakpoint on the instruction at $addr, which must be a 
+   word-aligned address of memory (returns false otherwise or if memory
+   runs out). Breakpoints stop run() before the instruction is executed,
+   with RUN_BREAKPOINT, if it is given $stop.breakpoints. Only the pages
+   holding breakpoints are checked: the slots of the instructions they 
+   are on are dispatched to the check, which the JIT never translates. */
+bool add_breakpoint(Computer* c, long addr);
+
+/* Removes the breakpoint at $addr, returns false if there is none */
+bool remove_breakpoint(Computer* c, long addr);
+
+/* Whether a breakpoint is set at $addr */
+bool has_breakpoint(Computer* c, long addr);
+
+/* Sets a watchpoint on the loads ($access has WATCH_READ) and/or the 
+   stores (WATCH_WRITE) by the CPU of any of the bytes of [$start, $end),
+   returns false if the range is empty or memory runs out. A hit is
+   recorded in c -> watch_hit, c -> watch_address and c -> watch_access
+   and stops run(), with RUN_WATCHPOINT, if it is given 
+   $stop.breakpoints. Only accesses to the pages of a watchpoint are 
+   compared to the watchpoints. */
+bool add_watchpoint(Computer* c, long start, long end, int access);
+
+/* Removes the watchpoints on exactly [$start, $end), returns false if 
+   there is none */
+bool remove_watchpoint(Computer* c, long start, long end);
+
+/* Removes every breakpoint and watchpoint of $c */
+void clear_breakpoints(Computer* c);
+
+/* Queues an interrupt of computer $c and raises its interrupt line.
+   $type is the interrupt number while $keyval is the associated 
+   character. Interrupts are handed to the interrupt handler one at a 
+   time and in order, each time the CPU is back in user mode.
+   Can be called from another thread than the one running $c without
+   locking, as long as a single thread raises interrupts.
+   Returns false, and counts an overflow, if the queue is full. */
+bool raise_interrupt(Computer* c, char type, char keyval);
+
+/* Sets the number of interrupts that can wait in the queue of $c 
+   (INTERRUPT_QUEUE_DEPTH after init_computer()), the waiting ones are
+   dropped. Must not be called while $c runs or interrupts are raised.
+   Returns false if $depth is 0 or cannot be allocated. */
+bool set_interrupt_queue_depth(Computer* c, unsigned long depth);
+
+/* Number of interrupts raise_interrupt() dropped because the queue of 
+   $c was full, since init_computer(). */
+unsigned long interrupt_overflows(Computer* c);
 
 /* Stores a textual representation of the disassembly of 
    $instruction in the buffer $buf. We assume that $buf
@@ -108,5 +338,54 @@ void raise_interrupt(Computer* c, char type, char keyval);
    value otherwise. */
 int disassemble(int instruction, char* buf);
 
+/* disassemble() for the instruction at $addr: the target of a BEQ, 
+   BNE or LDR is written as its absolute address "0xxxxxxxxx" rather
+   than as the literal offset. */
+int disassemble_at(int instruction, long addr, char* buf);
+
+/* Longest text disassemble() or disassemble_range() writes for an
+   instruction, terminating '\0' included. */
+#define DISASSEMBLY_MAX 32
+
+/* One instruction of a disassembled range */
+typedef struct{
+    long addr;
+    int word;
+    bool valid; // false if $word is not a valid instruction
+    bool target; // the target of a BEQ, BNE or LDR of the range
+    long text; // offset of the '\0'-terminated disassembly in the text arena
+} DisassemblyLine;
+
+/* Disassembly of a range of memory: its lines and an arena holding their
+   text. The buffers are kept from one call of disassemble_range() to the
+   next and only grow, so refreshing a listing allocates nothing. */
+typedef struct{
+    DisassemblyLine* lines;
+    long nb_lines;
+    long lines_capacity;
+    char* text;
+    long text_capacity;
+    bool symbolic; // write branch targets as labels (see disassemble_range())
+} Disassembly;
+
+/* Initializes an empty disassembly, with symbolic branch targets if 
+   $symbolic. */
+void init_disassembly(Disassembly* d, bool symbolic);
+
+/* Releases the buffers of $d. */
+void free_disassembly(Disassembly* d);
+
+/* Disassembles the words of [$start, $end) of the memory of $c into $out
+   in one pass, replacing its previous lines. $start is rounded down to a
+   word. The text of the i-th line is $out->text + $out->lines[i].text.
+   
+   Without $out->symbolic, lines read as disassemble() writes them. With
+   it, the target of a BEQ, BNE or LDR is written as the label 
+   "L_xxxxxxxx" (its address in hexadecimal) when it lies in the range, 
+   and the line of that address has $target set, or as its absolute 
+   address "0xxxxxxxxx" otherwise, instead of the literal offset.
+   Returns the number of lines, or -1 if the buffers cannot grow. */
+long disassemble_range(Computer* c, long start, long end, Disassembly* out);
+
 
 #endif
@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "emulator.h"
+#include "jit.h"
+
+/* Batch runner: executes many independent jobs on a pool of worker
+   threads, each job on its own computer, and prints one aggregated
+   report.
+
+   Jobs are read from a file (or stdin), one per line:
+       program.bin handler.bin input.txt budget
+   where handler.bin and input.txt can be "-" for none, and budget is the
+   largest number of instructions the job may execute. Empty lines and
+   lines starting with # are ignored.
+
+   The bytes of input.txt are typed on the keyboard of the computer: each
+   of them is raised as a key press then a key release interrupt, one
+   interrupt every -i instructions.
+
+   Jobs are dealt to the workers round-robin. Each worker runs the jobs
+   of its own queue, newest first, then steals the oldest jobs of the
+   other queues. Workers share nothing but the job list (read-only) and
+   the result array (one slot per job).
+
+   Each job runs in a child process of its worker, which writes its 
+   result into the (shared) result array: a job that crashes the emulator,
+   e.g. by dividing by zero, then fails alone instead of ending the farm.
+
+   The report is CSV, one line per job in the order of the job file:
+   job,program,status,instructions,seconds,program_hash,video_hash,kernel_hash,registers
+   where status is halted, budget, error or fault (the job crashed the
+   emulator, see the signal on stderr), hashes are 64-bit FNV-1a (over
+   8-byte words) of each part of memory and registers are R0 to R30 in hexadecimal. */
+
+// Default number of instructions between two interrupts of the scripted input
+#define INPUT_INTERVAL 10000
+
+#define MAX_LINE_LEN 4096
+
+typedef struct{
+    char* program;
+    char* handler; // NULL for none
+    char* input; // NULL for none
+    uint64_t budget;
+} Job;
+
+typedef enum{
+    JOB_HALTED,
+    JOB_BUDGET_EXHAUSTED,
+    JOB_ERROR,
+    JOB_FAULT
+} JobStatus;
+
+typedef struct{
+    JobStatus status;
+    uint64_t instructions;
+    double seconds;
+    uint64_t program_hash;
+    uint64_t video_hash;
+    uint64_t kernel_hash;
+    int registers[31];
+} JobResult;
+
+/* Jobs waiting for a worker: its owner takes them at the bottom, other
+   workers steal them at the top. */
+typedef struct{
+    pthread_mutex_t lock;
+    int* jobs; // indices in Farm.jobs
+    int top;
+    int bottom; // exclusive
+} WorkQueue;
+
+struct Farm;
+
+typedef struct{
+    struct Farm* farm;
+    int id;
+    pthread_t thread;
+    WorkQueue queue;
+    uint64_t steals; // jobs taken from the queues of other workers
+} Worker;
+
+typedef struct Farm{
+    Job* jobs;
+    int nb_jobs;
+    JobResult* results; // shared with the child processes running the jobs
+    Worker* workers;
+    int nb_workers;
+    uint64_t input_interval;
+    bool use_jit;
+} Farm;
+
+static void usage(const char* name){
+    fprintf(stderr, "Usage: %s [options] jobs.txt    (- for stdin)\n", name);
+    fprintf(stderr, "  -j WORKERS    number of worker threads (default: one per core)\n");
+    fprintf(stderr, "  -i COUNT      instructions between two interrupts of the scripted input (default: %d)\n", INPUT_INTERVAL);
+    fprintf(stderr, "  -I            interpret only, without the JIT\n");
+}
+
+static double get_time_seconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 64-bit FNV-1a of $size bytes at $p, taken 8 bytes at a time (memory is
+   large and mostly zero, hashing it byte by byte would cost more than 
+   running most jobs) */
+static uint64_t hash_bytes(const char* p, long size){
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    long i = 0;
+
+    for(; i + 8 <= size; i += 8){
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        hash ^= word;
+        hash *= 0x100000001b3ULL;
+    }
+    for(; i < size; i++){
+        hash ^= (unsigned char) p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Parsing of the job file */
+
+static char* optional_path(const char* field){
+    return (strcmp(field, "-") == 0) ? NULL : strdup(field);
+}
+
+/* Reads the jobs of $fp into $farm. Returns false, after reporting the
+   line, on a malformed job. */
+static bool read_jobs(FILE* fp, Farm* farm){
+    char line[MAX_LINE_LEN];
+    char program[MAX_LINE_LEN], handler[MAX_LINE_LEN], input[MAX_LINE_LEN];
+    unsigned long long budget;
+    int capacity = 0;
+    int line_nb = 0;
+
+    while(fgets(line, sizeof(line), fp) != NULL){
+        line_nb++;
+
+        char first;
+        if(sscanf(line, " %c", &first) != 1 || first == '#'){
+            continue;
+        }
+
+        if(sscanf(line, "%s %s %s %llu", program, handler, input, &budget) != 4){
+            fprintf(stderr, "Line %d: expected \"program handler input budget\"\n", line_nb);
+            return false;
+        }
+
+        if(farm->nb_jobs == capacity){
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            Job* jobs = realloc(farm->jobs, capacity * sizeof(Job));
+            if(jobs == NULL){
+                fprintf(stderr, "Out of memory\n");
+                return false;
+            }
+            farm->jobs = jobs;
+        }
+
+        Job* job = &farm->jobs[farm->nb_jobs++];
+        job->program = strdup(program);
+        job->handler = optional_path(handler);
+        job->input = optional_path(input);
+        job->budget = budget;
+    }
+
+    return true;
+}
+
+/* Execution of one job */
+
+// Reads the whole file at $path, NULL if it cannot be read
+static char* read_file(const char* path, long* size){
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL){
+        return NULL;
+    }
+
+    char* data = NULL;
+    if(fseek(fp, 0, SEEK_END) == 0 && (*size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0){
+        data = malloc(*size + 1);
+        if(data != NULL && fread(data, 1, *size, fp) != (size_t) *size){
+            free(data);
+            data = NULL;
+        }
+    }
+
+    fclose(fp);
+    return data;
+}
+
+static bool load_file(Computer* c, const char* path, bool handler, int job_nb){
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL){
+        fprintf(stderr, "Job %d: cannot open %s\n", job_nb, path);
+        return false;
+    }
+
+    LoadStatus status = handler ? load_interrupt_handler(c, fp) : load(c, fp);
+    fclose(fp);
+    if(status != LOAD_OK){
+        fprintf(stderr, "Job %d: cannot load %s: %s\n", job_nb, path, load_status_message(status));
+        return false;
+    }
+    return true;
+}
+
+static void run_job(Farm* farm, int job_nb, Computer* c){
+    const Job* job = &farm->jobs[job_nb];
+    JobResult* result = &farm->results[job_nb];
+    double start = get_time_seconds();
+
+    memset(result, 0, sizeof(*result));
+    result->status = JOB_ERROR;
+
+    char* input = NULL;
+    long input_size = 0;
+    if(job->input != NULL && (input = read_file(job->input, &input_size)) == NULL){
+        fprintf(stderr, "Job %d: cannot read %s\n", job_nb, job->input);
+        return;
+    }
+
+    init_computer(c, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+    if(farm->use_jit){
+        jit_attach(c); // falls back to the interpreter if not supported by the host
+    }
+
+    if(load_file(c, job->program, false, job_nb) &&
+       (job->handler == NULL || load_file(c, job->handler, true, job_nb))){
+
+        StopConditions no_stop = {.on_interrupt = false, .breakpoint = -1};
+        RunStatus status = RUN_BUDGET_EXHAUSTED;
+        long next_event = 0; // even: press of input[next_event / 2], odd: its release
+
+        // The first interrupt comes after a full interval, once the program had time to set up its stack
+        while(c->instructions < job->budget){
+            uint64_t batch = job->budget - c->instructions;
+            if(batch > farm->input_interval){
+                batch = farm->input_interval;
+            }
+
+            status = run(c, batch, no_stop);
+            if(status == RUN_HALTED){
+                break;
+            }
+
+            if(next_event < 2 * input_size &&
+               raise_interrupt(c, next_event & 1, input[next_event / 2])){
+                next_event++;
+            }
+        }
+
+        result->status = (status == RUN_HALTED) ? JOB_HALTED : JOB_BUDGET_EXHAUSTED;
+        result->instructions = c->instructions;
+        result->program_hash = hash_bytes(c->cpu.program_memory, c->program_memory_size);
+        result->video_hash = hash_bytes(c->cpu.video_memory, c->video_memory_size);
+        result->kernel_hash = hash_bytes(c->cpu.kernel_memory, c->kernel_memory_size);
+        for(int i = 0; i < 31; i++){
+            result->registers[i] = get_register(c, i);
+        }
+    }
+
+    free_computer(c);
+    free(input);
+    result->seconds = get_time_seconds() - start;
+}
+
+/* Runs job $job_nb in a child process, or in this thread if no child can
+   be forked. The job is reported as a fault if the child does not exit. */
+static void run_isolated_job(Farm* farm, int job_nb){
+    Computer computer;
+    double start = get_time_seconds();
+
+    pid_t pid = fork();
+    if(pid == 0){
+        run_job(farm, job_nb, &computer);
+        _exit(0);
+    }
+    if(pid < 0){
+        run_job(farm, job_nb, &computer);
+        return;
+    }
+
+    int status;
+    if(waitpid(pid, &status, 0) == pid && !WIFEXITED(status)){
+        JobResult* result = &farm->results[job_nb];
+        memset(result, 0, sizeof(*result));
+        result->status = JOB_FAULT;
+        result->seconds = get_time_seconds() - start;
+        fprintf(stderr, "Job %d: %s\n", job_nb,
+                WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "did not exit");
+    }
+}
+
+/* Workers */
+
+// Takes the newest job of $worker's own queue, -1 if it is empty
+static int pop_job(Worker* worker){
+    WorkQueue* q = &worker->queue;
+    int job = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if(q->bottom > q->top){
+        job = q->jobs[--q->bottom];
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return job;
+}
+
+// Takes the oldest job of $victim's queue, -1 if it is empty
+static int steal_job(Worker* victim){
+    WorkQueue* q = &victim->queue;
+    int job = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if(q->bottom > q->top){
+        job = q->jobs[q->top++];
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return job;
+}
+
+static void* worker_thread(void* arg){
+    Worker* worker = (Worker*) arg;
+    Farm* farm = worker->farm;
+
+    while(true){
+        int job = pop_job(worker);
+
+        // No job is ever added: once every queue is empty, the work is done
+        for(int i = 1; job < 0 && i < farm->nb_workers; i++){
+            job = steal_job(&farm->workers[(worker->id + i) % farm->nb_workers]);
+            if(job >= 0){
+                worker->steals++;
+            }
+        }
+
+        if(job < 0){
+            return NULL;
+        }
+
+        run_isolated_job(farm, job);
+    }
+}
+
+/* Report */
+
+static void print_report(Farm* farm){
+    static const char* const status_names[] = {"halted", "budget", "error", "fault"};
+
+    printf("job,program,status,instructions,seconds,program_hash,video_hash,kernel_hash,registers\n");
+
+    for(int i = 0; i < farm->nb_jobs; i++){
+        const JobResult* r = &farm->results[i];
+
+        printf("%d,%s,%s,%lu,%.6f,%016lx,%016lx,%016lx,", i, farm->jobs[i].program,
+               status_names[r->status], (unsigned long) r->instructions, r->seconds,
+               (unsigned long) r->program_hash, (unsigned long) r->video_hash,
+               (unsigned long) r->kernel_hash);
+        for(int j = 0; j < 31; j++){
+            printf("%.8x%s", r->registers[j], (j < 30) ? " " : "\n");
+        }
+    }
+}
+
+int main(int argc, char** argv){
+    Farm farm = {0};
+    farm.nb_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    farm.input_interval = INPUT_INTERVAL;
+    farm.use_jit = true;
+
+    int opt;
+    while((opt = getopt(argc, argv, "j:i:Ih")) != -1){
+        switch(opt){
+            case 'j': farm.nb_workers = atoi(optarg); break;
+            case 'i': farm.input_interval = strtoull(optarg, NULL, 10); break;
+            case 'I': farm.use_jit = false; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if(optind != argc - 1 || farm.nb_workers < 1 || farm.input_interval < 1){
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* fp = (strcmp(argv[optind], "-") == 0) ? stdin : fopen(argv[optind], "r");
+    if(fp == NULL){
+        fprintf(stderr, "Cannot open %s\n", argv[optind]);
+        return 1;
+    }
+    bool parsed = read_jobs(fp, &farm);
+    if(fp != stdin){
+        fclose(fp);
+    }
+    if(!parsed){
+        return 1;
+    }
+
+    if(farm.nb_workers > farm.nb_jobs){
+        farm.nb_workers = (farm.nb_jobs > 0) ? farm.nb_jobs : 1;
+    }
+
+    size_t results_size = (farm.nb_jobs + 1) * sizeof(JobResult); // mmap() rejects an empty mapping
+    farm.results = mmap(NULL, results_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(farm.results == MAP_FAILED){
+        farm.results = NULL;
+    }
+    farm.workers = calloc(farm.nb_workers, sizeof(Worker));
+    int* slots = malloc((farm.nb_jobs + 1) * sizeof(int));
+    if(farm.results == NULL || farm.workers == NULL || slots == NULL){
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Deals the jobs round-robin, the queue of worker w holds jobs w, w + n, w + 2n...
+    int used = 0;
+    for(int w = 0; w < farm.nb_workers; w++){
+        Worker* worker = &farm.workers[w];
+        worker->farm = &farm;
+        worker->id = w;
+
+        WorkQueue* q = &worker->queue;
+        pthread_mutex_init(&q->lock, NULL);
+        q->jobs = slots + used;
+        q->top = 0;
+        q->bottom = 0;
+        for(int job = w; job < farm.nb_jobs; job += farm.nb_workers){
+            q->jobs[q->bottom++] = job;
+        }
+        used += q->bottom;
+    }
+
+    double start = get_time_seconds();
+
+    for(int w = 0; w < farm.nb_workers; w++){
+        if(pthread_create(&farm.workers[w].thread, NULL, worker_thread, &farm.workers[w]) != 0){
+            fprintf(stderr, "Cannot create worker %d\n", w);
+            return 1;
+        }
+    }
+
+    uint64_t steals = 0;
+    for(int w = 0; w < farm.nb_workers; w++){
+        pthread_join(farm.workers[w].thread, NULL);
+        steals += farm.workers[w].steals;
+    }
+
+    double elapsed = get_time_seconds() - start;
+
+    print_report(&farm);
+
+    uint64_t instructions = 0;
+    int failed = 0;
+    for(int i = 0; i < farm.nb_jobs; i++){
+        instructions += farm.results[i].instructions;
+        failed += farm.results[i].status == JOB_ERROR || farm.results[i].status == JOB_FAULT;
+    }
+
+    fprintf(stderr, "%d jobs (%d failed) on %d workers in %.3f s, %lu instructions (%.2f MIPS), %lu steals\n",
+            farm.nb_jobs, failed, farm.nb_workers, elapsed, (unsigned long) instructions,
+            (elapsed > 0) ? instructions / elapsed / 1e6 : 0.0, (unsigned long) steals);
+
+    for(int w = 0; w < farm.nb_workers; w++){
+        pthread_mutex_destroy(&farm.workers[w].queue.lock);
+    }
+    for(int i = 0; i < farm.nb_jobs; i++){
+        free(farm.jobs[i].program);
+        free(farm.jobs[i].handler);
+        free(farm.jobs[i].input);
+    }
+    free(farm.jobs);
+    munmap(farm.results, results_size);
+    free(farm.workers);
+    free(slots);
+
+    return (failed == 0) ? 0 : 1;
+}
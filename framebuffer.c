@@ -0,0 +1,148 @@
+#include "framebuffer.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAMEBUFFER_X86
+#endif
+
+typedef void (*ConversionKernel)(unsigned char* dst, const char* src, size_t pixels);
+
+void framebuffer_dimensions(long video_memory_size, int* width, int* height){
+    int area = video_memory_size / 4;
+    *height = sqrt((area * 2.0) / 3.0);
+    *width = area / *height;
+}
+
+/* Portable kernels, also used for the pixels left over by the vector ones */
+
+static void to_rgb_scalar(unsigned char* dst, const char* src, size_t pixels){
+    for(size_t i = 0; i < pixels; i++){
+        dst[3 * i] = src[4 * i];
+        dst[3 * i + 1] = src[4 * i + 1];
+        dst[3 * i + 2] = src[4 * i + 2];
+    }
+}
+
+static void to_rgba_scalar(unsigned char* dst, const char* src, size_t pixels){
+    for(size_t i = 0; i < pixels; i++){
+        dst[4 * i] = src[4 * i];
+        dst[4 * i + 1] = src[4 * i + 1];
+        dst[4 * i + 2] = src[4 * i + 2];
+        dst[4 * i + 3] = 0xff;
+    }
+}
+
+#ifdef FRAMEBUFFER_X86
+
+/* SSE kernels: 4 pixels per iteration. Packing RGB needs a byte shuffle,
+   which first appeared with SSSE3. */
+
+__attribute__((target("sse2")))
+static void to_rgba_sse(unsigned char* dst, const char* src, size_t pixels){
+    const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+
+    size_t i = 0;
+    for(; i + 4 <= pixels; i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + 4 * i));
+        _mm_storeu_si128((__m128i*) (dst + 4 * i), _mm_or_si128(v, alpha));
+    }
+    to_rgba_scalar(dst + 4 * i, src + 4 * i, pixels - i);
+}
+
+__attribute__((target("ssse3")))
+static void to_rgb_sse(unsigned char* dst, const char* src, size_t pixels){
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    // Each store writes 4 bytes past the 12 it converts, they must still be inside $dst
+    size_t i = 0;
+    for(; i + 6 <= pixels; i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + 4 * i));
+        _mm_storeu_si128((__m128i*) (dst + 3 * i), _mm_shuffle_epi8(v, pack));
+    }
+    to_rgb_scalar(dst + 3 * i, src + 4 * i, pixels - i);
+}
+
+/* AVX2 kernels: 8 pixels per iteration */
+
+__attribute__((target("avx2")))
+static void to_rgba_avx2(unsigned char* dst, const char* src, size_t pixels){
+    const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+
+    size_t i = 0;
+    for(; i + 8 <= pixels; i += 8){
+        __m256i v = _mm256_loadu_si256((const __m256i*) (src + 4 * i));
+        _mm256_storeu_si256((__m256i*) (dst + 4 * i), _mm256_or_si256(v, alpha));
+    }
+    to_rgba_scalar(dst + 4 * i, src + 4 * i, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static void to_rgb_avx2(unsigned char* dst, const char* src, size_t pixels){
+    // Packs each 128-bit lane into its 12 first bytes, then joins the two lanes
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    // Each store writes 8 bytes past the 24 it converts, they must still be inside $dst
+    size_t i = 0;
+    for(; i + 11 <= pixels; i += 8){
+        __m256i v = _mm256_loadu_si256((const __m256i*) (src + 4 * i));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, pack), join);
+        _mm256_storeu_si256((__m256i*) (dst + 3 * i), v);
+    }
+    to_rgb_scalar(dst + 3 * i, src + 4 * i, pixels - i);
+}
+
+#endif
+
+static ConversionKernel rgb_kernel = NULL;
+static ConversionKernel rgba_kernel = NULL;
+static const char* kernel_name = NULL;
+
+// Picks the best kernels for this CPU, on first use
+static void select_kernels(){
+    if(rgb_kernel != NULL){
+        return;
+    }
+
+    ConversionKernel rgb = to_rgb_scalar;
+    ConversionKernel rgba = to_rgba_scalar;
+    const char* name = "scalar";
+
+#ifdef FRAMEBUFFER_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        rgb = to_rgb_avx2;
+        rgba = to_rgba_avx2;
+        name = "avx2";
+    }
+    else if(__builtin_cpu_supports("ssse3")){
+        rgb = to_rgb_sse;
+        rgba = to_rgba_sse;
+        name = "sse";
+    }
+#endif
+
+    // Every thread selects the same kernels, concurrent first calls are harmless
+    rgba_kernel = rgba;
+    kernel_name = name;
+    rgb_kernel = rgb;
+}
+
+void framebuffer_to_rgb(unsigned char* dst, const char* src, size_t pixels){
+    select_kernels();
+    rgb_kernel(dst, src, pixels);
+}
+
+void framebuffer_to_rgba(unsigned char* dst, const char* src, size_t pixels){
+    select_kernels();
+    rgba_kernel(dst, src, pixels);
+}
+
+const char* framebuffer_kernel_name(){
+    select_kernels();
+    return kernel_name;
+}
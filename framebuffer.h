@@ -0,0 +1,31 @@
+#ifndef FRAMEBUFFER_H__
+#define FRAMEBUFFER_H__
+
+#include <stddef.h>
+
+/* Conversions of video memory to common pixel formats, for exports
+   (PPM...) and for toolkits that cannot read it as is.
+
+   Video memory holds one little-endian 32-bit word per pixel, in rows of
+   $width pixels: its bytes are red, green and blue, the 4th one is unused.
+
+   The conversions use AVX2 or SSE kernels when the CPU supports them and
+   a portable scalar loop otherwise. */
+
+/* Width and height of the screen shown for $video_memory_size bytes of
+   video memory, which has a 3:2 aspect ratio. */
+void framebuffer_dimensions(long video_memory_size, int* width, int* height);
+
+/* Converts $pixels pixels of video memory at $src into packed RGB
+   (3 bytes per pixel) at $dst. */
+void framebuffer_to_rgb(unsigned char* dst, const char* src, size_t pixels);
+
+/* Converts $pixels pixels of video memory at $src into opaque RGBA
+   (4 bytes per pixel, alpha = 0xff) at $dst. */
+void framebuffer_to_rgba(unsigned char* dst, const char* src, size_t pixels);
+
+/* Name of the kernels used by the conversions on this CPU
+   ("avx2", "sse" or "scalar"). */
+const char* framebuffer_kernel_name();
+
+#endif
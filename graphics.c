@@ -1,41 +1,151 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <gtk/gtk.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "emulator.h"
+#include "jit.h"
+#include "framebuffer.h"
+#include "history.h"
 
 #define MAX_PATH_LEN 4096
 
 static GtkWidget* main_window = NULL;
 static char filename[MAX_PATH_LEN];
 static Computer computer;
-static bool computer_init = false;
-static GtkWidget* code_view;
-static GtkListStore* code_store;
-static GtkWidget* memory_view;
-static GtkListStore* memory_store;
+static atomic_bool computer_init = false; // written with computer_mutex held
 static double temp_frequency;
 static double frequency = 1.0;
-
-static GdkPixbuf* pixels_buf = NULL;
+static double achieved_frequency = 0; // measured by execute_thread(), 0 when not running
+static GtkWidget* frequency_label;
+static GtkWidget* custom_frequency_radio;
+static GtkWidget* custom_frequency_spin;
+static bool full_speed = false; // run unbounded until a breakpoint or watchpoint, whatever $frequency
+
+/* Copy of video memory shown by the screen window, in the layout of 
+   video memory: one 4-byte word per pixel holding its red, green and 
+   blue bytes, the 4th byte is unused. GTK reads it as is. */
+static guchar* frame = NULL;
+
+#if GTK_CHECK_VERSION(4, 14, 0)
+#define FRAME_FORMAT GDK_MEMORY_R8G8B8X8
+#else
+#define FRAME_FORMAT GDK_MEMORY_R8G8B8A8 // the 4th byte is forced to 0xff (opaque)
+#endif
 static GtkWidget* screen_window = NULL;
 static GtkWidget* canvas = NULL;
-static int screen_area;
 static int screen_width;
 static int screen_height;
 
 #define NB_REGS_STORES 3
+#define CODE_ROWS 256 // rows of the code view whose words are published, more than it ever materializes
+#define MEMORY_ROWS 256 // same for the memory view
+#define MEMORY_ROW_WORDS 4 // words per row of the memory view
+#define MEMORY_ROW_BYTES (4 * MEMORY_ROW_WORDS)
+#define MEMORY_HIGHLIGHT 30 // publications during which the words that changed stay highlighted
+#define CODE_CACHE_SZ 1024 // entries of the disassembly cache of the code view, a power of 2
+
+/* State of the computer shown by the main window. The thread running the
+   computer publishes it at a bounded rate and the GTK thread reads it 
+   through a seqlock, so that refreshing the window never blocks the CPU. 
+   The frame belongs to it too: its pixels only change while publishing. */
+typedef struct{
+    int pc;
+    int registers[32];
+    long program_rows; // rows of the code view: the words of the program, 
+    long handler_start; // then those of the interrupt handler from this address
+    long handler_rows;
+    long code_first; // row of code[0]
+    int code[CODE_ROWS];
+    bool code_breakpoints[CODE_ROWS]; // whether the instructions of code[] have a breakpoint
+    long memory_size; // rows of the memory view: all of memory, MEMORY_ROW_BYTES per row
+    long memory_first; // row of memory[0]
+    int memory[MEMORY_ROWS * MEMORY_ROW_WORDS];
+    unsigned frame_version; // incremented when pixels of the frame change
+    double frequency; // achieved frequency, in instructions per second
+    RunStatus stop; // RUN_BREAKPOINT or RUN_WATCHPOINT if the last run stopped on one
+    long watch_address; // access that hit a watchpoint, for RUN_WATCHPOINT
+    int watch_access;
+} DisplayState;
+
+typedef enum{
+    SCREEN_KEEP,  // the frame is not updated
+    SCREEN_DIRTY, // the pixels drawn since the last publication are copied
+    SCREEN_FULL   // the whole video memory is copied
+} ScreenUpdate;
+
+static DisplayState display_state;
+static atomic_uint display_sequence = 0; // odd while display_state is written
+static atomic_bool publish_requested = false; // set by the frame clock, cleared when published
 static int regs_store_index = 0;
 static GtkWidget* regs_views[NB_REGS_STORES];
 static GtkListStore* regs_stores[NB_REGS_STORES];
 static int regs_stores_starts[NB_REGS_STORES];
 static int regs_stores_ends[NB_REGS_STORES];
 
+/* List model of the virtualized views, one item per row. The list view 
+   only materializes the rows it shows, its items are told apart by their
+   position. */
+#define ROW_TYPE_MODEL (row_model_get_type())
+G_DECLARE_FINAL_TYPE(RowModel, row_model, ROW, MODEL, GObject)
+
+struct _RowModel{
+    GObject parent_instance;
+    guint rows;
+};
+
+/* A list view over a row model, whose content is published by windows of
+   rows: the thread running the computer publishes the rows from $window
+   and the GTK thread moves $window to follow the rows the view bound. */
+typedef struct{
+    GtkWidget* view;
+    RowModel* model;
+    GPtrArray* items; // items bound to a row
+    atomic_long window; // first published row
+    long window_rows; // number of published rows
+    bool window_moved; // the published rows do not cover the bound ones
+} RowView;
+
+static RowView code_rows;
+static RowView memory_rows;
+static long scrolled_pc = -1; // PC the code view last scrolled to
+
+// Disassembly of the code view, by address and instruction word
+typedef struct{
+    long addr; // -1 when empty
+    int word;
+    char text[DISASSEMBLY_MAX];
+} CachedDisassembly;
+
+static CachedDisassembly code_cache[CODE_CACHE_SZ];
+
 static GtkWidget* address_search;
 static GtkWidget* address_button;
-static int selected_address = 0x0;
+
+// Words of the memory view last shown, to highlight those that change
+static long memory_shown_first = -1; // row of memory_shown[0], -1 when none is shown
+static int memory_shown[MEMORY_ROWS * MEMORY_ROW_WORDS];
+static unsigned memory_changed[MEMORY_ROWS * MEMORY_ROW_WORDS]; // publication at which they last changed, 0 if not since shown
+static unsigned memory_publication = 0; // publications shown by the memory view
+
+static GtkWidget* breakpoint_entry;
+static GtkWidget* breakpoint_kind;
+static GtkWidget* breakpoints_label;
+static GtkWidget* stop_label;
+static RunStatus stop_status = RUN_BUDGET_EXHAUSTED; // why execute_thread() last stopped, computer_mutex must be held
+
+// Kinds of the breakpoint drop-down, in order
+enum{
+    KIND_BREAKPOINT = 0,
+    KIND_WATCH_WRITES,
+    KIND_WATCH_READS,
+    KIND_WATCH_ACCESSES
+};
 
 static bool running = false;
 static bool open_blocked = false;
@@ -49,144 +159,329 @@ pthread_mutex_t computer_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t paused_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t frequency_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-enum
+static GType row_model_get_item_type(GListModel* list){
+    return G_TYPE_OBJECT;
+}
 
-{
-  MEMORY_TABLE_COL_ADDRESS = 0,
-  MEMORY_TABLE_COL_VAL,
-  MEMORY_TABLE_NUM_COLS
-};
+static guint row_model_get_n_items(GListModel* list){
+    return ROW_MODEL(list)->rows;
+}
 
+static gpointer row_model_get_item(GListModel* list, guint position){
+    
+    if(position >= ROW_MODEL(list)->rows)
+        return NULL;
+    
+    return g_object_new(G_TYPE_OBJECT, NULL);
+}
 
-static GtkTreeModel* create_memory_model (void){
+static void row_model_list_model_init(GListModelInterface* iface){
+    iface->get_item_type = row_model_get_item_type;
+    iface->get_n_items = row_model_get_n_items;
+    iface->get_item = row_model_get_item;
+}
 
-    GtkListStore *store = gtk_list_store_new (MEMORY_TABLE_NUM_COLS,
-                                              G_TYPE_STRING,
-                                              G_TYPE_STRING);
-    memory_store = store;
-  
-    for(int i = 0; i < 8; i++){
-      
-      GtkTreeIter iter;
-      gtk_list_store_append (store, &iter);
-      gtk_list_store_set (store, &iter,
-                          MEMORY_TABLE_COL_ADDRESS, "",
-                          MEMORY_TABLE_COL_VAL, "",
-                          -1);
-    }
+G_DEFINE_TYPE_WITH_CODE(RowModel, row_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, row_model_list_model_init))
 
-    return GTK_TREE_MODEL (store);
+static void row_model_class_init(RowModelClass* class){
 }
 
-static GtkWidget* create_memory_view_and_model (void){
+static void row_model_init(RowModel* self){
+    self->rows = 0;
+}
 
-  GtkWidget *view = gtk_tree_view_new ();
-  GtkCellRenderer *renderer;
+static void row_model_set_rows(RowModel* self, guint rows){
+    
+    guint removed = self->rows;
+    self->rows = rows;
+    g_list_model_items_changed(G_LIST_MODEL(self), 0, removed, rows);
+}
 
-  renderer = gtk_cell_renderer_text_new ();
-  gtk_tree_view_insert_column_with_attributes (GTK_TREE_VIEW (view),
-                                               -1,      
-                                               "Address",  
-                                               renderer,
-                                               "text", MEMORY_TABLE_COL_ADDRESS,
-                                               NULL);
+// Row of $item, -1 if it is about to be unbound after a change of the model
+static long item_row(RowView* v, GtkListItem* item){
+    
+    guint row = gtk_list_item_get_position(item);
+    return (row < v->model->rows) ? (long) row : -1;
+}
 
-  
-  renderer = gtk_cell_renderer_text_new ();
-  gtk_tree_view_insert_column_with_attributes (GTK_TREE_VIEW (view),
-                                               -1,      
-                                               "Value",  
-                                               renderer,
-                                               "text", MEMORY_TABLE_COL_VAL,
-                                               NULL);
+/* Makes the published rows of $v, from $first_published, cover the
+   bound ones: they are centered on them for the next publication */
+static void follow_items(RowView* v, long first_published){
+    
+    long first = LONG_MAX;
+    long last = -1;
+    for(guint i = 0; i < v->items->len; i++){
+        long row = item_row(v, g_ptr_array_index(v->items, i));
+        if(row < 0)
+            continue;
+        first = (row < first) ? row : first;
+        last = (row > last) ? row : last;
+    }
+    
+    if(last < 0)
+        return;
+    if(last - first >= v->window_rows)
+        last = first + v->window_rows - 1; // the first rows are shown, whatever the size of the view
+    
+    if(first >= first_published && last < first_published + v->window_rows){
+        v->window_moved = false;
+        return;
+    }
+    
+    long start = first - (v->window_rows - (last - first + 1)) / 2;
+    atomic_store_explicit(&v->window, (start < 0) ? 0 : start, memory_order_relaxed);
+    v->window_moved = true;
+}
 
-  GtkTreeModel *model = create_memory_model ();
+// Brings $row of $v into view, if not visible already
+static void scroll_rows(RowView* v, long row){
+    
+#if GTK_CHECK_VERSION(4, 12, 0)
+    gtk_list_view_scroll_to(GTK_LIST_VIEW(v->view), row, GTK_LIST_SCROLL_NONE, NULL);
+#else
+    gtk_widget_activate_action(v->view, "list.scroll-to-item", "u", (guint) row);
+#endif
+}
 
-  gtk_tree_view_set_model (GTK_TREE_VIEW (view), model);
-  g_object_unref(model);
+// Sets the number of rows of $v, returns true if it changed
+static bool set_rows(RowView* v, long rows){
+    
+    if(rows == v->model->rows)
+        return false;
+    
+    row_model_set_rows(v->model, rows); // binds the visible rows again
+    return true;
+}
 
-  return view;
+// A row of $n labels of $widths characters
+static GtkWidget* create_label_row(const char* const* texts, const int* widths, int n){
+    
+    GtkWidget* box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 12);
+    
+    for(int i = 0; i < n; i++){
+        GtkWidget* label = gtk_label_new(texts[i]);
+        gtk_label_set_width_chars(GTK_LABEL(label), widths[i]);
+        gtk_label_set_xalign(GTK_LABEL(label), 0);
+        gtk_widget_add_css_class(label, "monospace");
+        gtk_box_append(GTK_BOX(box), label);
+    }
+    
+    return box;
 }
 
-enum
-{
-  CODE_TABLE_COL_ADDRESS = 0,
-  CODE_TABLE_COL_PC,
-  CODE_TABLE_COL_VAL,
-  CODE_TABLE_COL_DISASSEMBLY,
-  CODE_TABLE_NUM_COLS
-};
+static void unbind_row(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer data){
+    
+    RowView* v = data;
+    g_ptr_array_remove_fast(v->items, item);
+}
 
+/* Creates the list view of $v, publishing $window_rows rows at a time, 
+   scrolled under $header. $setup and $bind are the handlers of the
+   signals of its item factory. */
+static GtkWidget* create_row_view(RowView* v, long window_rows, GtkWidget* header,
+                                  GCallback setup, GCallback bind){
+    
+    v->items = g_ptr_array_new();
+    v->model = g_object_new(ROW_TYPE_MODEL, NULL);
+    v->window_rows = window_rows;
+    
+    GtkListItemFactory* factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", setup, NULL);
+    g_signal_connect(factory, "bind", bind, NULL);
+    g_signal_connect(factory, "unbind", G_CALLBACK(unbind_row), v);
+    
+    // The view owns the selection model, which owns the model
+    GtkNoSelection* selection = gtk_no_selection_new(G_LIST_MODEL(v->model));
+    v->view = gtk_list_view_new(GTK_SELECTION_MODEL(selection), factory);
+    
+    GtkWidget* scrolled = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_min_content_height(GTK_SCROLLED_WINDOW(scrolled), 200);
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), v->view);
+    
+    GtkWidget* box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_box_append(GTK_BOX(box), header);
+    gtk_box_append(GTK_BOX(box), scrolled);
+    
+    return box;
+}
 
-static GtkTreeModel* create_code_model (void){
+/* Rows of the code view: the words of the program, then those of the
+   interrupt handler */
+static long code_row_address(const DisplayState* state, long row){
+    
+    if(row < state->program_rows)
+        return 4 * row;
+    return state->handler_start + 4 * (row - state->program_rows);
+}
 
-    GtkListStore *store = gtk_list_store_new (CODE_TABLE_NUM_COLS,
-                                              G_TYPE_STRING,
-                                              G_TYPE_STRING,
-                                              G_TYPE_STRING,
-                                              G_TYPE_STRING);
-    code_store = store;
-  
-    for(int i = 0; i < 8; i++){
-      
-      GtkTreeIter iter;
-      gtk_list_store_append (store, &iter);
-      gtk_list_store_set (store, &iter,
-                          CODE_TABLE_COL_ADDRESS, "",
-                          CODE_TABLE_COL_PC, "",
-                          CODE_TABLE_COL_VAL, "",
-                          CODE_TABLE_COL_DISASSEMBLY, "",
-                          -1);
+// Row of the code view showing $addr, -1 if none does
+static long code_address_row(const DisplayState* state, long addr){
+    
+    if(addr >= 0 && addr < 4 * state->program_rows)
+        return addr / 4;
+    if(addr >= state->handler_start && addr < state->handler_start + 4 * state->handler_rows)
+        return state->program_rows + (addr - state->handler_start) / 4;
+    return -1;
+}
+
+// Disassembly of the instruction $word at $addr, only disassembled when not cached
+static const char* cached_disassembly(long addr, int word){
+    
+    CachedDisassembly* entry = &code_cache[(addr / 4) & (CODE_CACHE_SZ - 1)];
+    
+    if(entry->addr != addr || entry->word != word){
+        entry->addr = addr;
+        entry->word = word;
+        disassemble_at(word, addr, entry->text);
     }
+    
+    return entry->text;
+}
 
-    return GTK_TREE_MODEL (store);
+/* Last state shown by the main window */
+static DisplayState shown_state;
+
+// Labels of a row of the code view, in order
+enum{
+    CODE_LABEL_ADDRESS = 0,
+    CODE_LABEL_PC,
+    CODE_LABEL_VAL,
+    CODE_LABEL_DISASSEMBLY,
+    CODE_NUM_LABELS
+};
+
+static const int code_label_widths[CODE_NUM_LABELS] = {8, 3, 8, DISASSEMBLY_MAX}; // in characters
+
+// Shows the row of $item from the published $state
+static void update_code_row(GtkListItem* item, const DisplayState* state){
+    
+    long row = item_row(&code_rows, item);
+    if(row < 0)
+        return;
+    
+    long addr = code_row_address(state, row);
+    long i = row - state->code_first;
+    const char* texts[CODE_NUM_LABELS] = {"", "", "", ""};
+    char address[10];
+    char value[10];
+    
+    sprintf(address, "%.8lx", addr);
+    texts[CODE_LABEL_ADDRESS] = address;
+    
+    // Rows not published yet are blank until the next publication
+    if(i >= 0 && i < CODE_ROWS){
+        bool breakpoint = state->code_breakpoints[i];
+        sprintf(value, "%.8x", state->code[i]);
+        texts[CODE_LABEL_PC] = (addr == state->pc) ? (breakpoint ? "X B" : "X") : (breakpoint ? "B" : "");
+        texts[CODE_LABEL_VAL] = value;
+        texts[CODE_LABEL_DISASSEMBLY] = cached_disassembly(addr, state->code[i]);
+    }
+    
+    GtkWidget* label = gtk_widget_get_first_child(gtk_list_item_get_child(item));
+    for(int j = 0; j < CODE_NUM_LABELS; j++){
+        gtk_label_set_text(GTK_LABEL(label), texts[j]);
+        label = gtk_widget_get_next_sibling(label);
+    }
 }
 
+static void setup_code_row(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer data){
+    
+    static const char* const blank[CODE_NUM_LABELS] = {"", "", "", ""};
+    gtk_list_item_set_child(item, create_label_row(blank, code_label_widths, CODE_NUM_LABELS));
+}
 
+static void bind_code_row(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer data){
+    
+    g_ptr_array_add(code_rows.items, item);
+    update_code_row(item, &shown_state);
+    
+    long i = item_row(&code_rows, item) - shown_state.code_first;
+    if(i < 0 || i >= CODE_ROWS)
+        follow_items(&code_rows, shown_state.code_first);
+}
 
+/* Code view: the whole program and interrupt handler in a scrolled list
+   whose rows are only materialized when visible, under a header */
 static GtkWidget* create_code_view_and_model (void){
 
-  GtkWidget *view = gtk_tree_view_new ();
-  GtkCellRenderer *renderer;
+  static const char* const titles[CODE_NUM_LABELS] = {"Address", "PC?", "Value", "Disassembly"};
+  
+  for(int i = 0; i < CODE_CACHE_SZ; i++)
+    code_cache[i].addr = -1;
+  
+  return create_row_view(&code_rows, CODE_ROWS, 
+                         create_label_row(titles, code_label_widths, CODE_NUM_LABELS),
+                         G_CALLBACK(setup_code_row), G_CALLBACK(bind_code_row));
+}
 
-  renderer = gtk_cell_renderer_text_new ();
-  gtk_tree_view_insert_column_with_attributes (GTK_TREE_VIEW (view),
-                                               -1,      
-                                               "Address",  
-                                               renderer,
-                                               "text", CODE_TABLE_COL_ADDRESS,
-                                               NULL);
+#define MEMORY_NUM_LABELS (1 + MEMORY_ROW_WORDS) // address, then the words
 
-  renderer = gtk_cell_renderer_text_new ();
-  gtk_tree_view_insert_column_with_attributes (GTK_TREE_VIEW (view),
-                                               -1,      
-                                               "PC?",  
-                                               renderer,
-                                               "text", CODE_TABLE_COL_PC,
-                                               NULL);
-  
-  renderer = gtk_cell_renderer_text_new ();
-  gtk_tree_view_insert_column_with_attributes (GTK_TREE_VIEW (view),
-                                               -1,      
-                                               "Value",  
-                                               renderer,
-                                               "text", CODE_TABLE_COL_VAL,
-                                               NULL);
+static const int memory_label_widths[MEMORY_NUM_LABELS] = {8, 8, 8, 8, 8};
 
-  renderer = gtk_cell_renderer_text_new ();
-  gtk_tree_view_insert_column_with_attributes (GTK_TREE_VIEW (view),
-                                               -1,      
-                                               "Disassemby",  
-                                               renderer,
-                                               "text", CODE_TABLE_COL_DISASSEMBLY,
-                                               NULL);
+// Whether the $i-th published word changed during the last MEMORY_HIGHLIGHT publications
+static bool memory_highlighted(long i){
+    return memory_changed[i] != 0 && memory_publication - memory_changed[i] < MEMORY_HIGHLIGHT;
+}
 
-  GtkTreeModel *model = create_code_model ();
+// Shows the row of $item from the published $state, highlighting the words that changed
+static void update_memory_row(GtkListItem* item, const DisplayState* state){
+    
+    long row = item_row(&memory_rows, item);
+    if(row < 0)
+        return;
+    
+    long i = (row - state->memory_first) * MEMORY_ROW_WORDS;
+    bool published = row >= state->memory_first && row < state->memory_first + MEMORY_ROWS;
+    char buf[16];
+    
+    GtkWidget* label = gtk_widget_get_first_child(gtk_list_item_get_child(item));
+    sprintf(buf, "%.8lx", row * MEMORY_ROW_BYTES);
+    gtk_label_set_text(GTK_LABEL(label), buf);
+    
+    // Rows not published yet are blank until the next publication
+    for(int j = 0; j < MEMORY_ROW_WORDS; j++){
+        label = gtk_widget_get_next_sibling(label);
+        
+        if(!published)
+            gtk_label_set_text(GTK_LABEL(label), "");
+        else if(memory_highlighted(i + j)){
+            sprintf(buf, "<b>%.8x</b>", state->memory[i + j]);
+            gtk_label_set_markup(GTK_LABEL(label), buf);
+        }
+        else{
+            sprintf(buf, "%.8x", state->memory[i + j]);
+            gtk_label_set_text(GTK_LABEL(label), buf);
+        }
+    }
+}
 
-  gtk_tree_view_set_model (GTK_TREE_VIEW (view), model);
-  g_object_unref(model);
+static void setup_memory_row(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer data){
+    
+    static const char* const blank[MEMORY_NUM_LABELS] = {"", "", "", "", ""};
+    gtk_list_item_set_child(item, create_label_row(blank, memory_label_widths, MEMORY_NUM_LABELS));
+}
 
-  return view;
+static void bind_memory_row(GtkSignalListItemFactory* factory, GtkListItem* item, gpointer data){
+    
+    g_ptr_array_add(memory_rows.items, item);
+    update_memory_row(item, &shown_state);
+    
+    long i = item_row(&memory_rows, item) - shown_state.memory_first;
+    if(i < 0 || i >= MEMORY_ROWS)
+        follow_items(&memory_rows, shown_state.memory_first);
+}
+
+/* Memory view: all of program, video and kernel memory in a scrolled
+   list whose rows are only materialized when visible, under a header */
+static GtkWidget* create_memory_view_and_model (void){
+
+  static const char* const titles[MEMORY_NUM_LABELS] = {"Address", "+0", "+4", "+8", "+c"};
+  
+  return create_row_view(&memory_rows, MEMORY_ROWS,
+                         create_label_row(titles, memory_label_widths, MEMORY_NUM_LABELS),
+                         G_CALLBACK(setup_memory_row), G_CALLBACK(bind_memory_row));
 }
 
 enum{
@@ -252,12 +547,14 @@ static gboolean event_key_pressed (GtkWidget* widget,
                       GdkModifierType        state,
                       GtkEventControllerKey* event_controller){
     
-    if(keyval >= 128 || !computer_init)
+    // open_blocked is set in this thread before the computer is replaced or reset
+    if(keyval >= 128 || open_blocked || !computer_init)
         return TRUE;
     
-    pthread_mutex_lock(&computer_mutex);
-    raise_interrupt(&computer, 0, keyval);
-    pthread_mutex_unlock(&computer_mutex);
+    // Lock-free, the CPU thread takes it when back in user mode
+    if(!raise_interrupt(&computer, 0, keyval))
+        fprintf(stderr, "Interrupt queue full, key press dropped (%lu so far)\n", 
+                interrupt_overflows(&computer));
     fprintf(stderr, "key pressed event %c %d %c %d\n", keyval, keyval, keycode, keycode);
     return TRUE;
 }
@@ -268,80 +565,84 @@ static gboolean event_key_released (GtkWidget* widget,
                       GdkModifierType        state,
                       GtkEventControllerKey* event_controller){
     
-    if(keyval >= 128 || !computer_init)
+    if(keyval >= 128 || open_blocked || !computer_init)
         return FALSE;
     
-    pthread_mutex_lock(&computer_mutex);
-    raise_interrupt(&computer, 1, keyval);
-    pthread_mutex_unlock(&computer_mutex);
+    if(!raise_interrupt(&computer, 1, keyval))
+        fprintf(stderr, "Interrupt queue full, key release dropped (%lu so far)\n", 
+                interrupt_overflows(&computer));
     fprintf(stderr, "key released event %c\n", keyval);
     return FALSE;
 }
 
-void update_memory_state(){
-
-    gtk_list_store_clear(memory_store);
-    int start = selected_address;
+// Whether the row of the memory view whose first word is the $i-th published one must be shown again
+static bool memory_row_changed(long i){
     
-    for(int addr = start; addr <= start + 28 ; addr += 4){
-      
-      pthread_mutex_lock(&computer_mutex);
-      int word = get_word(&computer, addr);
-      pthread_mutex_unlock(&computer_mutex);
-      
-      char buf[10];
-      char buf2[10];
-      char disassembly[512];
-      
-      sprintf(buf, "%.8x", addr);
-      sprintf(buf2, "%.8x", word);
-      
-      GtkTreeIter iter;
-      gtk_list_store_append (memory_store, &iter);
-      gtk_list_store_set (memory_store, &iter,
-                          MEMORY_TABLE_COL_ADDRESS, buf,
-                          MEMORY_TABLE_COL_VAL, buf2,
-                          -1);
+    if(i < 0 || i >= MEMORY_ROWS * MEMORY_ROW_WORDS)
+        return false; // not published, stays blank
+    
+    for(long j = i; j < i + MEMORY_ROW_WORDS; j++){
+        if(memory_changed[j] == memory_publication)
+            return true;
+        if(memory_changed[j] != 0 && memory_publication - memory_changed[j] == MEMORY_HIGHLIGHT)
+            return true; // no longer highlighted
     }
+    
+    return false;
 }
 
+/* Records which published words changed since the previous publication 
+   and refreshes the rows the memory view materialized that changed: the
+   cost does not depend on the size of memory */
+static void update_memory_state(const DisplayState* state){
+    
+    // On a new window, every row is shown again and none is highlighted
+    bool moved = set_rows(&memory_rows, (state->memory_size + MEMORY_ROW_BYTES - 1) / MEMORY_ROW_BYTES)
+                 || state->memory_first != memory_shown_first;
+    
+    memory_publication++;
+    for(int i = 0; i < MEMORY_ROWS * MEMORY_ROW_WORDS; i++){
+        if(moved)
+            memory_changed[i] = 0;
+        else if(state->memory[i] != memory_shown[i])
+            memory_changed[i] = memory_publication;
+        memory_shown[i] = state->memory[i];
+    }
+    memory_shown_first = state->memory_first;
+    
+    for(guint i = 0; i < memory_rows.items->len; i++){
+        GtkListItem* item = g_ptr_array_index(memory_rows.items, i);
+        long row = item_row(&memory_rows, item);
+        if(moved || memory_row_changed((row - state->memory_first) * MEMORY_ROW_WORDS))
+            update_memory_row(item, state);
+    }
+    
+    follow_items(&memory_rows, state->memory_first);
+}
 
-void update_code_state(){
-
-    gtk_list_store_clear(code_store);
-    int pc = computer.cpu.program_counter;
-    int start = pc - 4;
+/* Refreshes the rows the code view materialized from the published state
+   and scrolls to the PC when it moved: the cost does not depend on the 
+   size of the program */
+static void update_code_state(const DisplayState* state){
     
-    if(computer.cpu.program_counter == 0) 
-    	start = pc;
+    if(set_rows(&code_rows, state->program_rows + state->handler_rows))
+        scrolled_pc = -1;
     
-    for(int addr = start; addr <= start + 28 ; addr += 4){
-      
-      pthread_mutex_lock(&computer_mutex);
-      int instruction = get_word(&computer, addr);
-      pthread_mutex_unlock(&computer_mutex);
-      
-      char buf[10];
-      char buf2[10];
-      char disassembly[512];
-      
-      sprintf(buf, "%.8x", addr);
-      sprintf(buf2, "%.8x", instruction);
-      
-      disassemble(instruction, disassembly);
-      
-      GtkTreeIter iter;
-      gtk_list_store_append (code_store, &iter);
-      gtk_list_store_set (code_store, &iter,
-                          CODE_TABLE_COL_ADDRESS, buf,
-                          CODE_TABLE_COL_PC, (addr == pc) ? "X": "",
-                          CODE_TABLE_COL_VAL, buf2,
-                          CODE_TABLE_COL_DISASSEMBLY, disassembly,
-                          -1);
+    for(guint i = 0; i < code_rows.items->len; i++)
+        update_code_row(g_ptr_array_index(code_rows.items, i), state);
+    
+    if(state->pc != scrolled_pc){
+        long row = code_address_row(state, state->pc);
+        scrolled_pc = state->pc;
+        if(row >= 0)
+            scroll_rows(&code_rows, row);
     }
+    
+    follow_items(&code_rows, state->code_first);
 }
 
-void update_regs_state(){
+/* Writes the published registers into the register views */
+static void update_regs_state(const DisplayState* state){
     
     char buf[10];
     
@@ -351,9 +652,7 @@ void update_regs_state(){
         
         for(int j = regs_stores_starts[i]; j <= regs_stores_ends[i]; j++){
             
-            pthread_mutex_lock(&computer_mutex);
-            sprintf(buf, "%.8x", get_register(&computer, j));
-            pthread_mutex_unlock(&computer_mutex);
+            sprintf(buf, "%.8x", state->registers[j]);
             
             GtkTreeIter iter;
             gtk_list_store_append (regs_stores[i], &iter);
@@ -366,108 +665,229 @@ void update_regs_state(){
     }
 }
 
-void init_screen(){
+// Writes $hz in $buf with a unit (Hz, kHz, MHz...)
+static void format_frequency(double hz, char* buf, size_t size){
 
-    int n_channels = gdk_pixbuf_get_n_channels (pixels_buf);
-    int rowstride = gdk_pixbuf_get_rowstride (pixels_buf);
-    guchar* pixels = gdk_pixbuf_get_pixels (pixels_buf);
+    static const char* const units[] = {"Hz", "kHz", "MHz", "GHz"};
+    int unit = 0;
     
-    int row_byte_length = screen_width * 4;
+    while(hz >= 1000 && unit < 3){
+        hz /= 1000;
+        unit++;
+    }
     
-    for(int y = 0; y < screen_height; y++){
-        for(int x = 0; x < screen_width; x++){
-        
-            pthread_mutex_lock(&computer_mutex);
-            unsigned int pixel = get_word(&computer, 
-                                          computer.program_memory_size
-                                          + y * row_byte_length
-                                          + x * 4);
-            pthread_mutex_unlock(&computer_mutex);
-            
-            guchar* p = pixels + y * rowstride + x * n_channels;
-            p[0] = pixel & 0xff;
-            p[1] = (pixel >> 8) & 0xff;
-            p[2] = (pixel >> 16) & 0xff;
-        }
-    } 
+    snprintf(buf, size, "%.3g %s", hz, units[unit]);
+}
+
+/* Shows the published achieved frequency next to the target one */
+static void update_frequency_state(const DisplayState* state){
+    
+    char achieved[32];
+    char target[32];
+    char buf[96];
+    
+    if(frequency < 0)
+        snprintf(target, sizeof(target), "unbounded");
+    else
+        format_frequency(frequency, target, sizeof(target));
     
-    gtk_picture_set_pixbuf((GtkPicture*) canvas, pixels_buf);
+    if(state->frequency > 0){
+        format_frequency(state->frequency, achieved, sizeof(achieved));
+        snprintf(buf, sizeof(buf), "%s\n(target: %s)", achieved, target);
+    }
+    else
+        snprintf(buf, sizeof(buf), "-\n(target: %s)", target);
+    
+    gtk_label_set_text(GTK_LABEL(frequency_label), buf);
 }
 
-void update_screen(){
+/* Tells on which breakpoint or watchpoint the last run stopped, if any */
+static void update_stop_state(const DisplayState* state){
+    
+    char buf[64];
+    
+    if(state->stop == RUN_BREAKPOINT)
+        snprintf(buf, sizeof(buf), "Breakpoint at %.8x", state->pc);
+    else if(state->stop == RUN_WATCHPOINT)
+        snprintf(buf, sizeof(buf), "%s %.8lx hit a watchpoint", 
+                 (state->watch_access == WATCH_WRITE) ? "Store to" : "Load from", state->watch_address);
+    else
+        buf[0] = '\0';
+    
+    gtk_label_set_text(GTK_LABEL(stop_label), buf);
+}
 
-    if(first_open)
+/* Copies [start, end) of video memory (offsets in bytes) into the frame,
+   computer_mutex must be held */
+static void copy_to_frame(long start, long end){
+
+    long frame_size = (long) screen_width * screen_height * 4;
+    if(end > frame_size)
+        end = frame_size;
+    if(start >= end)
         return;
     
-    Computer* c = &computer;
-    pthread_mutex_lock(&computer_mutex);
+#if GTK_CHECK_VERSION(4, 14, 0)
+    memcpy(frame + start, computer.cpu.video_memory + start, end - start);
+#else
+    // [start, end) is made of whole pixels (dirty spans are word aligned)
+    framebuffer_to_rgba(frame + start, computer.cpu.video_memory + start, (end - start) / 4);
+#endif
+}
+
+/* Publishes the state of the computer for the GTK thread. $screen tells 
+   which pixels are copied into the frame. computer_mutex must be held: 
+   it orders the writers, the GTK thread reads without it. */
+static void publish_state(ScreenUpdate screen){
+
+    DisplayState* state = &display_state;
+    unsigned sequence = atomic_load_explicit(&display_sequence, memory_order_relaxed);
+    
+    // Odd while writing, the release fence keeps the writes below after it
+    atomic_store_explicit(&display_sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    
+    state->pc = computer.cpu.program_counter;
+    state->frequency = achieved_frequency;
+    for(int i = 0; i < 32; i++)
+        state->registers[i] = get_register(&computer, i);
+    
+    state->program_rows = (computer.program_size + 3) / 4;
+    state->handler_start = computer.handler_start;
+    state->handler_rows = (computer.handler_size + 3) / 4;
+    state->code_first = atomic_load_explicit(&code_rows.window, memory_order_relaxed);
+    for(int i = 0; i < CODE_ROWS; i++){
+        long addr = code_row_address(state, state->code_first + i);
+        state->code[i] = get_word(&computer, addr);
+        state->code_breakpoints[i] = has_breakpoint(&computer, addr);
+    }
     
-    if(c -> latest_accessed < c -> program_memory_size
-        || c -> latest_accessed >= c -> program_memory_size 
-                                   + c -> video_memory_size){
+    // Only the words of the rows around those the memory view shows
+    state->memory_size = computer.memory_size;
+    state->memory_first = atomic_load_explicit(&memory_rows.window, memory_order_relaxed);
+    for(int i = 0; i < MEMORY_ROWS * MEMORY_ROW_WORDS; i++)
+        state->memory[i] = get_word(&computer, state->memory_first * MEMORY_ROW_BYTES + 4 * i);
+    
+    state->stop = stop_status;
+    state->watch_address = computer.watch_address;
+    state->watch_access = computer.watch_access;
+    
+    if(screen == SCREEN_FULL){
+        // Everything is redrawn, the pending dirty spans are useless
+        clear_dirty_video(&computer);
+        copy_to_frame(0, computer.video_memory_size);
+        state->frame_version++;
+    }
+    else if(screen == SCREEN_DIRTY){
+        long start, end;
+        long from = 0;
+        bool drawn = false;
         
-        pthread_mutex_unlock(&computer_mutex);
-        return;
+        while(take_dirty_video(&computer, from, &start, &end)){
+            copy_to_frame(start, end);
+            from = end;
+            drawn = true;
+        }
+        
+        if(drawn)
+            state->frame_version++;
     }
-  
-    
-    unsigned int video_memory_offset = c-> program_memory_size;
-    unsigned int pixel_start = c -> latest_accessed 
-                               - (((c -> latest_accessed) 
-                                    - video_memory_offset)) % 4;
-    
-    unsigned int pixel = get_word(&computer, 
-                                  pixel_start);
     
-    pthread_mutex_unlock(&computer_mutex);
-                                  
-    unsigned int x = ((pixel_start - video_memory_offset) / 4)  % screen_width;
-    unsigned int y = ((pixel_start - video_memory_offset) / 4)  / screen_width;
-   
-    int n_channels = gdk_pixbuf_get_n_channels (pixels_buf);
-    int rowstride = gdk_pixbuf_get_rowstride (pixels_buf);
-    guchar *pixels = gdk_pixbuf_get_pixels (pixels_buf);
-            
-    guchar *p = pixels + y * rowstride + x * n_channels;
-    p[0] = pixel & 0xff;
-    p[1] = (pixel >> 8) & 0xff;
-    p[2] = (pixel >> 16) & 0xff;
-     
-    gtk_picture_set_pixbuf((GtkPicture*) canvas, pixels_buf);
+    atomic_store_explicit(&display_sequence, sequence + 2, memory_order_release);
 }
 
+/* Copies the published state into $state and, if the frame changed since 
+   $frame_version, the frame into $frame_bytes (NULL otherwise). Never 
+   blocks: the copy is retried if a writer published meanwhile. Returns 
+   the sequence number of the copied state. */
+static unsigned read_published_state(DisplayState* state, unsigned frame_version,
+                                  GBytes** frame_bytes){
 
-gboolean update_display_state(gpointer* par){
+    unsigned sequence;
+    *frame_bytes = NULL;
     
-    bool do_screen = (bool) (void*) par;
-    
-    if(!computer_init)
-        return FALSE;
+    while(true){
+        sequence = atomic_load_explicit(&display_sequence, memory_order_acquire);
+        if(sequence & 1)
+            continue; // being written
+        
+        *state = display_state;
+        if(state->frame_version != frame_version)
+            *frame_bytes = g_bytes_new(frame, (gsize) screen_width * screen_height * 4);
         
-    update_code_state();
-    update_memory_state();
-    update_regs_state();
+        // The acquire fence keeps the copies above before the check
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&display_sequence, memory_order_relaxed) == sequence)
+            return sequence;
+        
+        if(*frame_bytes != NULL){
+            g_bytes_unref(*frame_bytes);
+            *frame_bytes = NULL;
+        }
+    }
+}
+
+// Shows the pixels of $bytes (a copy of the frame) in the screen window
+static void present_frame(GBytes* bytes){
+
+    GdkTexture* texture = gdk_memory_texture_new(screen_width, screen_height, 
+                                                 FRAME_FORMAT, bytes, 
+                                                 screen_width * 4);
     
-    if(do_screen)
-        update_screen();
+    gtk_picture_set_paintable(GTK_PICTURE(canvas), GDK_PAINTABLE(texture));
     
-    return FALSE;
+    g_object_unref(texture);
 }
 
-gboolean full_update_display_state(){
+/* Sequence number of the state shown by the main window */
+static unsigned shown_sequence = 0;
+
+/* Shows the last published state, in the GTK thread */
+static void update_display_state(){
+    
+    static unsigned presented_frame_version = 0;
     
     if(!computer_init)
-        return FALSE;
-        
-    update_code_state();
-    update_memory_state();
-    update_regs_state();
-    init_screen();
+        return;
     
-    return FALSE;
+    DisplayState* state = &shown_state;
+    GBytes* bytes;
+    shown_sequence = read_published_state(state, presented_frame_version, &bytes);
+        
+    update_code_state(state);
+    update_memory_state(state);
+    update_regs_state(state);
+    update_frequency_state(state);
+    update_stop_state(state);
+    
+    if(bytes != NULL){
+        present_frame(bytes);
+        g_bytes_unref(bytes);
+        presented_frame_version = state->frame_version;
+    }
 }
 
-
+/* Called by the frame clock of the main window before each frame: shows
+   the state published since the previous frame, if any, and asks the 
+   thread running the computer to publish a new one for the next frame.
+   However fast the program runs, the window is refreshed at most once 
+   per frame and nothing queues up. */
+static gboolean display_tick(GtkWidget* widget, GdkFrameClock* frame_clock, 
+                             gpointer data){
+    
+    if(atomic_load_explicit(&display_sequence, memory_order_acquire) != shown_sequence)
+        update_display_state();
+    
+    // Scrolled to rows that are not published, while the computer is idle
+    if((code_rows.window_moved || memory_rows.window_moved) && computer_init && pthread_mutex_trylock(&computer_mutex) == 0){
+        publish_state(SCREEN_KEEP);
+        pthread_mutex_unlock(&computer_mutex);
+    }
+    
+    atomic_store(&publish_requested, true);
+    
+    return G_SOURCE_CONTINUE;
+}
 
 void update_memory_address(GtkWidget *widget, gpointer data){
 
@@ -479,10 +899,9 @@ void update_memory_address(GtkWidget *widget, gpointer data){
     strncpy(buf, text, 8);
     long addr = strtol(buf, NULL, 16);
 
-    if(addr > 0)
-        selected_address = addr;
-        	
-    update_display_state((gpointer) (void*) TRUE);
+    // The words of the rows it binds are published at the next frame
+    if(addr >= 0 && addr < shown_state.memory_size)
+        scroll_rows(&memory_rows, addr / MEMORY_ROW_BYTES);
 }
 
 void make_responsive(GtkWidget* window){
@@ -510,19 +929,56 @@ void* open_thread(void *arg) {
         
     while(running && !run_paused) ;
     stop_emulator = false;
+    
+    // Breakpoints and watchpoints are kept for the new program
+    long* breakpoints = NULL;
+    int nb_breakpoints = 0;
+    Watchpoint* watchpoints = NULL;
+    int nb_watchpoints = 0;
+    
+    // Held until the new computer is loaded, so that display_tick() never publishes one being replaced
+    pthread_mutex_lock(&computer_mutex);
         
-    if(computer_init)
+    if(computer_init){
+        computer_init = false;
+        breakpoints = computer.breakpoints;
+        nb_breakpoints = computer.nb_breakpoints;
+        computer.breakpoints = NULL;
+        watchpoints = computer.watchpoints;
+        nb_watchpoints = computer.nb_watchpoints;
+        computer.watchpoints = NULL;
         free_computer(&computer);
+    }
     
     init_computer(&computer, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
-    load(&computer, fp);
+    jit_attach(&computer); // used by run() in unbounded mode, if supported by the host
+    
+    for(int i = 0; i < nb_breakpoints; i++)
+        add_breakpoint(&computer, breakpoints[i]);
+    for(int i = 0; i < nb_watchpoints; i++)
+        add_watchpoint(&computer, watchpoints[i].start, watchpoints[i].end, watchpoints[i].access);
+    free(breakpoints);
+    free(watchpoints);
+    stop_status = RUN_BUDGET_EXHAUSTED;
+    
+    LoadStatus status = load(&computer, fp);
     fclose(fp);
+    if(status != LOAD_OK)
+        fprintf(stderr, "Cannot load %s: %s\n", filename, load_status_message(status));
+    
     fp = fopen("interrupt_handler.asm.bin", "rb");
-    load_interrupt_handler(&computer, fp);
-    computer_init = true;
+    status = load_interrupt_handler(&computer, fp);
+    if(fp != NULL)
+        fclose(fp);
+    if(status != LOAD_OK)
+        fprintf(stderr, "Cannot load the interrupt handler: %s\n", load_status_message(status));
     
-    init_screen();
-    g_idle_add((GSourceFunc) update_display_state, (gpointer) (void*) FALSE);
+    take_snapshot(&computer); // state reset_emulator() goes back to
+    history_attach(&computer, HISTORY_INTERVAL, HISTORY_BUDGET); // for step_back() and reverse_continue()
+    
+    computer_init = true;
+    publish_state(SCREEN_FULL);
+    pthread_mutex_unlock(&computer_mutex);
     
     open_blocked = false;
     run_blocked = false;
@@ -579,13 +1035,49 @@ static void open_file_selector(GtkWidget *widget, gpointer data){
     gtk_widget_show(dialog);
 }
 
-static inline unsigned long get_time_millis(){
+/* Number of instructions run() executes between two checks of the GUI
+   state in unbounded mode (about a millisecond of emulation), also the 
+   largest batch at a bounded frequency */
+#define UNBOUNDED_BATCH_SZ 100000
 
-    struct timeval  tv;
-    gettimeofday(&tv, NULL);
-    double time_in_mill =  (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000;
+/* At a bounded frequency, instructions run by batches covering this much
+   emulated time (at least one instruction), each followed by a sleep 
+   until the absolute deadline of its last instruction */
+#define PACING_SLICE_NS 2000000LL // 2 ms
+
+// Longest sleep between two checks of the pause and stop requests
+#define MAX_SLEEP_NS 100000000LL // 100 ms
+
+/* Delay past which the host is considered unable to keep up with the 
+   frequency: deadlines start over from the current time instead of 
+   running a burst of instructions to catch up */
+#define MAX_LAG_NS 50000000LL // 50 ms
+
+// Shortest period over which the achieved frequency is measured
+#define MEASURE_PERIOD_NS 500000000LL // 500 ms
+
+static inline int64_t get_time_ns(){
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Sleeps until $deadline (CLOCK_MONOTONIC, in ns), or until the execution
+   is paused or stopped */
+static void sleep_until(int64_t deadline){
+
+    while(!run_paused && !stop_emulator){
     
-    return time_in_mill;
+        int64_t now = get_time_ns();
+        if(now >= deadline)
+            return;
+        
+        int64_t wake_up = (deadline - now > MAX_SLEEP_NS) ? now + MAX_SLEEP_NS : deadline;
+        struct timespec ts = {wake_up / 1000000000LL, wake_up % 1000000000LL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
 }
 
 void* execute_thread(void* arg){
@@ -594,11 +1086,28 @@ void* execute_thread(void* arg){
     int pc = computer.cpu.program_counter;
     bool halted = false;
     int program_size = computer.program_size;
-    char buf[1024];
     running = true;
-    unsigned long prev_time = get_time_millis();
-    unsigned long now_time;
-    double f;
+    double f = 0; // 0 until read from $frequency
+    StopConditions stop = {false, -1, false, true}; // on the breakpoints and watchpoints
+    RunStatus status = RUN_BUDGET_EXHAUSTED;
+    
+    // run() ignores a breakpoint on the instruction it starts from, so that
+    // execution resumes from it. Only the first batch after a start or a
+    // pause does, the next ones stop on it.
+    bool resumed = true;
+    
+    pthread_mutex_lock(&computer_mutex);
+    stop_status = RUN_BUDGET_EXHAUSTED;
+    pthread_mutex_unlock(&computer_mutex);
+    
+    // Deadlines are computed from the time and instruction count of the 
+    // last change of pace (start, frequency change, pause, lag)
+    bool repace = true;
+    int64_t pace_time = 0;
+    uint64_t pace_instructions = 0;
+    
+    int64_t measure_time = get_time_ns();
+    uint64_t measure_instructions = computer.instructions;
     
     while(!halted && (pc < program_size) 
                      || ((pc > computer.program_memory_size
@@ -612,6 +1121,11 @@ void* execute_thread(void* arg){
     	    run_blocked = true;
     	    pthread_mutex_unlock(&paused_mutex);
     	    run_paused = false;
+    	    
+    	    repace = true;
+    	    resumed = true;
+    	    measure_time = get_time_ns();
+    	    measure_instructions = computer.instructions;
     	}
     	
     	if(stop_emulator) {
@@ -620,76 +1134,104 @@ void* execute_thread(void* arg){
     	    break;
     	}
         
-        pthread_mutex_lock(&computer_mutex);
-        int instruction = get_word(&computer, pc);
-        pthread_mutex_unlock(&computer_mutex);
-        
-        pthread_mutex_lock(&computer_mutex);
-        execute_step(&computer);
-        halted = computer.halted;
-        pc = computer.cpu.program_counter;
-        pthread_mutex_unlock(&computer_mutex);
-        
         pthread_mutex_lock(&frequency_mutex);
-        f = frequency;
+        double target = full_speed ? -1 : frequency;
+        if(f != target)
+            repace = true;
+        f = target;
         pthread_mutex_unlock(&frequency_mutex);
         
-        if(f < 0 || f > 10){
+        if(repace){
             
-            now_time = get_time_millis();
-
-            if(now_time - prev_time > 100){
+            repace = false;
+            pace_time = get_time_ns();
+            pace_instructions = computer.instructions;
+        }
+        
+        // In unbounded mode, instructions are executed by the largest batches
+        uint64_t batch = UNBOUNDED_BATCH_SZ;
+        if(f > 0){
             
-                prev_time = now_time;
-                g_idle_add((GSourceFunc) full_update_display_state, NULL);
-            }
+            double slice = f * PACING_SLICE_NS / 1e9;
+            batch = (slice < 1) ? 1 : (slice > UNBOUNDED_BATCH_SZ) ? UNBOUNDED_BATCH_SZ : (uint64_t) slice;
         }
         
+        pthread_mutex_lock(&computer_mutex);
+        
+        // Paused while waiting for the mutex, by single_step(), step_back()
+        // or reverse_continue() which then changed the computer: nothing 
+        // runs from that state before the execution is resumed
+        if(run_paused || stop_emulator){
+            
+            pthread_mutex_unlock(&computer_mutex);
+            continue;
+        }
+        
+        if(!resumed && has_breakpoint(&computer, computer.cpu.program_counter))
+            status = RUN_BREAKPOINT; // the previous batch ended right on it
         else
-            g_idle_add((GSourceFunc) update_display_state, (gpointer) (void*) TRUE);
+            status = run(&computer, batch, stop);
+        resumed = false;
+        
+        if(status == RUN_BREAKPOINT || status == RUN_WATCHPOINT)
+            stop_status = status;
+            
+        halted = computer.halted;
+        pc = computer.cpu.program_counter;
+        uint64_t instructions = computer.instructions;
+        
+        int64_t now = get_time_ns();
+        if(now - measure_time >= MEASURE_PERIOD_NS){
+            
+            achieved_frequency = (instructions - measure_instructions) * 1e9 / (now - measure_time);
+            measure_time = now;
+            measure_instructions = instructions;
+        }
+        
+        // The state is published once per frame of the main window, when
+        // display_tick() asks for it
+        if(atomic_exchange(&publish_requested, false))
+            publish_state(SCREEN_DIRTY);
+        pthread_mutex_unlock(&computer_mutex);
+        
+        if(status == RUN_BREAKPOINT || status == RUN_WATCHPOINT)
+            break;
        
 
         if(f > 0){
             
-            int to_wait = 1000000 / f;
-            
-            if(to_wait > 800000){
-                
-                int us;
-                
-                do{
-                    
-                    us = (to_wait > 100000) ? 100000 : to_wait; 
-                    usleep(us);
-                    to_wait -= us;
-                    
-                    if(run_paused)
-                        continue;
-                    
-                    if(stop_emulator)
-                        break;
-                    
-                } while(to_wait > 0);
-            
-            }
+            int64_t deadline = pace_time + (int64_t) ((instructions - pace_instructions) * 1e9 / f);
             
+            if(now - deadline > MAX_LAG_NS)
+                repace = true;
             else
-            	usleep(to_wait);
+                sleep_until(deadline);
         }
     }
     
-    if(f < 0 || f > 10)
-        g_idle_add((GSourceFunc) full_update_display_state, NULL);
+    pthread_mutex_lock(&computer_mutex);
+    achieved_frequency = 0;
+    publish_state(SCREEN_DIRTY);
+    pthread_mutex_unlock(&computer_mutex);
+    
+    pthread_mutex_lock(&frequency_mutex);
+    full_speed = false;
+    pthread_mutex_unlock(&frequency_mutex);
       
     run_blocked = false;
     running = false;
     pthread_exit(NULL);
 }
 
-void start_executing(GtkWidget *widget, gpointer data){
+// Runs at $speed_up (or at the chosen frequency), starts or resumes the execution
+static void start_executing_at(bool speed_up){
 
     if(run_blocked || !computer_init)
         return;
+    
+    pthread_mutex_lock(&frequency_mutex);
+    full_speed = speed_up;
+    pthread_mutex_unlock(&frequency_mutex);
         
     if(run_paused){
     
@@ -702,6 +1244,18 @@ void start_executing(GtkWidget *widget, gpointer data){
     pthread_create(&thread, NULL, execute_thread, NULL);
 }
 
+void start_executing(GtkWidget *widget, gpointer data){
+    
+    start_executing_at(false);
+}
+
+/* Runs unbounded, whatever the frequency, until a breakpoint or a 
+   watchpoint stops the execution */
+void run_to_breakpoint(GtkWidget *widget, gpointer data){
+    
+    start_executing_at(true);
+}
+
 void pause_execution(GtkWidget *widget, gpointer data){
     
     static bool pausing = false;
@@ -715,6 +1269,34 @@ void pause_execution(GtkWidget *widget, gpointer data){
     pausing = false;  
 }
 
+/* Brings the computer back to its state right after the program was
+   loaded, only the memory the program modified is copied back. */
+void* reset_thread(void *arg) {
+
+    while(running && !run_paused) ;
+    stop_emulator = false;
+    
+    pthread_mutex_lock(&computer_mutex);
+    bool restored = computer_init && restore_snapshot(&computer);
+    if(restored){
+        history_attach(&computer, HISTORY_INTERVAL, HISTORY_BUDGET); // the previous run is forgotten
+        stop_status = RUN_BUDGET_EXHAUSTED;
+        publish_state(SCREEN_FULL);
+    }
+    pthread_mutex_unlock(&computer_mutex);
+    
+    if(!restored)
+        return open_thread(arg); // no snapshot, the program is loaded again
+    
+    open_blocked = false;
+    run_blocked = false;
+    
+    pthread_mutex_trylock(&paused_mutex);
+    pthread_mutex_unlock(&paused_mutex);
+    
+    pthread_exit(NULL);
+}
+
 void reset_emulator(GtkWidget *widget, gpointer data){
     
     if(first_open)
@@ -728,7 +1310,7 @@ void reset_emulator(GtkWidget *widget, gpointer data){
     run_paused = false;
     
     pthread_t thread;
-    pthread_create(&thread, NULL, open_thread, (void*) filename);
+    pthread_create(&thread, NULL, reset_thread, (void*) filename);
 }
 
 void single_step(GtkWidget *widget, gpointer data){
@@ -745,9 +1327,150 @@ void single_step(GtkWidget *widget, gpointer data){
                         && (pc < computer.memory_size))){
 
         pause_execution(NULL, NULL);
+        
+        pthread_mutex_lock(&computer_mutex);
         execute_step(&computer);
-        g_idle_add((GSourceFunc) update_display_state, (gpointer) (void*) TRUE);
+        stop_status = RUN_BUDGET_EXHAUSTED;
+        publish_state(SCREEN_DIRTY);
+        pthread_mutex_unlock(&computer_mutex);
+    }
+}
+
+/* Brings the computer back to its state before the last instruction, by
+   executing it again from the closest checkpoint of its history */
+void step_back(GtkWidget *widget, gpointer data){
+
+    if(!computer_init)
+        return;
+    
+    pause_execution(NULL, NULL);
+    
+    pthread_mutex_lock(&computer_mutex);
+    if(computer.instructions > history_start(&computer)){
+        history_seek(&computer, computer.instructions - 1);
+        stop_status = RUN_BUDGET_EXHAUSTED;
+        publish_state(SCREEN_DIRTY);
+    }
+    pthread_mutex_unlock(&computer_mutex);
+}
+
+/* Executes the computer backwards, until the last interrupt was about to
+   be handed to the interrupt handler, the last breakpoint was reached or
+   the last watchpoint was hit (or the start of its history) */
+void reverse_continue(GtkWidget *widget, gpointer data){
+
+    if(!computer_init)
+        return;
+    
+    pause_execution(NULL, NULL);
+    
+    StopConditions stop = {true, -1, false, true};
+    
+    pthread_mutex_lock(&computer_mutex);
+    history_reverse_continue(&computer, stop);
+    stop_status = RUN_BUDGET_EXHAUSTED;
+    publish_state(SCREEN_DIRTY);
+    pthread_mutex_unlock(&computer_mutex);
+}
+
+/* Lists the breakpoints and watchpoints of the computer, computer_mutex
+   must be held */
+static void update_breakpoints_label(){
+    
+    GString* text = g_string_new("Breakpoints:");
+    
+    for(int i = 0; i < computer.nb_breakpoints; i++)
+        g_string_append_printf(text, " %.8lx", computer.breakpoints[i]);
+    
+    g_string_append(text, "\nWatchpoints:");
+    for(int i = 0; i < computer.nb_watchpoints; i++){
+        
+        const Watchpoint* w = &computer.watchpoints[i];
+        g_string_append_printf(text, " [%.8lx, %.8lx) %s%s", w->start, w->end, 
+                               (w->access & WATCH_READ) ? "r" : "", (w->access & WATCH_WRITE) ? "w" : "");
     }
+    
+    gtk_label_set_text(GTK_LABEL(breakpoints_label), text->str);
+    g_string_free(text, TRUE);
+}
+
+/* Reads the breakpoint entry: an address, or a range START:END for a
+   watchpoint (hexadecimal). A single address watches its word. */
+static bool read_breakpoint_entry(long* start, long* end){
+    
+    GtkEntryBuffer* buffer = gtk_entry_get_buffer((GtkEntry*) breakpoint_entry);
+    const char* text = gtk_entry_buffer_get_text(buffer);
+    char* rest;
+    
+    *start = strtol(text, &rest, 16);
+    if(rest == text)
+        return false;
+    
+    if(*rest == ':'){
+        const char* text_end = rest + 1;
+        *end = strtol(text_end, &rest, 16);
+        if(rest == text_end)
+            return false;
+    }
+    else
+        *end = *start + 4;
+    
+    return *rest == '\0' && *start >= 0 && *start < *end;
+}
+
+/* Adds ($add) or removes the breakpoint or watchpoint given by the entry
+   and the drop-down */
+static void change_breakpoint(bool add){
+    
+    long start, end;
+    if(!computer_init || !read_breakpoint_entry(&start, &end))
+        return;
+    
+    guint kind = gtk_drop_down_get_selected(GTK_DROP_DOWN(breakpoint_kind));
+    int access = (kind == KIND_WATCH_WRITES) ? WATCH_WRITE :
+                 (kind == KIND_WATCH_READS) ? WATCH_READ : WATCH_READ | WATCH_WRITE;
+    
+    pthread_mutex_lock(&computer_mutex);
+    
+    bool done;
+    if(kind == KIND_BREAKPOINT)
+        done = add ? add_breakpoint(&computer, start) : remove_breakpoint(&computer, start);
+    else
+        done = add ? add_watchpoint(&computer, start, end, access) : remove_watchpoint(&computer, start, end);
+    
+    if(!done)
+        fprintf(stderr, "Cannot %s the %s\n", add ? "add" : "remove", 
+                (kind == KIND_BREAKPOINT) ? "breakpoint" : "watchpoint");
+    
+    update_breakpoints_label();
+    publish_state(SCREEN_KEEP);
+    pthread_mutex_unlock(&computer_mutex);
+    
+    update_display_state();
+}
+
+void add_breakpoint_clicked(GtkWidget *widget, gpointer data){
+    
+    change_breakpoint(true);
+}
+
+void remove_breakpoint_clicked(GtkWidget *widget, gpointer data){
+    
+    change_breakpoint(false);
+}
+
+void clear_breakpoints_clicked(GtkWidget *widget, gpointer data){
+    
+    if(!computer_init)
+        return;
+    
+    pthread_mutex_lock(&computer_mutex);
+    clear_breakpoints(&computer);
+    update_breakpoints_label();
+    publish_state(SCREEN_KEEP);
+    pthread_mutex_unlock(&computer_mutex);
+    
+    update_display_state();
 }
 
 void close_frequency(GtkWidget *widget, gpointer data){
@@ -769,9 +1492,11 @@ void set_temp_frequency(GtkWidget *widget, gpointer data){
 
 void set_frequency(GtkWidget *widget, gpointer data){
     
+    if(gtk_toggle_button_get_active((GtkToggleButton*) custom_frequency_radio))
+        temp_frequency = gtk_spin_button_get_value((GtkSpinButton*) custom_frequency_spin);
+    
     pthread_mutex_lock(&frequency_mutex);
     frequency = temp_frequency;
-    full_update_display_state();
     pthread_mutex_unlock(&frequency_mutex);
     
     frequency_window_opened = false;
@@ -820,11 +1545,26 @@ void open_frequency_window(GtkWidget *widget, gpointer data){
         gtk_box_append(GTK_BOX(hbox), frequency_radio[i]);
     }
     
-    for(int i = 0; i < NB_RADIOS; i++)
+    // Any other frequency, in Hz, read when OK is clicked
+    GtkWidget* custom_box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_widget_set_halign (custom_box, GTK_ALIGN_CENTER);
+    custom_frequency_radio = gtk_toggle_button_new_with_label("Custom (Hz)");
+    custom_frequency_spin = gtk_spin_button_new_with_range(0.01, 1e9, 1);
+    gtk_spin_button_set_digits((GtkSpinButton*) custom_frequency_spin, 2);
+    gtk_spin_button_set_value((GtkSpinButton*) custom_frequency_spin, 
+                              (frequency > 0) ? frequency : 1000.0);
+    gtk_box_append(GTK_BOX(custom_box), custom_frequency_radio);
+    gtk_box_append(GTK_BOX(custom_box), custom_frequency_spin);
+    gtk_box_append(GTK_BOX(vbox), custom_box);
+    
+    for(int i = 0; i < NB_RADIOS; i++){
         for(int j = i + 1; j < NB_RADIOS; j++)
             if(i!= j)
                 gtk_toggle_button_set_group((GtkToggleButton*) frequency_radio[i], 
                                             (GtkToggleButton*) frequency_radio[j]);
+        gtk_toggle_button_set_group((GtkToggleButton*) frequency_radio[i], 
+                                    (GtkToggleButton*) custom_frequency_radio);
+    }
     
     gtk_box_append(GTK_BOX(vbox), ok_button);
     g_signal_connect(ok_button, "clicked", G_CALLBACK (set_frequency), 
@@ -839,22 +1579,18 @@ void open_drawing_window(GtkWidget *widget, gpointer data){
 
     GtkWidget *window;
     
-    screen_area = VIDEO_MEMORY_SZ / 4;
-    screen_height = sqrt((screen_area * 2.0) / 3.0);
-    screen_width = screen_area / screen_height;
+    framebuffer_dimensions(VIDEO_MEMORY_SZ, &screen_width, &screen_height);
     
     window = gtk_window_new();
     screen_window = window;
     gtk_window_set_title (GTK_WINDOW (window), "Screen");
     gtk_window_set_deletable(GTK_WINDOW (window), FALSE);
-    pixels_buf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, 
-                                FALSE, 8, 
-                                screen_width, screen_height);
+    frame = calloc(screen_width * screen_height, 4);
     
-    
-    canvas = gtk_picture_new_for_pixbuf(pixels_buf);
-    update_screen();
-    //gtk_picture_set_pixbuf((GtkPicture*) canvas, pixels_buf);
+    canvas = gtk_picture_new();
+    GBytes* bytes = g_bytes_new(frame, (gsize) screen_width * screen_height * 4);
+    present_frame(bytes);
+    g_bytes_unref(bytes);
     gtk_window_set_child (GTK_WINDOW (window), canvas);
     gtk_widget_set_size_request(canvas, screen_width, screen_height);
     make_responsive(window);
@@ -866,7 +1602,12 @@ static void activate(GtkApplication *app, gpointer user_data){
     GtkWidget *window, *file_button, *box1, *box2, *grid, *hbox;
     GtkWidget *hbox2, *action_box, *action_bar, *run_button;
     GtkWidget *vbox, *pause_button, *regs_table, *step_button;
-    GtkWidget *reset_button, *frequency_button;
+    GtkWidget *reset_button, *frequency_button, *back_button, *reverse_button;
+    GtkWidget *break_run_button, *debug_box, *add_button, *remove_button, *clear_button;
+    GtkWidget *code_box, *memory_box;
+    
+    static const char* const breakpoint_kinds[] = {"Breakpoint", "Watch writes", "Watch reads", 
+                                                   "Watch accesses", NULL};
 
     window = gtk_application_window_new (app);
     main_window = window;
@@ -902,7 +1643,10 @@ static void activate(GtkApplication *app, gpointer user_data){
     address_search = gtk_entry_new();
     action_bar = gtk_action_bar_new();
     run_button = gtk_button_new_with_label("Run");
+    break_run_button = gtk_button_new_with_label ("Run to\n break");
     step_button = gtk_button_new_with_label ("Single\n  step");
+    back_button = gtk_button_new_with_label ("Step\nback");
+    reverse_button = gtk_button_new_with_label ("Reverse");
     pause_button = gtk_button_new_with_label("Pause");
     reset_button = gtk_button_new_with_label("Reset");
     frequency_button = gtk_button_new_with_label ("       Set\nfrequency");
@@ -912,23 +1656,55 @@ static void activate(GtkApplication *app, gpointer user_data){
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, file_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, reset_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, run_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, break_run_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, step_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, back_button);
+    gtk_action_bar_pack_start((GtkActionBar*) action_bar, reverse_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, pause_button);
     gtk_action_bar_pack_start((GtkActionBar*) action_bar, frequency_button);
+    
+    frequency_label = gtk_label_new("-");
+    gtk_action_bar_pack_end((GtkActionBar*) action_bar, frequency_label);
 
     g_signal_connect (run_button, "clicked", G_CALLBACK (start_executing), NULL);
+    g_signal_connect (break_run_button, "clicked", G_CALLBACK (run_to_breakpoint), NULL);
     g_signal_connect (step_button, "clicked", G_CALLBACK (single_step), NULL);
+    g_signal_connect (back_button, "clicked", G_CALLBACK (step_back), NULL);
+    g_signal_connect (reverse_button, "clicked", G_CALLBACK (reverse_continue), NULL);
     g_signal_connect (file_button, "clicked", G_CALLBACK (open_file_selector), NULL);
     g_signal_connect (pause_button, "clicked", G_CALLBACK (pause_execution), NULL);
     g_signal_connect (reset_button, "clicked", G_CALLBACK (reset_emulator), NULL);
     g_signal_connect (frequency_button, "clicked", G_CALLBACK (open_frequency_window), NULL);
     g_signal_connect (address_button, "clicked", G_CALLBACK (update_memory_address), NULL);
     
-    code_view = create_code_view_and_model ();
-    gtk_tree_view_set_enable_search((GtkTreeView*) code_view, FALSE);
+    // Breakpoints and watchpoints: address or START:END range, kind, list
+    debug_box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_widget_set_halign (debug_box, GTK_ALIGN_CENTER);
+    breakpoint_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(breakpoint_entry), "address or start:end");
+    breakpoint_kind = gtk_drop_down_new_from_strings(breakpoint_kinds);
+    add_button = gtk_button_new_with_label("Add");
+    remove_button = gtk_button_new_with_label("Remove");
+    clear_button = gtk_button_new_with_label("Clear");
+    breakpoints_label = gtk_label_new("Breakpoints:\nWatchpoints:");
+    gtk_label_set_xalign(GTK_LABEL(breakpoints_label), 0);
+    stop_label = gtk_label_new("");
+    
+    gtk_box_append (GTK_BOX (debug_box), breakpoint_entry);
+    gtk_box_append (GTK_BOX (debug_box), breakpoint_kind);
+    gtk_box_append (GTK_BOX (debug_box), add_button);
+    gtk_box_append (GTK_BOX (debug_box), remove_button);
+    gtk_box_append (GTK_BOX (debug_box), clear_button);
+    gtk_box_append (GTK_BOX (debug_box), breakpoints_label);
+    gtk_box_append (GTK_BOX (debug_box), stop_label);
+    
+    g_signal_connect (add_button, "clicked", G_CALLBACK (add_breakpoint_clicked), NULL);
+    g_signal_connect (remove_button, "clicked", G_CALLBACK (remove_breakpoint_clicked), NULL);
+    g_signal_connect (clear_button, "clicked", G_CALLBACK (clear_breakpoints_clicked), NULL);
+    
+    code_box = create_code_view_and_model ();
     
-    memory_view = create_memory_view_and_model();
-    gtk_tree_view_set_enable_search((GtkTreeView*) memory_view, FALSE);
+    memory_box = create_memory_view_and_model();
     
     
     regs_views[0] = create_regs_view_and_model (0, 10);
@@ -948,13 +1724,14 @@ static void activate(GtkApplication *app, gpointer user_data){
     
     gtk_box_append(GTK_BOX (vbox), action_box);
     gtk_box_append(GTK_BOX (vbox), hbox);
+    gtk_box_append(GTK_BOX (vbox), debug_box);
     gtk_box_append(GTK_BOX (action_box), action_bar);
     gtk_box_append (GTK_BOX (hbox2), address_search);
     gtk_box_append (GTK_BOX (hbox2), address_button);
     gtk_box_append (GTK_BOX (box2), (GtkWidget*) hbox2);
-    gtk_box_append (GTK_BOX (box2), memory_view);
+    gtk_box_append (GTK_BOX (box2), memory_box);
     
-    gtk_box_append(GTK_BOX (hbox), code_view);
+    gtk_box_append(GTK_BOX (hbox), code_box);
     gtk_box_append(GTK_BOX (hbox), box2);
     
     for(int i = 0; i < NB_REGS_STORES; i++)
@@ -963,6 +1740,7 @@ static void activate(GtkApplication *app, gpointer user_data){
     gtk_box_append (GTK_BOX (hbox), box1);
     
     make_responsive(window);
+    gtk_widget_add_tick_callback(window, display_tick, NULL, NULL);
     gtk_widget_show (window);
     
     open_drawing_window(NULL, NULL);
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emulator.h"
+#include "jit.h"
+#include "framebuffer.h"
+#include "profile.h"
+#include "trace.h"
+
+/* Command-line runner: executes a program without the GUI, until it halts
+   or until its instruction or time budget is spent, then prints the state
+   of the computer. */
+
+// Number of instructions run() executes between two checks of the time budget
+#define BATCH_SZ 1000000
+
+#define MAX_DUMPS 16
+
+// Number of addresses listed by the profile report
+#define PROFILE_TOP 30
+
+typedef struct{
+    long start;
+    long end; // exclusive
+} MemoryRange;
+
+static void usage(const char* name){
+    fprintf(stderr, "Usage: %s [options] program.bin\n", name);
+    fprintf(stderr, "  -k FILE       interrupt handler to load in kernel memory\n");
+    fprintf(stderr, "  -n COUNT      stop after COUNT instructions\n");
+    fprintf(stderr, "  -t SECONDS    stop after SECONDS seconds of emulation\n");
+    fprintf(stderr, "  -m START:END  dump the words of memory in [START, END) (hexadecimal, repeatable)\n");
+    fprintf(stderr, "  -d START:END  disassemble the words of [START, END) (hexadecimal, repeatable)\n");
+    fprintf(stderr, "  -s FILE       save the screen to FILE (PPM image) at the end\n");
+    fprintf(stderr, "  -I            interpret only, without the JIT\n");
+    fprintf(stderr, "  -p FILE       profile the execution and write the report to FILE (- for stdout)\n");
+    fprintf(stderr, "  -T FILE       record an execution trace in FILE (see tracedump)\n");
+}
+
+static double get_time_seconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool parse_range(const char* arg, MemoryRange* range){
+    char* end;
+
+    range->start = strtol(arg, &end, 16);
+    if(*end != ':'){
+        return false;
+    }
+
+    range->end = strtol(end + 1, &end, 16);
+    return *end == '\0' && range->start >= 0 && range->start <= range->end;
+}
+
+static void print_registers(Computer* c){
+    for(int i = 0; i < 32; i++){
+        printf("%-3s = %.8x%s", reg_symbols[i], get_register(c, i), (i % 4 == 3) ? "\n" : "  ");
+    }
+    printf("PC  = %.8lx\n", c->cpu.program_counter);
+}
+
+static void dump_memory(Computer* c, MemoryRange range){
+    printf("\nMemory [%.8lx, %.8lx):\n", range.start, range.end);
+
+    long addr = range.start & ~3L;
+    while(addr < range.end){
+        printf("%.8lx:", addr);
+        for(int i = 0; i < 4 && addr < range.end; i++, addr += 4){
+            printf(" %.8x", get_word(c, addr));
+        }
+        printf("\n");
+    }
+}
+
+// Listing of $range, with labels on the targets of its branches
+static void dump_disassembly(Computer* c, MemoryRange range, Disassembly* d){
+    printf("\nDisassembly [%.8lx, %.8lx):\n", range.start, range.end);
+
+    long n = disassemble_range(c, range.start, range.end, d);
+    if(n < 0){
+        printf("Cannot allocate the listing\n");
+        return;
+    }
+
+    for(long i = 0; i < n; i++){
+        const DisassemblyLine* line = &d->lines[i];
+        if(line->target){
+            printf("L_%.8lx:\n", line->addr);
+        }
+        printf("    %.8lx: %.8x  %s\n", line->addr, line->word, d->text + line->text);
+    }
+}
+
+// Writes video memory as a binary PPM image, one row at a time
+static bool save_screen(Computer* c, const char* path){
+    int width, height;
+    framebuffer_dimensions(c->video_memory_size, &width, &height);
+
+    FILE* fp = fopen(path, "wb");
+    if(fp == NULL){
+        return false;
+    }
+
+    unsigned char* row = malloc((size_t) width * 3);
+    if(row == NULL){
+        fclose(fp);
+        return false;
+    }
+
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for(int y = 0; y < height; y++){
+        framebuffer_to_rgb(row, c->cpu.video_memory + (long) y * width * 4, width);
+        fwrite(row, 3, width, fp);
+    }
+
+    free(row);
+    return fclose(fp) == 0;
+}
+
+int main(int argc, char** argv){
+    const char* handler_path = NULL;
+    uint64_t max_instructions = UINT64_MAX;
+    double max_seconds = -1;
+    MemoryRange dumps[MAX_DUMPS];
+    int nb_dumps = 0;
+    MemoryRange listings[MAX_DUMPS];
+    int nb_listings = 0;
+    bool use_jit = true;
+    const char* screen_path = NULL;
+    const char* profile_path = NULL;
+    const char* trace_path = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "k:n:t:m:d:s:Ip:T:h")) != -1){
+        switch(opt){
+            case 'k': handler_path = optarg; break;
+            case 'n': max_instructions = strtoull(optarg, NULL, 10); break;
+            case 't': max_seconds = atof(optarg); break;
+            case 'm':
+                if(nb_dumps == MAX_DUMPS || !parse_range(optarg, &dumps[nb_dumps])){
+                    fprintf(stderr, "Invalid or too many memory ranges: %s\n", optarg);
+                    return 1;
+                }
+                nb_dumps++;
+                break;
+            case 'd':
+                if(nb_listings == MAX_DUMPS || !parse_range(optarg, &listings[nb_listings])){
+                    fprintf(stderr, "Invalid or too many disassembly ranges: %s\n", optarg);
+                    return 1;
+                }
+                nb_listings++;
+                break;
+            case 's': screen_path = optarg; break;
+            case 'I': use_jit = false; break;
+            case 'p': profile_path = optarg; break;
+            case 'T': trace_path = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if(optind != argc - 1){
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* fp = fopen(argv[optind], "rb");
+    if(fp == NULL){
+        fprintf(stderr, "Cannot open %s\n", argv[optind]);
+        return 1;
+    }
+
+    static Computer computer;
+    init_computer(&computer, PROGRAM_MEMORY_SZ, VIDEO_MEMORY_SZ, KERNEL_MEMORY_SZ);
+    if(use_jit){
+        jit_attach(&computer); // falls back to the interpreter if not supported by the host
+    }
+    if(profile_path != NULL && !profile_attach(&computer)){
+        fprintf(stderr, "Cannot allocate the profile\n");
+        free_computer(&computer);
+        return 1;
+    }
+
+    LoadStatus status = load(&computer, fp);
+    fclose(fp);
+    if(status != LOAD_OK){
+        fprintf(stderr, "Cannot load %s: %s\n", argv[optind], load_status_message(status));
+        free_computer(&computer);
+        return 1;
+    }
+
+    if(handler_path != NULL){
+        fp = fopen(handler_path, "rb");
+        if(fp == NULL){
+            fprintf(stderr, "Cannot open %s\n", handler_path);
+            free_computer(&computer);
+            return 1;
+        }
+        status = load_interrupt_handler(&computer, fp);
+        fclose(fp);
+        if(status != LOAD_OK){
+            fprintf(stderr, "Cannot load %s: %s\n", handler_path, load_status_message(status));
+            free_computer(&computer);
+            return 1;
+        }
+    }
+
+    // Started once everything is loaded, the trace begins with the initial state
+    if(trace_path != NULL && !trace_start(&computer, trace_path)){
+        fprintf(stderr, "Cannot write %s\n", trace_path);
+        free_computer(&computer);
+        return 1;
+    }
+
+    StopConditions no_stop = {.on_interrupt = false, .breakpoint = -1};
+    RunStatus run_status = RUN_BUDGET_EXHAUSTED;
+    double start = get_time_seconds();
+    double elapsed = 0;
+
+    while(computer.instructions < max_instructions){
+        uint64_t batch = max_instructions - computer.instructions;
+        if(batch > BATCH_SZ){
+            batch = BATCH_SZ;
+        }
+
+        run_status = run(&computer, batch, no_stop);
+        elapsed = get_time_seconds() - start;
+
+        if(run_status == RUN_HALTED || (max_seconds >= 0 && elapsed >= max_seconds)){
+            break;
+        }
+    }
+
+    print_registers(&computer);
+    for(int i = 0; i < nb_dumps; i++){
+        dump_memory(&computer, dumps[i]);
+    }
+    if(nb_listings > 0){
+        Disassembly disassembly;
+        init_disassembly(&disassembly, true);
+        for(int i = 0; i < nb_listings; i++){
+            dump_disassembly(&computer, listings[i], &disassembly);
+        }
+        free_disassembly(&disassembly);
+    }
+
+    printf("\n%s after %lu instructions in %.3f s (%.2f MIPS)\n",
+           (run_status == RUN_HALTED) ? "Halted" : "Stopped",
+           (unsigned long) computer.instructions, elapsed,
+           (elapsed > 0) ? computer.instructions / elapsed / 1e6 : 0.0);
+
+    if(screen_path != NULL && !save_screen(&computer, screen_path)){
+        fprintf(stderr, "Cannot write %s\n", screen_path);
+    }
+
+    if(profile_path != NULL){
+        FILE* out = (strcmp(profile_path, "-") == 0) ? stdout : fopen(profile_path, "w");
+        if(out == NULL){
+            fprintf(stderr, "Cannot write %s\n", profile_path);
+        }
+        else{
+            profile_report(&computer, out, PROFILE_TOP);
+            if(out != stdout){
+                fclose(out);
+            }
+        }
+    }
+
+    if(trace_path != NULL && !trace_stop(&computer)){
+        fprintf(stderr, "Cannot write %s\n", trace_path);
+    }
+
+    free_computer(&computer);
+
+    return (run_status == RUN_HALTED) ? 0 : 2;
+}
@@ -0,0 +1,497 @@
+#include "history.h"
+#include <assert.h>
+#include <string.h>
+
+// Copy of a page of memory, as it was when a checkpoint was taken
+typedef struct PageCopy{
+    struct PageCopy* older; // previous copy of the same page, NULL if none is kept
+    uint64_t checkpoint; // number of the checkpoint that holds it
+    long page;
+    char data[MEMORY_PAGE_SZ];
+} PageCopy;
+
+typedef struct{
+    uint64_t number; // increases with each checkpoint taken
+    uint64_t instruction; // value of c -> instructions
+    long program_counter;
+    int registers[32];
+    bool halted;
+    long latest_accessed;
+
+    PageCopy** copies; // of the pages written since the previous checkpoint (every page for the first one)
+    long nb_copies;
+    long capacity;
+} Checkpoint;
+
+typedef struct{
+    uint64_t instruction; // value of c -> instructions when it was handed to the handler
+    PendingInterrupt irq;
+} LoggedInterrupt;
+
+typedef struct History{
+    uint64_t interval;
+    size_t budget;
+    size_t size; // bytes taken by the copies and the log
+
+    Checkpoint* checkpoints; // oldest first
+    long nb_checkpoints;
+    long max_checkpoints;
+    uint64_t next_number;
+    uint64_t due; // next checkpoint, in instructions
+
+    PageCopy** newest; // per page, its most recent copy or NULL
+
+    LoggedInterrupt* interrupts; // in the order they were delivered
+    long nb_interrupts;
+    long max_interrupts;
+
+    bool replaying; // the history itself executes the computer, no checkpoint is taken
+    bool diverged; // an interrupt could not be logged, the history starts over at the next checkpoint
+} History;
+
+#define NO_HIT UINT64_MAX
+
+static long page_size(Computer* c, long page){
+    long start = page << MEMORY_PAGE_SHIFT;
+    return (c->memory_size - start < MEMORY_PAGE_SZ) ? c->memory_size - start : MEMORY_PAGE_SZ;
+}
+
+// Whether the $size bytes at $data, a page of memory, are all zeros
+static bool is_zero(const char* data, long size){
+    long i = 0;
+    for(; i + 8 <= size; i += 8){
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        if(word != 0){
+            return false;
+        }
+    }
+    for(; i < size; i++){
+        if(data[i] != 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Content of $page as of the checkpoint $number, NULL for all zeros
+static const char* page_at(History* h, long page, uint64_t number){
+    for(PageCopy* copy = h->newest[page]; copy != NULL; copy = copy->older){
+        if(copy->checkpoint <= number){
+            return copy->data;
+        }
+    }
+    return NULL;
+}
+
+// Makes room for $n more copies in $checkpoint
+static bool reserve_copies(Checkpoint* checkpoint, long n){
+    if(checkpoint->nb_copies + n <= checkpoint->capacity){
+        return true;
+    }
+
+    long capacity = (checkpoint->capacity == 0) ? 64 : 2 * checkpoint->capacity;
+    if(capacity < checkpoint->nb_copies + n){
+        capacity = checkpoint->nb_copies + n;
+    }
+    PageCopy** copies = realloc(checkpoint->copies, capacity * sizeof(PageCopy*));
+    if(copies == NULL){
+        return false;
+    }
+    checkpoint->copies = copies;
+    checkpoint->capacity = capacity;
+    return true;
+}
+
+/* Copies the pages of $c written since the last checkpoint, or all of
+   those that are not all zeros if $all_pages, into a new checkpoint.
+   Returns false, leaving the history as it was, if memory runs out. */
+static bool take_checkpoint(Computer* c, History* h, bool all_pages){
+    if(h->nb_checkpoints == h->max_checkpoints){
+        long max = (h->max_checkpoints == 0) ? 16 : 2 * h->max_checkpoints;
+        Checkpoint* checkpoints = realloc(h->checkpoints, max * sizeof(Checkpoint));
+        if(checkpoints == NULL){
+            return false;
+        }
+        h->checkpoints = checkpoints;
+        h->max_checkpoints = max;
+    }
+
+    Checkpoint* checkpoint = &h->checkpoints[h->nb_checkpoints];
+    memset(checkpoint, 0, sizeof(Checkpoint));
+    checkpoint->number = h->next_number;
+
+    for(long page = 0; page < c->nb_pages; page++){
+        const char* data = &c->cpu.memory[page << MEMORY_PAGE_SHIFT];
+        bool copied = all_pages ? !is_zero(data, page_size(c, page)) : (c->page_flags[page] & PAGE_CHANGED);
+        if(!copied){
+            continue;
+        }
+
+        PageCopy* copy = malloc(sizeof(PageCopy));
+        if(copy == NULL || !reserve_copies(checkpoint, 1)){
+            free(copy);
+            for(long i = 0; i < checkpoint->nb_copies; i++){
+                free(checkpoint->copies[i]);
+            }
+            free(checkpoint->copies);
+            return false;
+        }
+        copy->checkpoint = checkpoint->number;
+        copy->page = page;
+        memcpy(copy->data, data, page_size(c, page));
+        checkpoint->copies[checkpoint->nb_copies++] = copy;
+    }
+
+    // Nothing can fail anymore, the copies become the newest ones
+    for(long i = 0; i < checkpoint->nb_copies; i++){
+        PageCopy* copy = checkpoint->copies[i];
+        copy->older = h->newest[copy->page];
+        h->newest[copy->page] = copy;
+        c->page_flags[copy->page] &= ~PAGE_CHANGED;
+    }
+    h->size += checkpoint->nb_copies * sizeof(PageCopy);
+
+    // The first checkpoint holds every page, the next ones only the pages written after it
+    if(all_pages){
+        for(long page = 0; page < c->nb_pages; page++){
+            c->page_flags[page] &= ~PAGE_CHANGED;
+        }
+    }
+
+    checkpoint->instruction = c->instructions;
+    checkpoint->program_counter = c->cpu.program_counter;
+    memcpy(checkpoint->registers, c->cpu.registers, sizeof(checkpoint->registers));
+    checkpoint->halted = c->halted;
+    checkpoint->latest_accessed = c->latest_accessed;
+
+    h->nb_checkpoints++;
+    h->next_number++;
+    return true;
+}
+
+// Forgets the interrupts logged before $instruction
+static void forget_interrupts_before(History* h, uint64_t instruction){
+    long n = 0;
+    while(n < h->nb_interrupts && h->interrupts[n].instruction < instruction){
+        n++;
+    }
+    memmove(h->interrupts, h->interrupts + n, (h->nb_interrupts - n) * sizeof(LoggedInterrupt));
+    h->nb_interrupts -= n;
+    h->size -= n * sizeof(LoggedInterrupt);
+}
+
+/* Merges the oldest checkpoint into the next one, which becomes the first
+   one: the copies the next one has of the same pages are enough. Returns
+   false if memory runs out. */
+static bool merge_oldest(History* h){
+    Checkpoint* oldest = &h->checkpoints[0];
+    Checkpoint* next = &h->checkpoints[1];
+
+    if(!reserve_copies(next, oldest->nb_copies)){
+        return false;
+    }
+
+    for(long i = 0; i < oldest->nb_copies; i++){
+        PageCopy* copy = oldest->copies[i];
+
+        // $copy is the oldest of its page, finds the one right after it
+        PageCopy* newer = h->newest[copy->page];
+        if(newer == copy){
+            newer = NULL;
+        }
+        while(newer != NULL && newer->older != copy){
+            newer = newer->older;
+        }
+
+        if(newer != NULL && newer->checkpoint == next->number){
+            newer->older = NULL;
+            free(copy);
+            h->size -= sizeof(PageCopy);
+        }
+        else{
+            copy->checkpoint = next->number;
+            next->copies[next->nb_copies++] = copy;
+        }
+    }
+
+    free(oldest->copies);
+    memmove(h->checkpoints, h->checkpoints + 1, (h->nb_checkpoints - 1) * sizeof(Checkpoint));
+    h->nb_checkpoints--;
+
+    forget_interrupts_before(h, h->checkpoints[0].instruction);
+    return true;
+}
+
+// Forgets the checkpoints taken after the checkpoint at index $last
+static void forget_checkpoints_after(History* h, long last){
+    while(h->nb_checkpoints - 1 > last){
+        Checkpoint* checkpoint = &h->checkpoints[h->nb_checkpoints - 1];
+
+        // The copies of the most recent checkpoint are the newest ones of their pages
+        for(long i = 0; i < checkpoint->nb_copies; i++){
+            PageCopy* copy = checkpoint->copies[i];
+            h->newest[copy->page] = copy->older;
+            free(copy);
+        }
+        h->size -= checkpoint->nb_copies * sizeof(PageCopy);
+        free(checkpoint->copies);
+        h->nb_checkpoints--;
+    }
+}
+
+// Brings $c back to the state of the checkpoint at index $index
+static void restore_checkpoint(Computer* c, History* h, long index){
+    Checkpoint* checkpoint = &h->checkpoints[index];
+
+    // The pages that may differ are the ones written since the last checkpoint and the ones saved after this one
+    for(long i = index + 1; i < h->nb_checkpoints; i++){
+        for(long j = 0; j < h->checkpoints[i].nb_copies; j++){
+            c->page_flags[h->checkpoints[i].copies[j]->page] |= PAGE_CHANGED;
+        }
+    }
+
+    for(long page = 0; page < c->nb_pages; page++){
+        if(!(c->page_flags[page] & PAGE_CHANGED)){
+            continue;
+        }
+
+        // Pages left as they were keep their decoded and translated code
+        const char* data = page_at(h, page, checkpoint->number);
+        const char* current = &c->cpu.memory[page << MEMORY_PAGE_SHIFT];
+        bool same = (data != NULL) ? memcmp(current, data, page_size(c, page)) == 0 : is_zero(current, page_size(c, page));
+        if(!same){
+            write_page(c, page, data);
+        }
+        c->page_flags[page] &= ~PAGE_CHANGED;
+    }
+
+    c->cpu.program_counter = checkpoint->program_counter;
+    memcpy(c->cpu.registers, checkpoint->registers, sizeof(c->cpu.registers));
+    c->halted = checkpoint->halted;
+    c->latest_accessed = checkpoint->latest_accessed;
+    c->instructions = checkpoint->instruction;
+}
+
+// Index of the last checkpoint taken at or before $instruction, -1 if none
+static long checkpoint_before(History* h, uint64_t instruction){
+    long index = h->nb_checkpoints - 1;
+    while(index >= 0 && h->checkpoints[index].instruction > instruction){
+        index--;
+    }
+    return index;
+}
+
+/* Executes $c forward until c -> instructions is $target, delivering the
+   logged interrupts. $hit is set to the last instruction before $target
+   at which run() would have stopped on $breakpoint or, with 
+   $breakpoints, on a breakpoint or a watchpoint of $c (left as is if 
+   there is none). */
+static void replay(Computer* c, History* h, uint64_t target, long breakpoint, bool breakpoints, uint64_t* hit){
+    long next = 0;
+    while(next < h->nb_interrupts && h->interrupts[next].instruction < c->instructions){
+        next++;
+    }
+
+    // Live interrupts wait for the end of the replay
+    StopConditions stop = {false, breakpoint, true, breakpoints};
+    bool started = true; // run() ignores a breakpoint on the instruction it starts from
+
+    h->replaying = true;
+    while(c->instructions < target){
+        uint64_t end = target;
+        if(next < h->nb_interrupts && h->interrupts[next].instruction < end){
+            end = h->interrupts[next].instruction;
+        }
+
+        // An interrupt is delivered before the breakpoint is checked, as in run()
+        if(started && c->instructions < end && ((breakpoint >= 0 && c->cpu.program_counter == breakpoint) ||
+                                               (breakpoints && has_breakpoint(c, c->cpu.program_counter)))){
+            *hit = c->instructions;
+        }
+        started = false;
+
+        if(c->instructions < end){
+            RunStatus status = run(c, end - c->instructions, stop);
+            if((status == RUN_BREAKPOINT || status == RUN_WATCHPOINT) && c->instructions < target){
+                *hit = c->instructions;
+            }
+            continue;
+        }
+
+        // The first instruction of the handler stops run() if it hits a watchpoint
+        PendingInterrupt irq = h->interrupts[next++].irq;
+        c->watch_hit = false;
+        execute_interrupt(c, irq.nb, irq.character);
+        if(breakpoints && c->watch_hit && c->instructions < target){
+            *hit = c->instructions;
+        }
+        started = true;
+    }
+    h->replaying = false;
+}
+
+static void free_history(History* h){
+    for(long i = 0; i < h->nb_checkpoints; i++){
+        for(long j = 0; j < h->checkpoints[i].nb_copies; j++){
+            free(h->checkpoints[i].copies[j]);
+        }
+        free(h->checkpoints[i].copies);
+    }
+    free(h->checkpoints);
+    free(h->newest);
+    free(h->interrupts);
+    free(h);
+}
+
+bool history_attach(Computer* c, uint64_t interval, size_t budget){
+    assert(c && interval > 0);
+
+    history_detach(c);
+
+    History* h = calloc(1, sizeof(History));
+    if(h == NULL){
+        return false;
+    }
+    h->interval = interval;
+    h->budget = budget;
+
+    h->newest = calloc(c->nb_pages, sizeof(PageCopy*));
+    if(h->newest == NULL || !take_checkpoint(c, h, true)){
+        free_history(h);
+        return false;
+    }
+    h->due = c->instructions + interval;
+
+    c->history = h;
+    return true;
+}
+
+void history_detach(Computer* c){
+    assert(c);
+
+    if(c->history != NULL){
+        free_history(c->history);
+        c->history = NULL;
+    }
+}
+
+uint64_t history_start(Computer* c){
+    assert(c);
+
+    History* h = c->history;
+    return (h == NULL || h->diverged) ? c->instructions : h->checkpoints[0].instruction;
+}
+
+bool history_seek(Computer* c, uint64_t instruction){
+    assert(c);
+
+    History* h = c->history;
+    if(h == NULL || h->diverged || instruction > c->instructions || instruction < h->checkpoints[0].instruction){
+        return false;
+    }
+
+    long index = checkpoint_before(h, instruction);
+    restore_checkpoint(c, h, index);
+    forget_checkpoints_after(h, index);
+    replay(c, h, instruction, -1, false, NULL);
+
+    // The interrupts past $instruction belong to the timeline left
+    while(h->nb_interrupts > 0 && h->interrupts[h->nb_interrupts - 1].instruction >= instruction){
+        h->nb_interrupts--;
+        h->size -= sizeof(LoggedInterrupt);
+    }
+
+    h->due = h->checkpoints[index].instruction + h->interval;
+    return true;
+}
+
+bool history_reverse_continue(Computer* c, StopConditions stop){
+    assert(c);
+
+    History* h = c->history;
+    if(h == NULL || h->diverged){
+        return false;
+    }
+
+    // Looks for the last stop in each interval between two checkpoints, the most recent first
+    uint64_t end = c->instructions;
+    for(long index = checkpoint_before(h, end); index >= 0; index--){
+        uint64_t start = h->checkpoints[index].instruction;
+        if(start >= end){
+            continue;
+        }
+
+        uint64_t hit = NO_HIT;
+        if(stop.on_interrupt){
+            for(long i = h->nb_interrupts - 1; i >= 0 && h->interrupts[i].instruction >= start; i--){
+                if(h->interrupts[i].instruction < end){
+                    hit = h->interrupts[i].instruction;
+                    break;
+                }
+            }
+        }
+
+        if(stop.breakpoint >= 0 || stop.breakpoints){
+            uint64_t breakpoint_hit = NO_HIT;
+            restore_checkpoint(c, h, index);
+            replay(c, h, end, stop.breakpoint, stop.breakpoints, &breakpoint_hit);
+            if(breakpoint_hit != NO_HIT && (hit == NO_HIT || breakpoint_hit > hit)){
+                hit = breakpoint_hit;
+            }
+        }
+
+        if(hit != NO_HIT){
+            return history_seek(c, hit);
+        }
+        end = start;
+    }
+
+    history_seek(c, h->checkpoints[0].instruction);
+    return false;
+}
+
+uint64_t history_next_checkpoint(Computer* c){
+    History* h = c->history;
+    return h->replaying ? UINT64_MAX : h->due;
+}
+
+void history_checkpoint(Computer* c){
+    History* h = c->history;
+
+    // Without memory for it, the next attempt waits for another interval
+    h->due = c->instructions + h->interval;
+
+    if(h->diverged){
+        forget_checkpoints_after(h, -1);
+        forget_interrupts_before(h, UINT64_MAX);
+        h->diverged = !take_checkpoint(c, h, true);
+        return;
+    }
+
+    if(!take_checkpoint(c, h, false)){
+        return;
+    }
+
+    while(h->size > h->budget && h->nb_checkpoints > 1 && merge_oldest(h)) ;
+}
+
+void history_log_interrupt(Computer* c, uint64_t instruction, PendingInterrupt irq){
+    History* h = c->history;
+
+    if(h->nb_interrupts == h->max_interrupts){
+        long max = (h->max_interrupts == 0) ? 256 : 2 * h->max_interrupts;
+        LoggedInterrupt* interrupts = realloc(h->interrupts, max * sizeof(LoggedInterrupt));
+        if(interrupts == NULL){
+            // The execution cannot be replayed past this interrupt anymore
+            h->diverged = true;
+            h->due = instruction;
+            return;
+        }
+        h->interrupts = interrupts;
+        h->max_interrupts = max;
+    }
+
+    h->interrupts[h->nb_interrupts++] = (LoggedInterrupt) {instruction, irq};
+    h->size += sizeof(LoggedInterrupt);
+}
@@ -0,0 +1,63 @@
+#ifndef HISTORY_H__
+#define HISTORY_H__
+
+#include "emulator.h"
+
+/* Time-travel debugging. While a history is attached to a computer, run()
+   takes a checkpoint of its state every $interval instructions and the
+   interrupts handed to the interrupt handler, the only input of the
+   execution, are logged with the instruction they were delivered at.
+   history_seek() brings the computer back to any earlier instruction: it
+   restores the closest checkpoint before it, then executes forward again
+   and delivers the logged interrupts at the same instructions.
+
+   A checkpoint only holds the pages written since the previous one, the
+   first one holds every page that is not all zeros. When the copies take
+   more than the memory budget, the oldest checkpoint is merged into the
+   next one and the interrupts logged before it are forgotten.
+
+   Going back in time starts a new timeline: the checkpoints and the
+   interrupts past the instruction reached are forgotten, executing
+   forward again takes live interrupts. */
+
+#define HISTORY_INTERVAL 1000000 // instructions between two checkpoints
+#define HISTORY_BUDGET (256L * 1024 * 1024) // bytes of memory for the checkpoints and the log
+
+/* Attaches a history to $c, starting from its current state. An attached
+   history is discarded and started over, e.g. after restore_snapshot()
+   or a load. Returns false if memory runs out. */
+bool history_attach(Computer* c, uint64_t interval, size_t budget);
+
+/* Releases the history of $c, if any. Called by free_computer(). */
+void history_detach(Computer* c);
+
+/* Earliest instruction (value of c -> instructions) the history of $c can
+   go back to. */
+uint64_t history_start(Computer* c);
+
+/* Brings $c back to its state when c -> instructions was $instruction.
+   Returns false, and leaves $c untouched, if $instruction is not between
+   history_start() and c -> instructions. */
+bool history_seek(Computer* c, uint64_t instruction);
+
+/* Executes $c backwards until the last time before the current
+   instruction one of the conditions of $stop was met: an interrupt was
+   about to be handed to the interrupt handler ($on_interrupt), the
+   instruction at $breakpoint or, with $breakpoints, one with a 
+   breakpoint was about to be executed, or an instruction had just hit
+   a watchpoint ($breakpoints too). Returns false if none was, $c is 
+   then back at history_start(). */
+bool history_reverse_continue(Computer* c, StopConditions stop);
+
+/* For run(): value of c -> instructions at which the next checkpoint is
+   due (UINT64_MAX while the history itself executes $c). */
+uint64_t history_next_checkpoint(Computer* c);
+
+/* For run(): takes a checkpoint of the current state of $c. */
+void history_checkpoint(Computer* c);
+
+/* For the CPU: logs $irq, handed to the interrupt handler when
+   c -> instructions was $instruction. */
+void history_log_interrupt(Computer* c, uint64_t instruction, PendingInterrupt irq);
+
+#endif
@@ -0,0 +1,708 @@
+#include "jit.h"
+#include <assert.h>
+#include <string.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+#define JIT_ARENA_SZ (16 * 1024 * 1024)
+#define JIT_MAX_BLOCK_LEN 32 // instructions
+#define JIT_MAX_INSTR_BYTES 96 // upper bound on the native code generated for one instruction
+
+// Number of times the dispatcher reaches an address before a block is translated from it
+#ifndef JIT_HOT_THRESHOLD
+#define JIT_HOT_THRESHOLD 16
+#endif
+
+// x86-64 registers, as encoded in ModRM bytes
+#define EAX 0
+#define ECX 1
+#define EDX 2
+
+/* Written by the native code when it hands control back to jit_run() */
+typedef struct{
+    int64_t budget; // instructions that were left to execute
+    unsigned char* exit_site; // rel32 of the jump that left the block, NULL if it cannot be chained
+} JitExit;
+
+/* Trampoline generated at the start of the arena: saves the callee-saved
+   registers, keeps $c in r12, $registers in rbx and $budget in r13, then
+   jumps to $code. Returns the address of the next instruction. */
+typedef long (*JitEntry)(Computer* c, int* registers, int64_t budget,
+                         unsigned char* code, JitExit* exit);
+
+typedef struct{
+    long first_slot;
+    long nb_slots;
+} JitBlock;
+
+struct Jit{
+    unsigned char* arena; // executable memory holding the trampoline and the blocks
+    unsigned char* free; // first unused byte of the arena
+    unsigned char* blocks_start; // first byte after the trampoline
+    unsigned char* exit_common;
+    JitEntry enter;
+
+    long slots;
+    unsigned char** blocks; // native entry point of the block starting at each slot
+    unsigned char* heat; // how many times the dispatcher reached each slot (saturating)
+
+    JitBlock* translated; // every block of the arena, so that they can be forgotten
+    int nb_translated;
+    int max_translated;
+
+    unsigned generation; // incremented each time the arena is flushed
+    bool invalidated; // set when a store hit translated code
+};
+
+typedef struct Jit Jit;
+
+static void emit8(Jit* jit, unsigned b){
+    *jit->free++ = (unsigned char) b;
+}
+
+static void emit32(Jit* jit, uint32_t v){
+    memcpy(jit->free, &v, 4);
+    jit->free += 4;
+}
+
+static void emit64(Jit* jit, uint64_t v){
+    memcpy(jit->free, &v, 8);
+    jit->free += 8;
+}
+
+/* Points the rel32 field at $site to $target */
+static void patch_rel32(unsigned char* site, unsigned char* target){
+    int32_t rel = (int32_t) (target - (site + 4));
+    memcpy(site, &rel, 4);
+}
+
+/* Emits a rel32 jump (0xE9) or conditional jump (0x0F $cc) whose target
+   is given later with patch_rel32(), returns the rel32 field. */
+static unsigned char* emit_jump(Jit* jit, int cc){
+    if(cc < 0){
+        emit8(jit, 0xE9);
+    }
+    else{
+        emit8(jit, 0x0F);
+        emit8(jit, cc);
+    }
+    unsigned char* site = jit->free;
+    emit32(jit, 0);
+    return site;
+}
+
+#define JCC_JAE 0x83
+#define JCC_JE 0x84
+#define JCC_JNE 0x85
+#define JCC_JL 0x8C
+#define JCC_JGE 0x8D
+
+static void emit_jump_to(Jit* jit, unsigned char* target){
+    patch_rel32(emit_jump(jit, -1), target);
+}
+
+/* mov r32, Beta register $reg (R31 reads as 0) */
+static void emit_load_reg(Jit* jit, int x86, int reg){
+    if(reg == 31){
+        emit8(jit, 0x31); emit8(jit, 0xC0 | x86 << 3 | x86); // xor r32, r32
+        return;
+    }
+    emit8(jit, 0x8B); emit8(jit, 0x43 | x86 << 3); emit8(jit, 4 * reg); // mov r32, [rbx + 4 * reg]
+}
+
+/* mov Beta register $reg, eax (writes to R31 are discarded) */
+static void emit_store_reg(Jit* jit, int reg){
+    if(reg == 31){
+        return;
+    }
+    emit8(jit, 0x89); emit8(jit, 0x43); emit8(jit, 4 * reg); // mov [rbx + 4 * reg], eax
+}
+
+static void emit_store_reg_imm(Jit* jit, int reg, int32_t value){
+    if(reg == 31){
+        return;
+    }
+    emit8(jit, 0xC7); emit8(jit, 0x43); emit8(jit, 4 * reg); emit32(jit, value); // mov dword [rbx + 4 * reg], imm32
+}
+
+static void emit_mov_rax(Jit* jit, long value){
+    if(value == (int32_t) value){
+        emit8(jit, 0x48); emit8(jit, 0xC7); emit8(jit, 0xC0); emit32(jit, value); // mov rax, simm32
+    }
+    else{
+        emit8(jit, 0x48); emit8(jit, 0xB8); emit64(jit, value); // mov rax, imm64
+    }
+}
+
+/* mov rdi, r12 ; mov rax, $fn ; call rax */
+static void emit_call(Jit* jit, void* fn){
+    emit8(jit, 0x4C); emit8(jit, 0x89); emit8(jit, 0xE7);
+    emit8(jit, 0x48); emit8(jit, 0xB8); emit64(jit, (uint64_t) fn);
+    emit8(jit, 0xFF); emit8(jit, 0xD0);
+}
+
+/* cmp $x86_64_reg, kernel_start ; jge (returned) */
+static unsigned char* emit_kernel_check(Jit* jit, int modrm, long kernel_start){
+    emit8(jit, 0x48); emit8(jit, 0xB9); emit64(jit, kernel_start); // mov rcx, imm64
+    emit8(jit, 0x48); emit8(jit, 0x39); emit8(jit, modrm); // cmp r64, rcx
+    return emit_jump(jit, JCC_JGE);
+}
+
+/* Leaves native code with $pc as next address, without chaining */
+static void emit_exit(Jit* jit, long pc){
+    emit_mov_rax(jit, pc);
+    emit8(jit, 0x31); emit8(jit, 0xD2); // xor edx, edx
+    emit_jump_to(jit, jit->exit_common);
+}
+
+/* Leaves native code with $pc as next address through a jump that
+   jit_run() patches once a block starts at $pc */
+static void emit_chained_exit(Jit* jit, long pc){
+    unsigned char* site = emit_jump(jit, -1);
+    patch_rel32(site, jit->free);
+    emit_mov_rax(jit, pc);
+    emit8(jit, 0x48); emit8(jit, 0xBA); emit64(jit, (uint64_t) site); // mov rdx, site
+    emit_jump_to(jit, jit->exit_common);
+}
+
+/* Called by native code for ST and STR, returns whether the store hit
+   translated code or a watchpoint (in which case the block must be left
+   right away) */
+static int jit_store(Computer* c, long addr, int word){
+    c->jit->invalidated = false;
+    store_word(c, addr, word);
+    return c->jit->invalidated || c->watch_hit;
+}
+
+/* Unless the condition $cc holds (on the flags just set), gives back the
+   budget of the rest of the block and leaves */
+static void emit_exit_unless(Jit* jit, int cc, long next_pc, int refund){
+    unsigned char* cont = emit_jump(jit, cc);
+    if(refund > 0){
+        emit8(jit, 0x49); emit8(jit, 0x81); emit8(jit, 0xC5); emit32(jit, refund); // add r13, imm32
+    }
+    emit_exit(jit, next_pc);
+    patch_rel32(cont, jit->free);
+}
+
+// After a store, leaves if jit_store() says so
+static void emit_store_exit(Jit* jit, long next_pc, int refund){
+    emit8(jit, 0x85); emit8(jit, 0xC0); // test eax, eax
+    emit_exit_unless(jit, JCC_JE, next_pc, refund);
+}
+
+// After a load, leaves if it hit a watchpoint
+static void emit_load_exit(Jit* jit, long next_pc, int refund){
+    emit8(jit, 0x41); emit8(jit, 0x80); emit8(jit, 0xBC); emit8(jit, 0x24); // cmp byte [r12 + disp32], 0
+    emit32(jit, offsetof(Computer, watch_hit)); emit8(jit, 0);
+    emit_exit_unless(jit, JCC_JE, next_pc, refund);
+}
+
+static void emit_trampoline(Jit* jit){
+    jit->enter = (JitEntry) jit->free;
+
+    emit8(jit, 0x53); emit8(jit, 0x55); // push rbx ; push rbp
+    emit8(jit, 0x41); emit8(jit, 0x54); emit8(jit, 0x41); emit8(jit, 0x55); // push r12 ; push r13
+    emit8(jit, 0x41); emit8(jit, 0x56); emit8(jit, 0x41); emit8(jit, 0x57); // push r14 ; push r15
+    emit8(jit, 0x48); emit8(jit, 0x83); emit8(jit, 0xEC); emit8(jit, 0x08); // sub rsp, 8 (16-byte alignment for calls)
+    emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xFC); // mov r12, rdi
+    emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xF3); // mov rbx, rsi
+    emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xD5); // mov r13, rdx
+    emit8(jit, 0x4D); emit8(jit, 0x89); emit8(jit, 0xC6); // mov r14, r8
+    emit8(jit, 0xFF); emit8(jit, 0xE1); // jmp rcx
+
+    // rax = next address, rdx = exit site
+    jit->exit_common = jit->free;
+    emit8(jit, 0x4D); emit8(jit, 0x89); emit8(jit, 0x2E); // mov [r14], r13
+    emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0x56); emit8(jit, offsetof(JitExit, exit_site)); // mov [r14 + 8], rdx
+    emit8(jit, 0x48); emit8(jit, 0x83); emit8(jit, 0xC4); emit8(jit, 0x08); // add rsp, 8
+    emit8(jit, 0x41); emit8(jit, 0x5F); emit8(jit, 0x41); emit8(jit, 0x5E); // pop r15 ; pop r14
+    emit8(jit, 0x41); emit8(jit, 0x5D); emit8(jit, 0x41); emit8(jit, 0x5C); // pop r13 ; pop r12
+    emit8(jit, 0x5D); emit8(jit, 0x5B); // pop rbp ; pop rbx
+    emit8(jit, 0xC3); // ret
+
+    jit->blocks_start = jit->free;
+}
+
+static int get_bits(int instruction, int i, int n){
+    int mask = (1 << n) - 1;
+    return (mask & (instruction >> i));
+}
+
+static bool ends_block(int instruction){
+    int opcode = get_bits(instruction, 26, 6);
+    return instruction == 0 || opcode == 0x1B || opcode == 0x1D || opcode == 0x1E;
+}
+
+/* Emits the native code of the instruction found at $pc, the $index-th
+   of a block of $length instructions. */
+static void translate_instruction(Computer* c, Jit* jit, long pc, int index, int length){
+
+    const long kernel_start = c->program_memory_size + c->video_memory_size;
+    const bool kernel_mode = pc >= kernel_start;
+    const long next_pc = pc + 4;
+    const int refund = length - index - 1;
+
+    int instruction = get_word(c, pc);
+    int opcode = get_bits(instruction, 26, 6);
+    int ra = get_bits(instruction, 16, 5);
+    int rb = get_bits(instruction, 11, 5);
+    int rc = get_bits(instruction, 21, 5);
+    int lit = get_bits(instruction, 0, 16);
+        lit |= ((lit & 0x8000) ? 0xFFFF0000 : 0); // SEXT(literal)
+
+    unsigned char* skip;
+
+    // Register-register operations: eax = ra, ecx = rb
+    if(opcode >= 0x20 && opcode <= 0x2E){
+        emit_load_reg(jit, EAX, ra);
+        emit_load_reg(jit, ECX, rb);
+    }
+    // Register-literal operations: eax = ra
+    else if(opcode >= 0x30 && opcode <= 0x3E){
+        emit_load_reg(jit, EAX, ra);
+    }
+
+    switch(opcode){
+        case 0x0:
+            if(instruction != 0){
+                break; // Invalid instruction
+            }
+            emit8(jit, 0x41); emit8(jit, 0xC6); emit8(jit, 0x84); emit8(jit, 0x24); // mov byte [r12 + disp32], 1
+            emit32(jit, offsetof(Computer, halted)); emit8(jit, 1);
+            emit_exit(jit, next_pc);
+            return;
+
+        case 0x18: // LD
+        case 0x19: // ST
+            emit_load_reg(jit, EAX, ra);
+            emit8(jit, 0x05); emit32(jit, lit); // add eax, lit
+            emit8(jit, 0x48); emit8(jit, 0x63); emit8(jit, 0xF0); // movsxd rsi, eax
+
+            skip = NULL;
+            if(!kernel_mode){
+                skip = emit_kernel_check(jit, 0xCE, kernel_start); // Cannot access kernel memory from user program memory
+            }
+
+            if(opcode == 0x18){
+                emit_call(jit, (void*) load_word);
+                emit_store_reg(jit, rc);
+                emit_load_exit(jit, next_pc, refund);
+            }
+            else{
+                emit_load_reg(jit, EDX, rc);
+                emit_call(jit, (void*) jit_store);
+                emit_store_exit(jit, next_pc, refund);
+            }
+
+            if(skip != NULL){
+                patch_rel32(skip, jit->free);
+            }
+            break;
+
+        case 0x1B: // JMP
+            emit_load_reg(jit, EAX, ra);
+            emit8(jit, 0x25); emit32(jit, 0xFFFFFFFC); // and eax, 0xFFFFFFFC (zero-extends into rax)
+
+            skip = NULL;
+            if(!kernel_mode){
+                skip = emit_kernel_check(jit, 0xC8, kernel_start);
+            }
+
+            emit_store_reg_imm(jit, rc, next_pc);
+
+            // Jumps straight to the target block if there is one
+            emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xC1); // mov rcx, rax
+            emit8(jit, 0x48); emit8(jit, 0xC1); emit8(jit, 0xE9); emit8(jit, 0x02); // shr rcx, 2
+            emit8(jit, 0x48); emit8(jit, 0xBA); emit64(jit, jit->slots); // mov rdx, slots
+            emit8(jit, 0x48); emit8(jit, 0x39); emit8(jit, 0xD1); // cmp rcx, rdx
+            unsigned char* out_of_range = emit_jump(jit, JCC_JAE);
+            emit8(jit, 0x48); emit8(jit, 0xBA); emit64(jit, (uint64_t) jit->blocks); // mov rdx, blocks
+            emit8(jit, 0x48); emit8(jit, 0x8B); emit8(jit, 0x0C); emit8(jit, 0xCA); // mov rcx, [rdx + rcx * 8]
+            emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xC9); // test rcx, rcx
+            unsigned char* not_translated = emit_jump(jit, JCC_JE);
+            emit8(jit, 0xFF); emit8(jit, 0xE1); // jmp rcx
+
+            patch_rel32(out_of_range, jit->free);
+            patch_rel32(not_translated, jit->free);
+            emit8(jit, 0x31); emit8(jit, 0xD2); // xor edx, edx
+            emit_jump_to(jit, jit->exit_common);
+
+            if(skip != NULL){
+                patch_rel32(skip, jit->free);
+                emit_chained_exit(jit, next_pc);
+            }
+            return;
+
+        case 0x1D: // BEQ
+        case 0x1E:{ // BNE
+            long target = next_pc + 4 * lit;
+            if(!kernel_mode && (target >= kernel_start)){
+                emit_chained_exit(jit, next_pc); // Cannot access kernel memory from user program memory
+                return;
+            }
+
+            emit_load_reg(jit, EAX, ra);
+            emit_store_reg_imm(jit, rc, next_pc);
+            emit8(jit, 0x85); emit8(jit, 0xC0); // test eax, eax
+            unsigned char* not_taken = emit_jump(jit, opcode == 0x1D ? JCC_JNE : JCC_JE);
+            emit_chained_exit(jit, target);
+            patch_rel32(not_taken, jit->free);
+            emit_chained_exit(jit, next_pc);
+            return;
+        }
+
+        case 0x1F:{ // LDR, or STR if the address is part of kernel memory
+            long addr = next_pc + 4 * lit;
+            emit8(jit, 0x48); emit8(jit, 0xBE); emit64(jit, addr); // mov rsi, imm64
+
+            if(addr >= kernel_start){
+                emit_load_reg(jit, EDX, rc);
+                emit_call(jit, (void*) jit_store);
+                emit_store_exit(jit, next_pc, refund);
+            }
+            else{
+                emit_call(jit, (void*) load_word);
+                emit_store_reg(jit, rc);
+                emit_load_exit(jit, next_pc, refund);
+            }
+            break;
+        }
+
+        case 0x20: emit8(jit, 0x01); emit8(jit, 0xC8); break; // ADD: add eax, ecx
+        case 0x21: emit8(jit, 0x29); emit8(jit, 0xC8); break; // SUB: sub eax, ecx
+        case 0x22: emit8(jit, 0x0F); emit8(jit, 0xAF); emit8(jit, 0xC1); break; // MUL: imul eax, ecx
+        case 0x23: emit8(jit, 0x99); emit8(jit, 0xF7); emit8(jit, 0xF9); break; // DIV: cdq ; idiv ecx
+
+        case 0x24: // CMPEQ
+        case 0x25: // CMPLT
+        case 0x26: // CMPLE
+            emit8(jit, 0x39); emit8(jit, 0xC8); // cmp eax, ecx
+            break;
+
+        case 0x28: emit8(jit, 0x21); emit8(jit, 0xC8); break; // AND: and eax, ecx
+        case 0x29: emit8(jit, 0x09); emit8(jit, 0xC8); break; // OR: or eax, ecx
+        case 0x2A: emit8(jit, 0x31); emit8(jit, 0xC8); break; // XOR: xor eax, ecx
+
+        // x86 shifts only consider the 5 least-significant bits of cl, as the Beta does
+        case 0x2C: emit8(jit, 0xD3); emit8(jit, 0xE0); break; // SHL: shl eax, cl
+        case 0x2D: emit8(jit, 0xD3); emit8(jit, 0xE8); break; // SHR: shr eax, cl
+        case 0x2E: emit8(jit, 0xD3); emit8(jit, 0xF8); break; // SRA: sar eax, cl
+
+        case 0x30: emit8(jit, 0x05); emit32(jit, lit); break; // ADDC: add eax, imm32
+        case 0x31: emit8(jit, 0x2D); emit32(jit, lit); break; // SUBC: sub eax, imm32
+        case 0x32: emit8(jit, 0x69); emit8(jit, 0xC0); emit32(jit, lit); break; // MULC: imul eax, eax, imm32
+        case 0x33: // DIVC: mov ecx, imm32 ; cdq ; idiv ecx
+            emit8(jit, 0xB9); emit32(jit, lit);
+            emit8(jit, 0x99); emit8(jit, 0xF7); emit8(jit, 0xF9);
+            break;
+
+        case 0x34: // CMPEQC
+        case 0x35: // CMPLTC
+        case 0x36: // CMPLEC
+            emit8(jit, 0x3D); emit32(jit, lit); // cmp eax, imm32
+            break;
+
+        case 0x38: emit8(jit, 0x25); emit32(jit, lit); break; // ANDC: and eax, imm32
+        case 0x39: emit8(jit, 0x0D); emit32(jit, lit); break; // ORC: or eax, imm32
+        case 0x3A: emit8(jit, 0x35); emit32(jit, lit); break; // XORC: xor eax, imm32
+
+        case 0x3C: emit8(jit, 0xC1); emit8(jit, 0xE0); emit8(jit, lit & 0x1F); break; // SHLC: shl eax, imm8
+        case 0x3D: emit8(jit, 0xC1); emit8(jit, 0xE8); emit8(jit, lit & 0x1F); break; // SHRC: shr eax, imm8
+        case 0x3E: emit8(jit, 0xC1); emit8(jit, 0xF8); emit8(jit, lit & 0x1F); break; // SRAC: sar eax, imm8
+
+        default:
+            return; // Invalid instructions are skipped
+    }
+
+    // Comparisons: eax = flag
+    switch(opcode){
+        case 0x24: case 0x34: emit8(jit, 0x0F); emit8(jit, 0x94); emit8(jit, 0xC0); break; // sete al
+        case 0x25: case 0x35: emit8(jit, 0x0F); emit8(jit, 0x9C); emit8(jit, 0xC0); break; // setl al
+        case 0x26: case 0x36: emit8(jit, 0x0F); emit8(jit, 0x9E); emit8(jit, 0xC0); break; // setle al
+        default: break;
+    }
+    if((opcode >= 0x24 && opcode <= 0x26) || (opcode >= 0x34 && opcode <= 0x36)){
+        emit8(jit, 0x0F); emit8(jit, 0xB6); emit8(jit, 0xC0); // movzx eax, al
+    }
+
+    if(opcode >= 0x20){
+        emit_store_reg(jit, rc);
+    }
+}
+
+static unsigned char* lookup(Jit* jit, long pc){
+    if(pc < 0 || (pc & 3) != 0 || (pc >> 2) >= jit->slots){
+        return NULL;
+    }
+    return jit->blocks[pc >> 2];
+}
+
+static bool is_hot(Jit* jit, long pc){
+    if(pc < 0 || (pc & 3) != 0 || (pc >> 2) >= jit->slots){
+        return false;
+    }
+    unsigned char* heat = &jit->heat[pc >> 2];
+    if(*heat < JIT_HOT_THRESHOLD){
+        (*heat)++;
+    }
+    return *heat >= JIT_HOT_THRESHOLD;
+}
+
+/* Translates the block starting at $pc, returns its native entry point or
+   NULL if it cannot be translated. */
+static unsigned char* translate(Computer* c, Jit* jit, long pc){
+
+    const long kernel_start = c->program_memory_size + c->video_memory_size;
+
+    if(jit->arena + JIT_ARENA_SZ - jit->free < JIT_MAX_BLOCK_LEN * JIT_MAX_INSTR_BYTES + 128){
+        jit_invalidate(c);
+    }
+
+    if(jit->nb_translated == jit->max_translated){
+        int max = jit->max_translated ? 2 * jit->max_translated : 256;
+        JitBlock* translated = realloc(jit->translated, max * sizeof(JitBlock));
+        if(translated == NULL){
+            return NULL;
+        }
+        jit->translated = translated;
+        jit->max_translated = max;
+    }
+
+    // The block ends at the first BEQ, BNE, JMP or HALT, or before a breakpoint, left to the interpreter
+    int length = 0;
+    bool terminated = false;
+    for(long addr = pc; length < JIT_MAX_BLOCK_LEN && (addr >> 2) < jit->slots && addr + 3 < c->memory_size; addr += 4){
+        if(has_breakpoint(c, addr)){
+            break;
+        }
+        length++;
+        if(ends_block(get_word(c, addr))){
+            terminated = true;
+            break;
+        }
+    }
+    if(length == 0){
+        return NULL;
+    }
+
+    unsigned char* entry = jit->free;
+
+    // Interrupts are delivered between blocks, by the interpreter
+    unsigned char* interrupted = NULL;
+    if(pc < kernel_start){
+        emit8(jit, 0x41); emit8(jit, 0x80); emit8(jit, 0xBC); emit8(jit, 0x24); // cmp byte [r12 + disp32], 0
+        emit32(jit, offsetof(Computer, cpu.interrupt_line)); emit8(jit, 0);
+        interrupted = emit_jump(jit, JCC_JNE);
+    }
+
+    // The whole block is charged at once, if enough budget is left
+    emit8(jit, 0x49); emit8(jit, 0x81); emit8(jit, 0xFD); emit32(jit, length); // cmp r13, length
+    unsigned char* no_budget = emit_jump(jit, JCC_JL);
+    emit8(jit, 0x49); emit8(jit, 0x81); emit8(jit, 0xED); emit32(jit, length); // sub r13, length
+
+    for(int i = 0; i < length; i++){
+        translate_instruction(c, jit, pc + 4 * i, i, length);
+    }
+    if(!terminated){
+        emit_chained_exit(jit, pc + 4 * length);
+    }
+
+    if(interrupted != NULL){
+        patch_rel32(interrupted, jit->free);
+    }
+    patch_rel32(no_budget, jit->free);
+    emit_exit(jit, pc);
+
+    // Stores into any of these slots must throw the block away
+    for(int i = 0; i < length; i++){
+        c->instruction_cache[(pc >> 2) + i].translated = true;
+        c->page_flags[(pc + 4 * i) >> MEMORY_PAGE_SHIFT] |= PAGE_CODE;
+    }
+    jit->translated[jit->nb_translated].first_slot = pc >> 2;
+    jit->translated[jit->nb_translated].nb_slots = length;
+    jit->nb_translated++;
+    jit->blocks[pc >> 2] = entry;
+
+    return entry;
+}
+
+bool jit_attach(Computer* c){
+    assert(c);
+
+    if(c->jit != NULL){
+        return true;
+    }
+
+    Jit* jit = calloc(1, sizeof(Jit));
+    if(jit == NULL){
+        return false;
+    }
+
+    jit->arena = mmap(NULL, JIT_ARENA_SZ, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit->slots = c->cache_slots;
+    jit->blocks = calloc(jit->slots, sizeof(unsigned char*));
+    jit->heat = calloc(jit->slots, sizeof(unsigned char));
+
+    if(jit->arena == MAP_FAILED || jit->blocks == NULL || jit->heat == NULL){
+        if(jit->arena != MAP_FAILED){
+            munmap(jit->arena, JIT_ARENA_SZ);
+        }
+        free(jit->blocks);
+        free(jit->heat);
+        free(jit);
+        return false;
+    }
+
+    jit->free = jit->arena;
+    emit_trampoline(jit);
+
+    c->jit = jit;
+    return true;
+}
+
+void jit_detach(Computer* c){
+    assert(c);
+
+    Jit* jit = c->jit;
+    if(jit == NULL){
+        return;
+    }
+
+    jit_invalidate(c);
+    munmap(jit->arena, JIT_ARENA_SZ);
+    free(jit->blocks);
+    free(jit->heat);
+    free(jit->translated);
+    free(jit);
+    c->jit = NULL;
+}
+
+void jit_invalidate(Computer* c){
+    assert(c);
+
+    Jit* jit = c->jit;
+    if(jit == NULL){
+        return;
+    }
+
+    for(int i = 0; i < jit->nb_translated; i++){
+        JitBlock* block = &jit->translated[i];
+        for(long slot = block->first_slot; slot < block->first_slot + block->nb_slots; slot++){
+            c->instruction_cache[slot].translated = false;
+        }
+        jit->blocks[block->first_slot] = NULL;
+    }
+
+    jit->nb_translated = 0;
+    jit->free = jit->blocks_start;
+    jit->generation++;
+    jit->invalidated = true;
+}
+
+RunStatus jit_run(Computer* c, uint64_t max_steps, StopConditions stop){
+    assert(c && c->jit);
+
+    Jit* jit = c->jit;
+
+    // Native blocks cannot stop in the middle, breakpoints are left to the interpreter
+    if(stop.breakpoint >= 0){
+        return interpret(c, max_steps, stop);
+    }
+
+    const long kernel_start = c->program_memory_size + c->video_memory_size;
+    uint64_t left = max_steps;
+
+    c->halted = false;
+
+    while(left > 0){
+
+        long pc = c->cpu.program_counter;
+        unsigned char* code = NULL;
+
+        if(stop.hold_interrupts || !atomic_load_explicit(&c->cpu.interrupt_line, memory_order_relaxed) || pc >= kernel_start){
+            // Not translated, breakpoints are checked here unless the interpreter would ignore them
+            if(stop.breakpoints && left != max_steps && has_breakpoint(c, pc)){
+                return RUN_BREAKPOINT;
+            }
+
+            code = lookup(jit, pc);
+            if(code == NULL && is_hot(jit, pc)){
+                code = translate(c, jit, pc);
+            }
+        }
+
+        // Interrupt delivery and cold code are left to the interpreter
+        if(code == NULL){
+            uint64_t before = c->instructions;
+            RunStatus status = interpret(c, 1, stop);
+            left -= c->instructions - before;
+
+            if(status != RUN_BUDGET_EXHAUSTED){
+                return status;
+            }
+            continue;
+        }
+
+        JitExit exit = {0, NULL};
+        int64_t budget = (left > INT64_MAX) ? INT64_MAX : (int64_t) left;
+        unsigned generation = jit->generation;
+
+        long next = jit->enter(c, c->cpu.registers, budget, code, &exit);
+
+        uint64_t executed = budget - exit.budget;
+        c->cpu.program_counter = next;
+        c->instructions += executed;
+        left -= executed;
+
+        if(c->halted){
+            return RUN_HALTED;
+        }
+        if(c->watch_hit){
+            if(stop.breakpoints){
+                return RUN_WATCHPOINT;
+            }
+            c->watch_hit = false; // not to leave the next blocks at each load
+        }
+
+        if(executed == 0){
+            if(!stop.hold_interrupts && atomic_load_explicit(&c->cpu.interrupt_line, memory_order_relaxed) && next < kernel_start){
+                continue;
+            }
+            // Less budget left than the block needs
+            return interpret(c, left, stop);
+        }
+
+        // Chains the block that was left to its successor
+        if(exit.exit_site != NULL && generation == jit->generation){
+            unsigned char* target = lookup(jit, next);
+            if(target != NULL){
+                patch_rel32(exit.exit_site, target);
+            }
+        }
+    }
+
+    return RUN_BUDGET_EXHAUSTED;
+}
+
+#else
+
+bool jit_attach(Computer* c){
+    return false; // Native code generation is only implemented for x86-64
+}
+
+void jit_detach(Computer* c){
+}
+
+void jit_invalidate(Computer* c){
+}
+
+RunStatus jit_run(Computer* c, uint64_t max_steps, StopConditions stop){
+    return interpret(c, max_steps, stop);
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef JIT_H__
+#define JIT_H__
+
+#include "emulator.h"
+
+/* Optional dynamic binary translator: basic blocks of Beta code that are
+   executed often enough are translated into native x86-64 code, which
+   run() then executes instead of interpreting them. A block ends at the
+   first BEQ, BNE, JMP or HALT, blocks jump directly to each other and
+   the state of the computer is the same as with the interpreter whenever
+   control is handed back to the caller of run(). Instructions with a
+   breakpoint (see add_breakpoint()) are never translated, blocks end
+   before them and leave them to the interpreter.
+
+   On other architectures, jit_attach() fails and $c keeps using the
+   interpreter. */
+
+/* Attaches a translator to $c, run() then uses it for every call that has
+   no $stop.breakpoint. Returns false (and leaves $c untouched) if native code
+   cannot be generated on this host. */
+bool jit_attach(Computer* c);
+
+/* Releases the translator of $c, if any. Called by free_computer(). */
+void jit_detach(Computer* c);
+
+/* Throws away every translated block of $c. store_word() calls this
+   when the guest writes into translated code. */
+void jit_invalidate(Computer* c);
+
+/* run() for a computer with an attached translator. */
+RunStatus jit_run(Computer* c, uint64_t max_steps, StopConditions stop);
+
+#endif
@@ -0,0 +1,170 @@
+#include "profile.h"
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define OPCODE_BEQ 0x1D
+#define OPCODE_BNE 0x1E
+
+// Zero-filled counters, only backed by memory where the program actually runs
+static uint64_t* allocate_counters(long n){
+    void* p = mmap(NULL, n * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (p == MAP_FAILED) ? NULL : (uint64_t*) p;
+}
+
+bool profile_attach(Computer* c){
+    assert(c);
+
+    if(c->profile != NULL){
+        return true;
+    }
+
+    Profile* profile = calloc(1, sizeof(Profile));
+    if(profile == NULL){
+        return false;
+    }
+
+    profile->slots = c->cache_slots;
+    profile->counts = allocate_counters(profile->slots);
+    profile->taken = allocate_counters(profile->slots);
+
+    if(profile->counts == NULL || profile->taken == NULL){
+        if(profile->counts != NULL){
+            munmap(profile->counts, profile->slots * sizeof(uint64_t));
+        }
+        if(profile->taken != NULL){
+            munmap(profile->taken, profile->slots * sizeof(uint64_t));
+        }
+        free(profile);
+        return false;
+    }
+
+    c->profile = profile;
+    return true;
+}
+
+void profile_detach(Computer* c){
+    assert(c);
+
+    Profile* profile = c->profile;
+    if(profile == NULL){
+        return;
+    }
+
+    munmap(profile->counts, profile->slots * sizeof(uint64_t));
+    munmap(profile->taken, profile->slots * sizeof(uint64_t));
+    free(profile);
+    c->profile = NULL;
+}
+
+static double percent(uint64_t part, uint64_t total){
+    return (total == 0) ? 0.0 : 100.0 * part / total;
+}
+
+// Name of $opcode, as disassemble() writes it
+static void opcode_name(int opcode, char* buf){
+    disassemble(opcode << 26, buf);
+    char* args = strchr(buf, '(');
+    if(args != NULL){
+        *args = '\0';
+    }
+}
+
+static void report_opcodes(Profile* profile, FILE* out){
+    int order[64];
+    int n = 0;
+
+    // Executed opcodes, most executed first
+    for(int op = 0; op < 64; op++){
+        if(profile->opcodes[op] == 0){
+            continue;
+        }
+        int i = n++;
+        while(i > 0 && profile->opcodes[order[i - 1]] < profile->opcodes[op]){
+            order[i] = order[i - 1];
+            i--;
+        }
+        order[i] = op;
+    }
+
+    fprintf(out, "\n%-10s %14s %8s\n", "Opcode", "executed", "share");
+    for(int i = 0; i < n; i++){
+        char name[64];
+        opcode_name(order[i], name);
+        fprintf(out, "%-10s %14lu %7.2f%%\n", name, (unsigned long) profile->opcodes[order[i]],
+                percent(profile->opcodes[order[i]], profile->instructions));
+    }
+}
+
+static void report_hottest(Computer* c, Profile* profile, FILE* out, int top){
+    long* hottest = malloc(top * sizeof(long));
+    if(hottest == NULL){
+        return;
+    }
+    int n = 0;
+
+    // Keeps the $top most executed slots, most executed first
+    for(long slot = 0; slot < profile->slots; slot++){
+        uint64_t count = profile->counts[slot];
+        if(count == 0 || (n == top && count <= profile->counts[hottest[n - 1]])){
+            continue;
+        }
+        int i = (n < top) ? n++ : n - 1;
+        while(i > 0 && profile->counts[hottest[i - 1]] < count){
+            hottest[i] = hottest[i - 1];
+            i--;
+        }
+        hottest[i] = slot;
+    }
+
+    fprintf(out, "\n%-8s %14s %8s %8s  %s\n", "Address", "executed", "share", "taken", "Instruction");
+    for(int i = 0; i < n; i++){
+        long addr = hottest[i] * 4;
+        uint64_t count = profile->counts[hottest[i]];
+        int instruction = get_word(c, addr);
+
+        char disassembly[64];
+        disassemble(instruction, disassembly);
+
+        // The share of taken branches is only meaningful for the instruction currently at $addr
+        int opcode = (instruction >> 26) & 0x3F;
+        char taken[16] = "";
+        if(opcode == OPCODE_BEQ || opcode == OPCODE_BNE){
+            snprintf(taken, sizeof(taken), "%.2f%%", percent(profile->taken[hottest[i]], count));
+        }
+
+        fprintf(out, "%.8lx %14lu %7.2f%% %8s  %s\n", addr, (unsigned long) count,
+                percent(count, profile->instructions), taken, disassembly);
+    }
+
+    free(hottest);
+}
+
+void profile_report(Computer* c, FILE* out, int top){
+    assert(c && out);
+
+    Profile* profile = c->profile;
+    if(profile == NULL){
+        return;
+    }
+
+    fprintf(out, "Profile of %lu instructions\n", (unsigned long) profile->instructions);
+    fprintf(out, "Kernel mode: %lu instructions (%.2f%%), %lu interrupts\n",
+            (unsigned long) profile->kernel_instructions,
+            percent(profile->kernel_instructions, profile->instructions),
+            (unsigned long) profile->interrupts);
+
+    fprintf(out, "\n%-10s %14s %8s\n", "Branch", "executed", "taken");
+    for(int b = 0; b < 2; b++){
+        uint64_t executed = profile->branches[b][0] + profile->branches[b][1];
+        fprintf(out, "%-10s %14lu %7.2f%%\n", (b == 0) ? "BEQ" : "BNE",
+                (unsigned long) executed, percent(profile->branches[b][1], executed));
+    }
+
+    report_opcodes(profile, out);
+
+    if(top > 0){
+        report_hottest(c, profile, out, top);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef PROFILE_H__
+#define PROFILE_H__
+
+#include "emulator.h"
+
+/* Optional execution profiler. While a profile is attached to a computer,
+   run() executes every instruction with the interpreter, without the JIT
+   nor fused sequences, and records it. Without one, run() only pays for
+   a test per call.
+
+   Kernel mode is accounted by address: every instruction of kernel
+   memory, the interrupt handler included, counts as kernel time. */
+
+typedef struct Profile{
+    uint64_t* counts; // executions of the instruction at each 4-byte slot of memory
+    uint64_t* taken; // branches taken by the BEQ/BNE at each slot
+    long slots;
+
+    uint64_t instructions; // executed since profile_attach()
+    uint64_t opcodes[64]; // executions of each opcode, invalid instructions count as opcode 0x3F
+    uint64_t branches[2][2]; // [BEQ, BNE][not taken, taken]
+    uint64_t kernel_instructions; // executed from kernel memory
+    uint64_t interrupts; // handed to the interrupt handler
+} Profile;
+
+/* Attaches an empty profile to $c. Returns false if it cannot be
+   allocated. */
+bool profile_attach(Computer* c);
+
+/* Releases the profile of $c, if any. Called by free_computer(). */
+void profile_detach(Computer* c);
+
+/* Writes the profile of $c to $out: totals, kernel time, branches, the
+   opcode histogram and the $top most executed addresses with their
+   disassembly. */
+void profile_report(Computer* c, FILE* out, int top);
+
+#endif
@@ -0,0 +1,218 @@
+#include "trace.h"
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#define TRACE_BUFFER_SZ (256 * 1024)
+
+// Part of the stream, filled by the CPU thread then written by the writer thread
+typedef struct TraceBuffer{
+    struct TraceBuffer* next;
+    size_t size;
+    unsigned char data[TRACE_BUFFER_SZ];
+} TraceBuffer;
+
+// Writes the buffers handed over by the CPU thread, until trace_stop()
+static void* write_trace(void* arg){
+    Trace* t = arg;
+
+    pthread_mutex_lock(&t->lock);
+    while(true){
+        while(t->full == NULL && !t->stopping){
+            pthread_cond_wait(&t->ready, &t->lock);
+        }
+        if(t->full == NULL){
+            break;
+        }
+
+        TraceBuffer* buffer = t->full;
+        t->full = buffer->next;
+        if(t->full == NULL){
+            t->full_last = NULL;
+        }
+        bool failed = t->failed;
+        pthread_mutex_unlock(&t->lock);
+
+        // Compression and I/O happen outside of the lock, the CPU thread never waits for them
+        if(!failed && buffer->size > 0 && gzwrite(t->file, buffer->data, buffer->size) != (int) buffer->size){
+            failed = true;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        t->failed = failed;
+        buffer->next = t->spare;
+        t->spare = buffer;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+// A buffer to fill, NULL if memory ran out
+static TraceBuffer* take_buffer(Trace* t){
+    pthread_mutex_lock(&t->lock);
+    TraceBuffer* buffer = t->spare;
+    if(buffer != NULL){
+        t->spare = buffer->next;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if(buffer == NULL){
+        buffer = malloc(sizeof(TraceBuffer));
+    }
+    return buffer;
+}
+
+static void fill(Trace* t, TraceBuffer* buffer){
+    t->buffer = buffer;
+    t->cursor = buffer->data;
+    t->limit = buffer->data + TRACE_BUFFER_SZ - TRACE_MAX_STEP_SZ;
+}
+
+// Queues the buffer being filled for the writer thread
+static void queue_buffer(Trace* t){
+    TraceBuffer* buffer = t->buffer;
+    buffer->size = t->cursor - buffer->data;
+    buffer->next = NULL;
+
+    pthread_mutex_lock(&t->lock);
+    if(t->full_last != NULL){
+        t->full_last->next = buffer;
+    }
+    else{
+        t->full = buffer;
+    }
+    t->full_last = buffer;
+    pthread_cond_signal(&t->ready);
+    pthread_mutex_unlock(&t->lock);
+}
+
+void trace_hand_over(Trace* t){
+    TraceBuffer* next = take_buffer(t);
+
+    // Without memory for another buffer, the current one is dropped and filled again
+    if(next == NULL){
+        pthread_mutex_lock(&t->lock);
+        t->failed = true;
+        pthread_mutex_unlock(&t->lock);
+        t->cursor = t->buffer->data;
+        return;
+    }
+
+    queue_buffer(t);
+    fill(t, next);
+}
+
+static void put_le32(Trace* t, uint32_t value){
+    for(int i = 0; i < 4; i++){
+        *t->cursor++ = value >> (8 * i);
+    }
+}
+
+static void free_trace(Trace* t){
+    while(t->spare != NULL){
+        TraceBuffer* next = t->spare->next;
+        free(t->spare);
+        t->spare = next;
+    }
+    free(t->buffer);
+    if(t->known != NULL){
+        munmap(t->known, t->slots);
+    }
+    free(t);
+}
+
+bool trace_start(Computer* c, const char* path){
+    assert(c && path);
+
+    if(c->trace != NULL){
+        return false;
+    }
+
+    Trace* t = calloc(1, sizeof(Trace));
+    if(t == NULL){
+        return false;
+    }
+
+    t->slots = c->cache_slots;
+    t->known = mmap(NULL, t->slots, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(t->known == MAP_FAILED){
+        t->known = NULL;
+        free_trace(t);
+        return false;
+    }
+
+    t->buffer = malloc(sizeof(TraceBuffer));
+    if(t->buffer == NULL){
+        free_trace(t);
+        return false;
+    }
+    fill(t, t->buffer);
+
+    // Fastest compression level: the stream is very redundant and the writer must keep up
+    t->file = gzopen(path, "wb1");
+    if(t->file == NULL){
+        free_trace(t);
+        return false;
+    }
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->ready, NULL);
+    if(pthread_create(&t->writer, NULL, write_trace, t) != 0){
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->ready);
+        gzclose(t->file);
+        free_trace(t);
+        return false;
+    }
+
+    // Header, the state the records apply to
+    memcpy(t->cursor, TRACE_MAGIC, strlen(TRACE_MAGIC));
+    t->cursor += strlen(TRACE_MAGIC);
+    put_le32(t, c->program_memory_size);
+    put_le32(t, c->video_memory_size);
+    put_le32(t, c->kernel_memory_size);
+    put_le32(t, c->cpu.program_counter);
+    for(int i = 0; i < 32; i++){
+        put_le32(t, c->cpu.registers[i]);
+    }
+
+    memcpy(t->registers, c->cpu.registers, sizeof(t->registers));
+    t->next_pc = c->cpu.program_counter;
+    t->pending_register = -1;
+
+    c->trace = t;
+    return true;
+}
+
+bool trace_stop(Computer* c){
+    assert(c);
+
+    Trace* t = c->trace;
+    if(t == NULL){
+        return true;
+    }
+    c->trace = NULL;
+
+    queue_buffer(t);
+    t->buffer = NULL;
+
+    pthread_mutex_lock(&t->lock);
+    t->stopping = true;
+    pthread_cond_signal(&t->ready);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->writer, NULL);
+
+    bool written = !t->failed;
+    if(gzclose(t->file) != Z_OK){
+        written = false;
+    }
+
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->ready);
+    free_trace(t);
+
+    return written;
+}
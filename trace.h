@@ -0,0 +1,178 @@
+#ifndef TRACE_H__
+#define TRACE_H__
+
+#include <pthread.h>
+#include "emulator.h"
+
+/* Optional execution trace. While a trace is attached to a computer,
+   run() executes every instruction with the interpreter, without the JIT
+   nor fused sequences, and appends what it retires to a compact binary
+   stream. A background thread compresses (gzip) and writes the stream,
+   the CPU thread only hands it full buffers and never waits for I/O:
+   new buffers are allocated when the writer falls behind.
+
+   The stream starts with a header:
+       "BETATRC1", then as 32-bit little-endian words the program, video
+       and kernel memory sizes, the PC and registers R0 to R31
+   followed by records, each starting with a tag byte whose 3 low bits
+   are its type. Numbers are LEB128 varints, signed ones zigzag-encoded:
+       TRACE_STEP       an instruction retires. If bit 3 of the tag is
+                        set, it is followed by the signed distance from
+                        the address after the previous instruction,
+                        otherwise it is that address.
+       TRACE_CODE       the instruction word at the address of the last
+                        step (given the first time it is executed and
+                        after it is written to)
+       TRACE_REGISTER   register (tag >> 3) changed by the last step,
+                        followed by the signed difference with its
+                        previous value
+       TRACE_MEMORY     store of the last step, followed by the signed
+                        distance from the previous stored address and
+                        the stored word
+       TRACE_INTERRUPT  interrupt handed to the handler, followed by its
+                        number and character bytes. The next register
+                        record is XP, the next step the handler.
+   The register written by an instruction is recorded with the next
+   record of the stream, all records between two steps belong to the
+   first one. */
+
+#define TRACE_MAGIC "BETATRC1"
+
+enum{
+    TRACE_STEP = 0,
+    TRACE_CODE,
+    TRACE_REGISTER,
+    TRACE_MEMORY,
+    TRACE_INTERRUPT
+};
+
+#define TRACE_STEP_JUMP 0x08 // the step is not at the address following the previous one
+
+// Opcodes whose instruction writes RC: LD, JMP, BEQ, BNE, LDR and the operate class
+#define TRACE_WRITES_RC ((1ULL << 0x18) | (1ULL << 0x1B) | (1ULL << 0x1D) | (1ULL << 0x1E) | \
+                         (1ULL << 0x1F) | (0x7FFFFFFFULL << 0x20))
+
+// Room left in a buffer for the records of an instruction, past which it is handed to the writer
+#define TRACE_MAX_STEP_SZ 64
+
+struct TraceBuffer;
+
+typedef struct Trace{
+    unsigned char* cursor; // next free byte of the buffer being filled
+    unsigned char* limit; // handed to the writer once $cursor is past this
+    struct TraceBuffer* buffer;
+
+    long next_pc; // address following the last step
+    long last_address; // of the last store
+    int registers[32]; // values as last recorded
+    int pending_register; // written by the last step but not recorded yet, -1 for none
+    unsigned char* known; // per 4-byte slot: its instruction word is in the trace
+    long slots;
+
+    // Shared with the writer thread
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct TraceBuffer* full; // oldest buffer waiting to be written
+    struct TraceBuffer* full_last;
+    struct TraceBuffer* spare; // buffers already written, to be filled again
+    bool stopping;
+    bool failed; // a write failed, the rest of the trace is dropped
+    void* file; // gzFile
+} Trace;
+
+/* Starts tracing the execution of $c into the file at $path (replaced).
+   Returns false, and leaves $c untouched, if it cannot be created. */
+bool trace_start(Computer* c, const char* path);
+
+/* Stops tracing $c, once everything was written. Returns false if
+   part of the trace could not be written. Called by free_computer(). */
+bool trace_stop(Computer* c);
+
+/* Hands the buffer being filled to the writer thread and starts a new
+   one, for the CPU thread when $cursor went past $limit. */
+void trace_hand_over(Trace* t);
+
+/* Appending to the stream, for the interpreter */
+
+static inline void trace_put_varint(Trace* t, uint32_t value){
+    while(value >= 0x80){
+        *t->cursor++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *t->cursor++ = value;
+}
+
+static inline void trace_put_signed(Trace* t, int32_t value){
+    trace_put_varint(t, ((uint32_t) value << 1) ^ (uint32_t) (value >> 31));
+}
+
+// Records the register written by the last step, $r holds the registers after it
+static inline void trace_retire(Trace* t, const int* r){
+    int reg = t->pending_register;
+    if(reg < 0){
+        return;
+    }
+
+    t->pending_register = -1;
+    if(r[reg] != t->registers[reg]){
+        *t->cursor++ = TRACE_REGISTER | (reg << 3);
+        trace_put_signed(t, (int32_t) ((uint32_t) r[reg] - (uint32_t) t->registers[reg]));
+        t->registers[reg] = r[reg];
+    }
+}
+
+// Forgets the instruction words of the slots covered by [$addr, $addr + 4)
+static inline void trace_forget_code(Trace* t, long addr){
+    unsigned long slot = (unsigned long) addr >> 2;
+    if(slot < (unsigned long) t->slots){
+        t->known[slot] = 0;
+    }
+    slot = (unsigned long) (addr + 3) >> 2;
+    if(slot < (unsigned long) t->slots){
+        t->known[slot] = 0;
+    }
+}
+
+/* Records the step of the instruction of $c at $pc which will write
+   register $rc if it is not -1 */
+static inline void trace_step(Trace* t, Computer* c, long pc, int rc){
+    if(pc == t->next_pc){
+        *t->cursor++ = TRACE_STEP;
+    }
+    else{
+        *t->cursor++ = TRACE_STEP | TRACE_STEP_JUMP;
+        trace_put_signed(t, (int32_t) (pc - t->next_pc));
+    }
+    t->next_pc = pc + 4;
+
+    unsigned long slot = (unsigned long) pc >> 2;
+    if((pc & 3) != 0 || slot >= (unsigned long) t->slots || !t->known[slot]){
+        *t->cursor++ = TRACE_CODE;
+        trace_put_varint(t, (uint32_t) get_word(c, pc));
+        if((pc & 3) == 0 && slot < (unsigned long) t->slots){
+            t->known[slot] = 1;
+        }
+    }
+
+    t->pending_register = rc;
+}
+
+static inline void trace_store(Trace* t, long addr, int word){
+    *t->cursor++ = TRACE_MEMORY;
+    trace_put_signed(t, (int32_t) (addr - t->last_address));
+    trace_put_varint(t, (uint32_t) word);
+    t->last_address = addr;
+    trace_forget_code(t, addr);
+}
+
+// Records an interrupt handed to the handler, before XP is set
+static inline void trace_interrupt(Trace* t, const int* r, char nb, char character){
+    trace_retire(t, r);
+    *t->cursor++ = TRACE_INTERRUPT;
+    *t->cursor++ = (unsigned char) nb;
+    *t->cursor++ = (unsigned char) character;
+    t->pending_register = 30;
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "emulator.h"
+#include "trace.h"
+
+/* Round trip of an execution trace: runs a small program with a trace
+   attached, reads the trace back as tracedump does and checks that the
+   memory it rebuilds is the memory of the computer. Exits with 0 if it
+   is, 1 otherwise.
+
+   The program stores into kernel memory through LDR, which the machine
+   executes as a store when its address is in kernel memory. */
+
+#define PROGRAM_SZ 1024
+#define VIDEO_SZ 1024
+#define KERNEL_SZ 4096
+
+#define KERNEL_START (PROGRAM_SZ + VIDEO_SZ)
+#define STORED_ADDRESS (KERNEL_START + 420) // past the kernel data, in the handler area
+#define STORED_WORD 0x1234
+
+static int enc(int opcode, int rc, int ra, int literal){
+    return (opcode << 26) | (rc << 21) | (ra << 16) | (literal & 0xFFFF);
+}
+
+static bool read_varint(gzFile file, uint32_t* value){
+    *value = 0;
+    for(int shift = 0; shift < 35; shift += 7){
+        int byte = gzgetc(file);
+        if(byte < 0){
+            return false;
+        }
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+        if(!(byte & 0x80)){
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_signed(gzFile file, int32_t* value){
+    uint32_t u;
+    if(!read_varint(file, &u)){
+        return false;
+    }
+    *value = (int32_t) (u >> 1) ^ -(int32_t) (u & 1);
+    return true;
+}
+
+/* Rebuilds the stores of the trace at $path into $memory, of $size bytes,
+   and the registers into $registers. Returns false if it cannot be read. */
+static bool replay(const char* path, int* memory, long size, int* registers){
+    gzFile file = gzopen(path, "rb");
+    if(file == NULL){
+        return false;
+    }
+
+    // Magic, memory sizes, PC, then the registers
+    unsigned char header[8 + 4 * 4 + 32 * 4];
+    if(gzread(file, header, sizeof(header)) != sizeof(header) || memcmp(header, TRACE_MAGIC, 8) != 0){
+        gzclose(file);
+        return false;
+    }
+    for(int i = 0; i < 32; i++){
+        const unsigned char* p = header + 8 + 4 * 4 + 4 * i;
+        registers[i] = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned) p[3] << 24);
+    }
+
+    long last_address = 0;
+    bool ok = true;
+    int tag;
+    while(ok && (tag = gzgetc(file)) >= 0){
+        int32_t delta;
+        uint32_t value;
+
+        switch(tag & 0x07){
+            case TRACE_STEP:
+                ok = !(tag & TRACE_STEP_JUMP) || read_signed(file, &delta);
+                break;
+            case TRACE_CODE:
+                ok = read_varint(file, &value);
+                break;
+            case TRACE_REGISTER:
+                ok = (tag >> 3) <= 30 && read_signed(file, &delta);
+                if(ok){
+                    registers[tag >> 3] += delta;
+                }
+                break;
+            case TRACE_MEMORY:
+                ok = read_signed(file, &delta) && read_varint(file, &value);
+                last_address += delta;
+                if(ok && last_address >= 0 && last_address + 4 <= size && (last_address & 3) == 0){
+                    memory[last_address / 4] = value;
+                }
+                break;
+            case TRACE_INTERRUPT:
+                ok = gzgetc(file) >= 0 && gzgetc(file) >= 0;
+                break;
+            default:
+                ok = false;
+        }
+    }
+
+    gzclose(file);
+    return ok;
+}
+
+int main(){
+    static Computer c;
+    init_computer(&c, PROGRAM_SZ, VIDEO_SZ, KERNEL_SZ);
+
+    // The address of LDR is relative to the instruction after it, at 8
+    store_word(&c, 0, enc(0x30, 1, 31, STORED_WORD));                // ADDC(R31, STORED_WORD, R1)
+    store_word(&c, 4, enc(0x1F, 1, 31, (STORED_ADDRESS - 8) / 4));   // LDR(STORED_ADDRESS, R1), a store
+    store_word(&c, 8, enc(0x19, 1, 31, 16));                         // ST(R1, 16, R31)
+    store_word(&c, 12, 0);                                           // HALT()
+
+    char path[] = "/tmp/trace_testXXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){
+        fprintf(stderr, "Cannot create a temporary file\n");
+        return 1;
+    }
+    close(fd);
+
+    // The initial memory, as the trace only holds what changes
+    long size = c.memory_size;
+    int* memory = malloc(size);
+    for(long addr = 0; addr < size; addr += 4){
+        memory[addr / 4] = get_word(&c, addr);
+    }
+
+    if(!trace_start(&c, path)){
+        fprintf(stderr, "Cannot write %s\n", path);
+        return 1;
+    }
+    StopConditions no_stop = {.on_interrupt = false, .breakpoint = -1};
+    run(&c, 100, no_stop);
+    trace_stop(&c);
+
+    int registers[32];
+    bool read = replay(path, memory, size, registers);
+    unlink(path);
+
+    int failures = 0;
+    if(!read){
+        fprintf(stderr, "The trace cannot be read back\n");
+        failures++;
+    }
+    for(long addr = 0; read && addr < size; addr += 4){
+        if(memory[addr / 4] != get_word(&c, addr)){
+            fprintf(stderr, "Word at %.8lx: %.8x in the trace, %.8x in memory\n",
+                    addr, memory[addr / 4], get_word(&c, addr));
+            failures++;
+        }
+    }
+    for(int i = 0; read && i < 31; i++){
+        if(registers[i] != get_register(&c, i)){
+            fprintf(stderr, "%s: %.8x in the trace, %.8x in the CPU\n", reg_symbols[i], registers[i], get_register(&c, i));
+            failures++;
+        }
+    }
+    if(get_word(&c, STORED_ADDRESS) != STORED_WORD){
+        fprintf(stderr, "LDR did not store into kernel memory\n");
+        failures++;
+    }
+
+    free(memory);
+    free_computer(&c);
+
+    printf("%s\n", (failures == 0) ? "Trace round trip: OK" : "Trace round trip: FAILED");
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,272 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "emulator.h"
+#include "trace.h"
+
+/* Trace reader: replays an execution trace recorded by trace_start() (see
+   trace.h for the format) and lists the instructions it retired, with
+   their disassembly and effects. */
+
+typedef struct{
+    gzFile file;
+    long program_memory_size;
+    long video_memory_size;
+    long kernel_memory_size;
+    long next_pc; // address following the last step
+    long last_address; // of the last store
+    int registers[32];
+    uint32_t* code; // instruction word of each 4-byte slot, as last given by the trace
+    long slots;
+} Replay;
+
+// Instruction retired by the last step, or interrupt, printed once all of its effects are known
+typedef struct{
+    enum{LINE_NONE, LINE_STEP, LINE_INTERRUPT} kind;
+    long pc;
+    uint32_t word;
+    char nb;
+    char character;
+    char effects[128];
+} Line;
+
+static void usage(const char* name){
+    fprintf(stderr, "Usage: %s [options] trace\n", name);
+    fprintf(stderr, "  -n COUNT  list the COUNT first instructions only\n");
+    fprintf(stderr, "  -q        do not list instructions, only the final state\n");
+}
+
+static bool read_le32(Replay* replay, uint32_t* value){
+    unsigned char bytes[4];
+    if(gzread(replay->file, bytes, 4) != 4){
+        return false;
+    }
+    *value = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+    return true;
+}
+
+static bool read_varint(Replay* replay, uint32_t* value){
+    *value = 0;
+    for(int shift = 0; shift < 35; shift += 7){
+        int byte = gzgetc(replay->file);
+        if(byte < 0){
+            return false;
+        }
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+        if((byte & 0x80) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_signed(Replay* replay, int32_t* value){
+    uint32_t zigzag;
+    if(!read_varint(replay, &zigzag)){
+        return false;
+    }
+    *value = (int32_t) (zigzag >> 1) ^ -(int32_t) (zigzag & 1);
+    return true;
+}
+
+static bool read_header(Replay* replay){
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if(gzread(replay->file, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0){
+        return false;
+    }
+
+    uint32_t fields[4];
+    for(int i = 0; i < 4; i++){
+        if(!read_le32(replay, &fields[i])){
+            return false;
+        }
+    }
+    replay->program_memory_size = fields[0];
+    replay->video_memory_size = fields[1];
+    replay->kernel_memory_size = fields[2];
+    replay->next_pc = fields[3];
+
+    for(int i = 0; i < 32; i++){
+        uint32_t reg;
+        if(!read_le32(replay, &reg)){
+            return false;
+        }
+        replay->registers[i] = reg;
+    }
+
+    long memory_size = replay->program_memory_size + replay->video_memory_size + replay->kernel_memory_size;
+    replay->slots = (memory_size + 3) / 4;
+    replay->code = calloc(replay->slots, sizeof(uint32_t));
+    return replay->code != NULL;
+}
+
+static void append_effect(Line* line, const char* format, ...){
+    size_t len = strlen(line->effects);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line->effects + len, sizeof(line->effects) - len, format, args);
+    va_end(args);
+}
+
+static void print_line(Line* line){
+    if(line->kind == LINE_STEP){
+        char disassembly[64];
+        disassemble(line->word, disassembly);
+        printf("%.8lx  %-24s%s\n", line->pc, disassembly, line->effects);
+    }
+    else if(line->kind == LINE_INTERRUPT){
+        printf("--------  interrupt %d '%c'      %s\n", line->nb,
+               (line->character >= ' ' && line->character < 127) ? line->character : '?', line->effects);
+    }
+    line->kind = LINE_NONE;
+    line->effects[0] = '\0';
+}
+
+int main(int argc, char** argv){
+    long max_listed = -1;
+    bool quiet = false;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:qh")) != -1){
+        switch(opt){
+            case 'n': max_listed = strtol(optarg, NULL, 10); break;
+            case 'q': quiet = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if(optind != argc - 1){
+        usage(argv[0]);
+        return 1;
+    }
+
+    Replay replay = {0};
+    replay.file = gzopen(argv[optind], "rb");
+    if(replay.file == NULL){
+        fprintf(stderr, "Cannot open %s\n", argv[optind]);
+        return 1;
+    }
+    gzbuffer(replay.file, 256 * 1024);
+
+    if(!read_header(&replay)){
+        fprintf(stderr, "%s is not an execution trace\n", argv[optind]);
+        gzclose(replay.file);
+        free(replay.code);
+        return 1;
+    }
+
+    Line line = {LINE_NONE};
+    uint64_t steps = 0;
+    uint64_t interrupts = 0;
+    bool truncated = false;
+    int tag;
+
+    while((tag = gzgetc(replay.file)) >= 0){
+        bool listed = !quiet && (max_listed < 0 || steps < (uint64_t) max_listed);
+        int32_t delta;
+        uint32_t value;
+
+        switch(tag & 0x07){
+            case TRACE_STEP:{
+                long pc = replay.next_pc;
+                if(tag & TRACE_STEP_JUMP){
+                    if(!read_signed(&replay, &delta)){
+                        truncated = true;
+                        break;
+                    }
+                    pc += delta;
+                }
+                replay.next_pc = pc + 4;
+                steps++;
+
+                print_line(&line);
+                line.kind = listed ? LINE_STEP : LINE_NONE;
+                line.pc = pc;
+                line.word = ((pc & 3) == 0 && pc / 4 < replay.slots) ? replay.code[pc / 4] : 0;
+                break;
+            }
+
+            case TRACE_CODE:
+                if(!read_varint(&replay, &value)){
+                    truncated = true;
+                    break;
+                }
+                line.word = value;
+                if((line.pc & 3) == 0 && line.pc / 4 < replay.slots){
+                    replay.code[line.pc / 4] = value;
+                }
+                break;
+
+            case TRACE_REGISTER:{
+                int reg = tag >> 3;
+                if(reg > 30 || !read_signed(&replay, &delta)){
+                    truncated = true;
+                    break;
+                }
+                replay.registers[reg] = (int) ((uint32_t) replay.registers[reg] + (uint32_t) delta);
+                if(line.kind != LINE_NONE){
+                    append_effect(&line, "  %s = %.8x", reg_symbols[reg], replay.registers[reg]);
+                }
+                break;
+            }
+
+            case TRACE_MEMORY:
+                if(!read_signed(&replay, &delta) || !read_varint(&replay, &value)){
+                    truncated = true;
+                    break;
+                }
+                replay.last_address += delta;
+                if(line.kind != LINE_NONE){
+                    append_effect(&line, "  [%.8lx] = %.8x", replay.last_address, (int) value);
+                }
+                break;
+
+            case TRACE_INTERRUPT:{
+                int nb = gzgetc(replay.file);
+                int character = gzgetc(replay.file);
+                if(nb < 0 || character < 0){
+                    truncated = true;
+                    break;
+                }
+                interrupts++;
+
+                print_line(&line);
+                if(listed){
+                    line.kind = LINE_INTERRUPT;
+                    line.nb = nb;
+                    line.character = character;
+                }
+                break;
+            }
+
+            default:
+                truncated = true;
+        }
+
+        if(truncated){
+            break;
+        }
+    }
+    print_line(&line);
+
+    if(truncated || !gzeof(replay.file)){
+        fprintf(stderr, "%s is truncated or corrupted\n", argv[optind]);
+    }
+
+    printf("\n%lu instructions, %lu interrupts\n", (unsigned long) steps, (unsigned long) interrupts);
+    for(int i = 0; i < 32; i++){
+        printf("%-3s = %.8x%s", reg_symbols[i], replay.registers[i], (i % 4 == 3) ? "\n" : "  ");
+    }
+    if(steps > 0){
+        printf("Last instruction at %.8lx\n", replay.next_pc - 4);
+    }
+
+    gzclose(replay.file);
+    free(replay.code);
+
+    return truncated ? 1 : 0;
+}